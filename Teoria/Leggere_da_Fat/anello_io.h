@@ -0,0 +1,206 @@
+#ifndef ANELLO_IO_H
+#define ANELLO_IO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+
+// AnelloIo e' un io_uring usato direttamente con le chiamate di sistema,
+// senza liburing: la coda di invio (SQ), quella dei completamenti (CQ) e
+// l'array delle richieste sono mappati in memoria e condivisi col kernel.
+typedef struct
+{
+    int fd;
+
+    unsigned *sq_testa;
+    unsigned *sq_coda;
+    unsigned *sq_maschera;
+    unsigned *sq_indici;
+    struct io_uring_sqe *richieste;
+
+    unsigned *cq_testa;
+    unsigned *cq_coda;
+    unsigned *cq_maschera;
+    struct io_uring_cqe *completamenti;
+
+    void *mappa_sq;
+    unsigned long byte_sq;
+    void *mappa_cq;
+    unsigned long byte_cq;
+    void *mappa_richieste;
+    unsigned long byte_richieste;
+
+    // Richieste scritte nella SQ ma non ancora passate al kernel
+    unsigned da_inviare;
+
+    // Chiamate a io_uring_enter fatte finora
+    unsigned long ingressi;
+} AnelloIo;
+
+
+inline void distruggi_anello(AnelloIo *anello)
+{
+    if (anello->mappa_richieste != NULL)
+        munmap(anello->mappa_richieste, anello->byte_richieste);
+    if (anello->mappa_cq != NULL && anello->mappa_cq != anello->mappa_sq)
+        munmap(anello->mappa_cq, anello->byte_cq);
+    if (anello->mappa_sq != NULL)
+        munmap(anello->mappa_sq, anello->byte_sq);
+    if (anello->fd >= 0)
+        close(anello->fd);
+    memset(anello, 0, sizeof(AnelloIo));
+    anello->fd = -1;
+}
+
+
+/**
+ * crea_anello prepara un io_uring con almeno profondita posti nella SQ.
+ *
+ * @returns -1 se io_uring non e' disponibile (kernel vecchio, seccomp...), 0 altrimenti
+ */
+inline int crea_anello(AnelloIo *anello, unsigned profondita)
+{
+    memset(anello, 0, sizeof(AnelloIo));
+
+    struct io_uring_params parametri;
+    memset(&parametri, 0, sizeof(parametri));
+    anello->fd = syscall(__NR_io_uring_setup, profondita, &parametri);
+    if (anello->fd < 0)
+        return -1;
+
+    anello->byte_sq = parametri.sq_off.array + parametri.sq_entries * sizeof(unsigned);
+    anello->byte_cq = parametri.cq_off.cqes + parametri.cq_entries * sizeof(struct io_uring_cqe);
+
+    // con IORING_FEAT_SINGLE_MMAP le due code stanno nella stessa mappatura
+    if (parametri.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (anello->byte_cq > anello->byte_sq)
+            anello->byte_sq = anello->byte_cq;
+        anello->byte_cq = anello->byte_sq;
+    }
+
+    void *sq = mmap(NULL, anello->byte_sq, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    anello->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+    {
+        distruggi_anello(anello);
+        return -1;
+    }
+    anello->mappa_sq = sq;
+
+    void *cq = sq;
+    if (!(parametri.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq = mmap(NULL, anello->byte_cq, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  anello->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+        {
+            distruggi_anello(anello);
+            return -1;
+        }
+    }
+    anello->mappa_cq = cq;
+
+    anello->byte_richieste = parametri.sq_entries * sizeof(struct io_uring_sqe);
+    void *richieste = mmap(NULL, anello->byte_richieste, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           anello->fd, IORING_OFF_SQES);
+    if (richieste == MAP_FAILED)
+    {
+        distruggi_anello(anello);
+        return -1;
+    }
+    anello->mappa_richieste = richieste;
+    anello->richieste = (struct io_uring_sqe *)richieste;
+
+    unsigned char *s = (unsigned char *)sq;
+    anello->sq_testa = (unsigned *)(s + parametri.sq_off.head);
+    anello->sq_coda = (unsigned *)(s + parametri.sq_off.tail);
+    anello->sq_maschera = (unsigned *)(s + parametri.sq_off.ring_mask);
+    anello->sq_indici = (unsigned *)(s + parametri.sq_off.array);
+
+    unsigned char *c = (unsigned char *)cq;
+    anello->cq_testa = (unsigned *)(c + parametri.cq_off.head);
+    anello->cq_coda = (unsigned *)(c + parametri.cq_off.tail);
+    anello->cq_maschera = (unsigned *)(c + parametri.cq_off.ring_mask);
+    anello->completamenti = (struct io_uring_cqe *)(c + parametri.cq_off.cqes);
+    return 0;
+}
+
+
+/**
+ * accoda_operazione scrive una lettura o una scrittura nella SQ. Il kernel
+ * la vede solo alla prossima invia_e_attendi.
+ *
+ * @param codice IORING_OP_READ o IORING_OP_WRITE
+ * @param dato Restituito cosi' com'e' nel completamento
+ */
+inline void accoda_operazione(AnelloIo *anello, uint8_t codice, int fd, const void *indirizzo,
+                              unsigned lunghezza, unsigned long posizione, uint64_t dato)
+{
+    unsigned coda = *anello->sq_coda;
+    unsigned indice = coda & *anello->sq_maschera;
+
+    struct io_uring_sqe *sqe = &anello->richieste[indice];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = codice;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)indirizzo;
+    sqe->len = lunghezza;
+    sqe->off = posizione;
+    sqe->user_data = dato;
+
+    anello->sq_indici[indice] = indice;
+    __atomic_store_n(anello->sq_coda, coda + 1, __ATOMIC_RELEASE);
+    anello->da_inviare++;
+}
+
+
+/**
+ * invia_e_attendi passa al kernel le richieste accodate e aspetta che ne
+ * sia completata almeno minimo.
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+inline int invia_e_attendi(AnelloIo *anello, unsigned minimo)
+{
+    for (;;)
+    {
+        long n = syscall(__NR_io_uring_enter, anello->fd, anello->da_inviare, minimo,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+        anello->ingressi++;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        anello->da_inviare -= n;
+        return 0;
+    }
+}
+
+
+/**
+ * prossimo_completamento toglie un completamento dalla CQ, se ce n'e' uno.
+ *
+ * @param risultato Byte trasferiti, o -errno
+ *
+ * @returns 1 se ha trovato un completamento, 0 se la CQ e' vuota
+ */
+inline int prossimo_completamento(AnelloIo *anello, uint64_t *dato, int *risultato)
+{
+    unsigned testa = *anello->cq_testa;
+    if (testa == __atomic_load_n(anello->cq_coda, __ATOMIC_ACQUIRE))
+        return 0;
+
+    const struct io_uring_cqe *cqe = &anello->completamenti[testa & *anello->cq_maschera];
+    *dato = cqe->user_data;
+    *risultato = cqe->res;
+    __atomic_store_n(anello->cq_testa, testa + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+#endif
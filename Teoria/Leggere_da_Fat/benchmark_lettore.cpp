@@ -0,0 +1,550 @@
+// Benchmark del lettore su immagini sintetiche FAT12/16/32: apertura,
+// elenco, esportazione JSONL, controllo ed estrazione completa, con mmap e con pread.
+// Per ogni operazione riporta voci/s, MB/s e le chiamate di sistema di
+// I/O (read e write di /proc/self/io), cosi' si vedono le regressioni.
+// Le letture e scritture fatte da io_uring non compaiono in quel
+// conteggio: per l'estrazione con io_uring si sommano le chiamate a
+// io_uring_enter, e la riga lo dice.
+// Prima delle misure alcune verifiche di andata e ritorno controllano che
+// il lettore ritrovi quanto scritto o spostato dagli altri strumenti;
+// se una fallisce il benchmark non parte.
+//
+// g++ -O2 -pthread -o benchmark_lettore benchmark_lettore.cpp
+// ./benchmark_lettore [cartella di lavoro] [ripetizioni]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ftw.h>
+
+#include "immagine.h"
+#include "fat.h"
+#include "esplora.h"
+#include "controllo.h"
+#include "estrai_tutto.h"
+#include "generatore.h"
+#include "uscita.h"
+#include "impronte.h"
+#include "scrittura.h"
+#include "deframmenta.h"
+#include "partizioni.h"
+
+
+// Le immagini del benchmark: piccole abbastanza da generarle ogni volta
+static const struct
+{
+    const char *nome;
+    ParametriImmagine parametri;
+} immagini[] = {
+    {"fat12", {12, 2ul << 20, 512, 150, 2, 0, 4096, 1}},
+    {"fat16", {16, 64ul << 20, 2048, 4000, 4, 0, 8192, 2}},
+    {"fat16_framm", {16, 64ul << 20, 2048, 4000, 4, 40, 8192, 3}},
+    {"fat32", {32, 320ul << 20, 2048, 10000, 6, 0, 12288, 4}},
+    {"fat32_framm", {32, 320ul << 20, 2048, 10000, 6, 40, 12288, 5}},
+};
+
+
+double secondi()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+// chiamate_io somma le chiamate read e write fatte finora da tutto il processo
+unsigned long chiamate_io()
+{
+    FILE *io = fopen("/proc/self/io", "r");
+    if (io == NULL)
+        return 0;
+
+    char chiave[32];
+    unsigned long valore, totale = 0;
+    while (fscanf(io, "%31s %lu", chiave, &valore) == 2)
+        if (strcmp(chiave, "syscr:") == 0 || strcmp(chiave, "syscw:") == 0)
+            totale += valore;
+    fclose(io);
+    return totale;
+}
+
+
+// La misura migliore di un'operazione su tutte le ripetizioni
+typedef struct
+{
+    double tempo;
+    unsigned long voci;
+    unsigned long byte;
+    unsigned long chiamate;
+
+    // 1 se le chiamate comprendono gli io_uring_enter dell'estrazione
+    int anello;
+} Misura;
+
+
+void stampa(const char *immagine, const char *accesso, const char *operazione, const Misura *m)
+{
+    printf("%-12s %-6s %-10s %8lu voci %9.2f ms %11.0f voci/s", immagine, accesso, operazione,
+           m->voci, m->tempo * 1e3, m->voci / m->tempo);
+    if (m->byte > 0)
+        printf(" %8.1f MB/s", m->byte / m->tempo / 1e6);
+    else
+        printf(" %8s     ", "-");
+    printf(" %8lu syscall%s\n", m->chiamate, m->anello ? " (con io_uring_enter)" : "");
+}
+
+
+void registra(Misura *m, double inizio, unsigned long chiamate_prima, unsigned long voci, unsigned long byte)
+{
+    double tempo = secondi() - inizio;
+    if (m->tempo == 0 || tempo < m->tempo)
+    {
+        m->tempo = tempo;
+        m->chiamate = chiamate_io() - chiamate_prima;
+    }
+    m->voci = voci;
+    m->byte = byte;
+}
+
+
+int rimuovi(const char *percorso, const struct stat *, int, struct FTW *)
+{
+    return remove(percorso);
+}
+
+
+/**
+ * misura_immagine esegue tutte le operazioni su un'immagine gia' generata.
+ *
+ * @returns -1 se l'immagine non si apre, 0 altrimenti
+ */
+int misura_immagine(const char *nome, const char *percorso, const char *cartella, int usa_mmap, int ripetizioni)
+{
+    Misura apertura = {0, 0, 0, 0, 0}, elenco = {0, 0, 0, 0, 0}, esportazione = {0, 0, 0, 0, 0};
+    Misura controllo = {0, 0, 0, 0, 0}, estrazione = {0, 0, 0, 0, 0};
+    unsigned numero_thread = std::thread::hardware_concurrency();
+    FILE *nulla = fopen("/dev/null", "w");
+
+    for (int r = 0; r < ripetizioni; r++)
+    {
+        double inizio = secondi();
+        unsigned long chiamate = chiamate_io();
+        Immagine *img = apri_immagine(percorso, usa_mmap);
+        Volume vol;
+        if (img == NULL || leggi_volume(img, &vol) != 0)
+        {
+            if (img != NULL)
+                chiudi_immagine(img);
+            fclose(nulla);
+            return -1;
+        }
+        attiva_cache(img, vol.byte_per_settore, 4096);
+        TabellaFat *fat = carica_tabella_fat(img, &vol);
+        registra(&apertura, inizio, chiamate, 1, vol.bytes_per_fat);
+        if (fat == NULL)
+        {
+            chiudi_immagine(img);
+            fclose(nulla);
+            return -1;
+        }
+
+        inizio = secondi();
+        chiamate = chiamate_io();
+        std::vector<Voce> voci = esplora_albero(img, &vol, fat, numero_thread);
+        registra(&elenco, inizio, chiamate, voci.size(), 0);
+
+        inizio = secondi();
+        chiamate = chiamate_io();
+        BufferUscita out;
+        if (crea_buffer_uscita(&out, fileno(nulla)) == 0)
+        {
+            for (const Voce &voce : voci)
+                scrivi_voce(&out, FORMATO_JSONL, &voce);
+            distruggi_buffer_uscita(&out);
+            registra(&esportazione, inizio, chiamate, voci.size(), 0);
+        }
+
+        inizio = secondi();
+        chiamate = chiamate_io();
+        RisultatoControllo risultato;
+        controlla_immagine(img, &vol, fat, voci, nulla, &risultato);
+        registra(&controllo, inizio, chiamate, voci.size(), 0);
+
+        // si parte sempre da una cartella vuota
+        std::string destinazione = std::string(cartella) + "/estratti";
+        nftw(destinazione.c_str(), rimuovi, 64, FTW_DEPTH | FTW_PHYS);
+        inizio = secondi();
+        chiamate = chiamate_io();
+        RisultatoEstrazione estratti;
+        if (mkdir(destinazione.c_str(), 0755) == 0)
+        {
+            estrai_albero(img, &vol, fat, voci, destinazione.c_str(), 32, 1, &estratti);
+            // registra conta solo read e write: gli ingressi nell'anello si tolgono
+            // dal punto di partenza, cosi' finiscono nella differenza
+            registra(&estrazione, inizio, chiamate - estratti.ingressi_anello, estratti.file, estratti.byte);
+            if (estratti.ingressi_anello > 0)
+                estrazione.anello = 1;
+        }
+        nftw(destinazione.c_str(), rimuovi, 64, FTW_DEPTH | FTW_PHYS);
+
+        distruggi_tabella_fat(fat);
+        chiudi_immagine(img);
+    }
+
+    const char *accesso = usa_mmap ? "mmap" : "pread";
+    stampa(nome, accesso, "apertura", &apertura);
+    stampa(nome, accesso, "elenco", &elenco);
+    stampa(nome, accesso, "esportazione", &esportazione);
+    stampa(nome, accesso, "controllo", &controllo);
+    stampa(nome, accesso, "estrazione", &estrazione);
+    fclose(nulla);
+    return 0;
+}
+
+
+// VolumeAperto e' un volume letto per le verifiche: immagine, boot sector e FAT
+typedef struct
+{
+    Immagine *img;
+    Volume vol;
+    TabellaFat *fat;
+} VolumeAperto;
+
+
+/**
+ * apri_volume apre il volume che inizia al byte inizio dell'immagine.
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+int apri_volume(const char *percorso, unsigned long inizio, VolumeAperto *v)
+{
+    v->fat = NULL;
+    v->img = apri_immagine(percorso);
+    if (v->img != NULL && leggi_volume(v->img, &v->vol, inizio) == 0)
+        v->fat = carica_tabella_fat(v->img, &v->vol);
+    if (v->fat != NULL)
+        return 0;
+    if (v->img != NULL)
+        chiudi_immagine(v->img);
+    return -1;
+}
+
+
+void chiudi_volume(VolumeAperto *v)
+{
+    distruggi_tabella_fat(v->fat);
+    chiudi_immagine(v->img);
+}
+
+
+/**
+ * impronte_volume elenca l'albero di un volume e ne calcola le impronte.
+ *
+ * @returns -1 se il volume non si apre o il controllo trova problemi, 0 altrimenti
+ */
+int impronte_volume(const char *percorso, unsigned long inizio, std::vector<Voce> &voci,
+                    std::vector<ImprontaFile> &impronte)
+{
+    VolumeAperto v;
+    if (apri_volume(percorso, inizio, &v) != 0)
+        return -1;
+
+    unsigned numero_thread = std::thread::hardware_concurrency();
+    voci = esplora_albero(v.img, &v.vol, v.fat, numero_thread);
+    impronte_albero(v.img, &v.vol, v.fat, voci, numero_thread, impronte);
+
+    FILE *nulla = fopen("/dev/null", "w");
+    RisultatoControllo controllo;
+    int ret = controlla_immagine(v.img, &v.vol, v.fat, voci, nulla, &controllo) != 0 ||
+              problemi_trovati(&controllo) > 0 ? -1 : 0;
+    fclose(nulla);
+    chiudi_volume(&v);
+    return ret;
+}
+
+
+// stesso_contenuto dice se due alberi hanno gli stessi percorsi con le stesse impronte
+int stesso_contenuto(const std::vector<Voce> &voci_a, const std::vector<ImprontaFile> &impronte_a,
+                     const std::vector<Voce> &voci_b, const std::vector<ImprontaFile> &impronte_b)
+{
+    if (voci_a.size() != voci_b.size())
+        return 0;
+    for (size_t i = 0; i < voci_a.size(); i++)
+        if (voci_a[i].percorso != voci_b[i].percorso || voci_a[i].dimensione != voci_b[i].dimensione ||
+            impronte_a[i].errore || impronte_b[i].errore ||
+            memcmp(impronte_a[i].sha256, impronte_b[i].sha256, sizeof(impronte_a[i].sha256)) != 0)
+            return 0;
+    return 1;
+}
+
+
+int esito(const char *verifica, int riuscita)
+{
+    printf("verifica %-14s %s\n", verifica, riuscita ? "ok" : "FALLITA");
+    return riuscita ? 0 : 1;
+}
+
+
+/**
+ * verifica_scrittura crea directory e file con nomi lunghi in un'immagine
+ * generata, poi la rilegge: il controllo non deve trovare problemi e il
+ * file estratto deve avere il contenuto scritto.
+ *
+ * @returns 1 se la verifica fallisce, 0 altrimenti
+ */
+int verifica_scrittura(const char *cartella)
+{
+    std::string percorso = std::string(cartella) + "/verifica_scrittura.img";
+    ParametriImmagine parametri = {16, 16ul << 20, 2048, 300, 3, 30, 4096, 101};
+    std::vector<Voce> voci_prima, voci_dopo;
+    std::vector<ImprontaFile> impronte;
+    if (genera_immagine(percorso.c_str(), &parametri) != 0 ||
+        impronte_volume(percorso.c_str(), 0, voci_prima, impronte) != 0)
+        return esito("scrittura", 0);
+
+    std::vector<unsigned char> contenuto(100000);
+    for (size_t i = 0; i < contenuto.size(); i++)
+        contenuto[i] = i * 31 + (i >> 9);
+
+    const char *file = "Verifica/Sotto cartella/un file dal nome lungo.bin";
+    ScritturaFat *w = apri_scrittura(percorso.c_str());
+    int riuscita = w != NULL && crea_directory(w, "Verifica/Sotto cartella") == 0 && crea_file(w, file) == 0 &&
+                   aggiungi_a_file(w, file, contenuto.data(), contenuto.size()) == 0 &&
+                   crea_file(w, "Verifica/CORTO.TXT") == 0 &&
+                   aggiungi_a_file(w, "Verifica/CORTO.TXT", contenuto.data(), 5000) == 0 &&
+                   tronca_file(w, "Verifica/CORTO.TXT", 10) == 0 && salva_scrittura(w) == 0;
+    if (w != NULL)
+        chiudi_scrittura(w);
+
+    // due directory e due file in piu', e un controllo pulito
+    riuscita = riuscita && impronte_volume(percorso.c_str(), 0, voci_dopo, impronte) == 0 &&
+               voci_dopo.size() == voci_prima.size() + 4;
+
+    std::string destinazione = std::string(cartella) + "/verifica_estratti";
+    nftw(destinazione.c_str(), rimuovi, 64, FTW_DEPTH | FTW_PHYS);
+    VolumeAperto v;
+    if (riuscita && mkdir(destinazione.c_str(), 0755) == 0 && apri_volume(percorso.c_str(), 0, &v) == 0)
+    {
+        RisultatoEstrazione estratti;
+        estrai_albero(v.img, &v.vol, v.fat, voci_dopo, destinazione.c_str(), 32, 1, &estratti);
+        chiudi_volume(&v);
+
+        std::vector<unsigned char> letto(contenuto.size() + 1);
+        int fd = open((destinazione + "/" + file).c_str(), O_RDONLY);
+        riuscita = estratti.errori == 0 && fd >= 0 &&
+                   pread_tutto(fd, letto.data(), letto.size(), 0) == contenuto.size() &&
+                   memcmp(letto.data(), contenuto.data(), contenuto.size()) == 0;
+        if (fd >= 0)
+            close(fd);
+        struct stat corto;
+        riuscita = riuscita && stat((destinazione + "/Verifica/CORTO.TXT").c_str(), &corto) == 0 && corto.st_size == 10;
+    }
+    else
+        riuscita = 0;
+
+    nftw(destinazione.c_str(), rimuovi, 64, FTW_DEPTH | FTW_PHYS);
+    remove(percorso.c_str());
+    return esito("scrittura", riuscita);
+}
+
+
+/**
+ * verifica_deframmentazione deframmenta sul posto un'immagine FAT32 molto
+ * frammentata, come la modalita' defrag: dopo ogni catena deve essere
+ * un'unica estensione e ogni file deve avere la stessa impronta di prima.
+ *
+ * @returns 1 se la verifica fallisce, 0 altrimenti
+ */
+int verifica_deframmentazione(const char *cartella)
+{
+    std::string percorso = std::string(cartella) + "/verifica_deframmentazione.img";
+    ParametriImmagine parametri = {32, 64ul << 20, 512, 1500, 4, 60, 8192, 102};
+    std::vector<Voce> voci_prima, voci_dopo;
+    std::vector<ImprontaFile> impronte_prima, impronte_dopo;
+    if (genera_immagine(percorso.c_str(), &parametri) != 0 ||
+        impronte_volume(percorso.c_str(), 0, voci_prima, impronte_prima) != 0)
+        return esito("deframmenta", 0);
+
+    ScritturaFat *w = apri_scrittura(percorso.c_str());
+    int riuscita = w != NULL;
+    Frammentazione prima, dopo;
+    if (riuscita)
+    {
+        std::vector<Voce> voci = voci_prima;
+        std::vector<IntervalloCluster> intervalli;
+        std::vector<uint32_t> destinazione;
+        RisultatoDeframmentazione r;
+        memset(&r, 0, sizeof(r));
+        costruisci_mappa_inversa(&w->vol, w->fat, voci, intervalli);
+        misura_frammentazione(intervalli, voci.size(), &prima);
+
+        riuscita = prima.frammentate > 0 && pianifica_deframmentazione(w->fat, intervalli, destinazione) == 0 &&
+                   sposta_cluster(w, destinazione, &r) == 0;
+        if (riuscita)
+        {
+            aggiorna_metadati(w, destinazione, voci);
+            riuscita = salva_scrittura(w) == 0 && scrivi_cluster_root(w) == 0;
+        }
+        chiudi_scrittura(w);
+    }
+
+    VolumeAperto v;
+    riuscita = riuscita && impronte_volume(percorso.c_str(), 0, voci_dopo, impronte_dopo) == 0 &&
+               stesso_contenuto(voci_prima, impronte_prima, voci_dopo, impronte_dopo) &&
+               apri_volume(percorso.c_str(), 0, &v) == 0;
+    if (riuscita)
+    {
+        std::vector<IntervalloCluster> intervalli;
+        costruisci_mappa_inversa(&v.vol, v.fat, voci_dopo, intervalli);
+        misura_frammentazione(intervalli, voci_dopo.size(), &dopo);
+        chiudi_volume(&v);
+        riuscita = dopo.frammentate == 0 && dopo.catene == prima.catene;
+    }
+
+    remove(percorso.c_str());
+    return esito("deframmenta", riuscita);
+}
+
+
+// scrivi_riga_partizione compila una riga da 16 byte di una tabella delle partizioni
+void scrivi_riga_partizione(unsigned char *riga, unsigned char tipo, uint32_t settore, uint32_t settori)
+{
+    memset(riga, 0, 16);
+    riga[4] = tipo;
+    scrivi_32(riga + 8, settore);
+    scrivi_32(riga + 12, settori);
+}
+
+
+// copia_volume copia un'immagine generata nel disco, al byte inizio
+int copia_volume(int disco, const char *percorso, unsigned long inizio)
+{
+    int fd = open(percorso, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    std::vector<unsigned char> blocco(1 << 20);
+    unsigned long letti, fatti = 0;
+    int ret = 0;
+    while (ret == 0 && (letti = pread_tutto(fd, blocco.data(), blocco.size(), fatti)) > 0)
+    {
+        ret = pwrite_tutto(disco, blocco.data(), letti, inizio + fatti);
+        fatti += letti;
+    }
+    close(fd);
+    return ret;
+}
+
+
+/**
+ * verifica_partizioni costruisce un disco con un MBR: una partizione FAT12
+ * primaria, una Linux e una estesa con una FAT16 logica dietro un EBR.
+ * volumi_fat deve trovare le due FAT con i numeri 1 e 5, e ognuna deve
+ * avere lo stesso contenuto dell'immagine da cui e' stata copiata.
+ *
+ * @returns 1 se la verifica fallisce, 0 altrimenti
+ */
+int verifica_partizioni(const char *cartella)
+{
+    std::string primaria = std::string(cartella) + "/verifica_primaria.img";
+    std::string logica = std::string(cartella) + "/verifica_logica.img";
+    std::string disco = std::string(cartella) + "/verifica_disco.img";
+    ParametriImmagine parametri_primaria = {12, 2ul << 20, 512, 100, 2, 20, 2048, 103};
+    ParametriImmagine parametri_logica = {16, 16ul << 20, 2048, 300, 3, 20, 4096, 104};
+
+    // settori da 512 byte: la logica sta 2048 settori dopo il suo EBR
+    const uint32_t inizio_primaria = 2048, settori_primaria = (2ul << 20) / BYTE_SETTORE_MBR;
+    const uint32_t inizio_linux = inizio_primaria + settori_primaria, settori_linux = 2048;
+    const uint32_t inizio_estesa = inizio_linux + settori_linux, settori_logica = (16ul << 20) / BYTE_SETTORE_MBR;
+    const uint32_t settori_estesa = 2048 + settori_logica;
+
+    std::vector<Voce> voci[2], voci_disco[2];
+    std::vector<ImprontaFile> impronte[2], impronte_disco[2];
+    int riuscita = genera_immagine(primaria.c_str(), &parametri_primaria) == 0 &&
+                   genera_immagine(logica.c_str(), &parametri_logica) == 0 &&
+                   impronte_volume(primaria.c_str(), 0, voci[0], impronte[0]) == 0 &&
+                   impronte_volume(logica.c_str(), 0, voci[1], impronte[1]) == 0;
+
+    int fd = open(disco.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (riuscita && fd >= 0)
+    {
+        unsigned char settore[BYTE_SETTORE_MBR];
+        memset(settore, 0, sizeof(settore));
+        scrivi_riga_partizione(settore + INIZIO_TABELLA_PARTIZIONI, 0x01, inizio_primaria, settori_primaria);
+        scrivi_riga_partizione(settore + INIZIO_TABELLA_PARTIZIONI + 16, 0x83, inizio_linux, settori_linux);
+        scrivi_riga_partizione(settore + INIZIO_TABELLA_PARTIZIONI + 32, 0x05, inizio_estesa, settori_estesa);
+        settore[510] = 0x55;
+        settore[511] = 0xaa;
+        riuscita = pwrite_tutto(fd, settore, sizeof(settore), 0) == 0;
+
+        memset(settore, 0, sizeof(settore));
+        scrivi_riga_partizione(settore + INIZIO_TABELLA_PARTIZIONI, 0x06, 2048, settori_logica);
+        settore[510] = 0x55;
+        settore[511] = 0xaa;
+        riuscita = riuscita && pwrite_tutto(fd, settore, sizeof(settore), (unsigned long)inizio_estesa * BYTE_SETTORE_MBR) == 0 &&
+                   copia_volume(fd, primaria.c_str(), (unsigned long)inizio_primaria * BYTE_SETTORE_MBR) == 0 &&
+                   copia_volume(fd, logica.c_str(), (unsigned long)(inizio_estesa + 2048) * BYTE_SETTORE_MBR) == 0 &&
+                   ftruncate(fd, (unsigned long)(inizio_estesa + settori_estesa) * BYTE_SETTORE_MBR) == 0;
+    }
+    else
+        riuscita = 0;
+    if (fd >= 0)
+        close(fd);
+
+    std::vector<Partizione> volumi;
+    Immagine *img = riuscita ? apri_immagine(disco.c_str()) : NULL;
+    if (img != NULL)
+    {
+        riuscita = volumi_fat(img, 0, volumi) == 0 && volumi.size() == 2 &&
+                   volumi[0].numero == 1 && volumi[0].inizio == (unsigned long)inizio_primaria * BYTE_SETTORE_MBR &&
+                   volumi[1].numero == 5 && volumi[1].inizio == (unsigned long)(inizio_estesa + 2048) * BYTE_SETTORE_MBR;
+
+        // la partizione Linux non e' un volume FAT
+        std::vector<Partizione> sola_linux;
+        riuscita = riuscita && volumi_fat(img, 2, sola_linux) != 0;
+        chiudi_immagine(img);
+    }
+    else
+        riuscita = 0;
+
+    for (int i = 0; riuscita && i < 2; i++)
+        riuscita = impronte_volume(disco.c_str(), volumi[i].inizio, voci_disco[i], impronte_disco[i]) == 0 &&
+                   stesso_contenuto(voci[i], impronte[i], voci_disco[i], impronte_disco[i]);
+
+    remove(primaria.c_str());
+    remove(logica.c_str());
+    remove(disco.c_str());
+    return esito("partizioni", riuscita);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *cartella = argc > 1 ? argv[1] : "/tmp";
+    int ripetizioni = argc > 2 ? atoi(argv[2]) : 3;
+    if (ripetizioni < 1)
+        ripetizioni = 1;
+
+    int fallite = verifica_scrittura(cartella) + verifica_deframmentazione(cartella) + verifica_partizioni(cartella);
+    if (fallite > 0)
+        return 1;
+
+    for (size_t i = 0; i < sizeof(immagini) / sizeof(immagini[0]); i++)
+    {
+        std::string percorso = std::string(cartella) + "/benchmark_" + immagini[i].nome + ".img";
+
+        double inizio = secondi();
+        if (genera_immagine(percorso.c_str(), &immagini[i].parametri) != 0)
+            return 1;
+        printf("%s generata in %.2f s\n", percorso.c_str(), secondi() - inizio);
+
+        for (int usa_mmap = 1; usa_mmap >= 0; usa_mmap--)
+            if (misura_immagine(immagini[i].nome, percorso.c_str(), cartella, usa_mmap, ripetizioni) != 0)
+            {
+                fprintf(stderr, "Errore nell'apertura di %s\n", percorso.c_str());
+                return 1;
+            }
+
+        remove(percorso.c_str());
+    }
+    return 0;
+}
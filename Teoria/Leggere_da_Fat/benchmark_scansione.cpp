@@ -0,0 +1,104 @@
+// Microbenchmark della classificazione delle righe di directory:
+// ciclo scalare originale contro le versioni a maschere (scalare, SSE2, AVX2).
+//
+// g++ -O2 -o benchmark_scansione benchmark_scansione.cpp
+// ./benchmark_scansione [righe] [percentuale righe vive]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "scansione.h"
+
+
+double secondi()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+// Il ciclo di main.cpp prima delle maschere: una riga alla volta
+unsigned long conta_scalare_originale(const unsigned char *righe, unsigned long numero)
+{
+    unsigned long vive = 0;
+    for (unsigned long f = 0; f < numero; f++)
+    {
+        const unsigned char *riga = righe + f * 32;
+        if (riga[0] == 0 || riga[0] == 0xe5)
+            continue;
+        if ((riga[0x0b] & 0x3f) == 0x0f)
+            continue;
+        vive++;
+    }
+    return vive;
+}
+
+
+unsigned long conta_con_maschere(const unsigned char *righe, unsigned long numero, Classificatore classifica)
+{
+    unsigned long vive = 0;
+    for (unsigned long base = 0; base < numero; base += RIGHE_PER_MASCHERA)
+    {
+        unsigned long quante = numero - base < RIGHE_PER_MASCHERA ? numero - base : RIGHE_PER_MASCHERA;
+        MaschereRighe maschere;
+        classifica(righe + base * 32, quante, &maschere);
+        uint64_t validi = quante >= 64 ? ~0ull : ((1ull << quante) - 1);
+        vive += __builtin_popcountll(maschere.vive & validi);
+    }
+    return vive;
+}
+
+
+void misura(const char *nome, const unsigned char *righe, unsigned long numero, Classificatore classifica)
+{
+    const int ripetizioni = 20;
+    unsigned long vive = 0;
+
+    double inizio = secondi();
+    for (int r = 0; r < ripetizioni; r++)
+        vive = classifica ? conta_con_maschere(righe, numero, classifica) : conta_scalare_originale(righe, numero);
+    double tempo = (secondi() - inizio) / ripetizioni;
+
+    printf("%-18s %10lu vive  %8.3f ms  %8.1f Mrighe/s\n", nome, vive, tempo * 1e3, numero / tempo / 1e6);
+}
+
+
+int main(int argc, char *argv[])
+{
+    unsigned long numero = argc > 1 ? strtoul(argv[1], NULL, 10) : (1ul << 21);
+    int percentuale_vive = argc > 2 ? atoi(argv[2]) : 1;
+
+    // una directory enorme e quasi vuota: poche righe vive, qualche nome
+    // lungo, tutto il resto cancellato
+    unsigned char *righe = (unsigned char *)malloc(numero * 32);
+    if (righe == NULL)
+        return 1;
+    srand(1);
+    for (unsigned long f = 0; f < numero; f++)
+    {
+        unsigned char *riga = righe + f * 32;
+        int caso = rand() % 100;
+        for (int i = 0; i < 32; i++)
+            riga[i] = 'A' + i % 26;
+        if (caso < percentuale_vive)
+            riga[0x0b] = 0x20;
+        else if (caso < percentuale_vive + 1)
+            riga[0x0b] = 0x0f;
+        else
+            riga[0] = 0xe5;
+    }
+
+    printf("%lu righe, %d%% vive\n", numero, percentuale_vive);
+    misura("scalare originale", righe, numero, NULL);
+    misura("maschere scalare", righe, numero, classifica_righe_scalare);
+#ifdef SCANSIONE_X86
+    misura("maschere SSE2", righe, numero, classifica_righe_sse2);
+    if (__builtin_cpu_supports("avx2"))
+        misura("maschere AVX2", righe, numero, classifica_righe_avx2);
+#endif
+
+    free(righe);
+    return 0;
+}
@@ -0,0 +1,238 @@
+#ifndef CACHE_BLOCCHI_H
+#define CACHE_BLOCCHI_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+// Indice che non punta a nessun blocco
+#define CACHE_NESSUNO 0xffffffffu
+
+// Oltre questa capacita' i secchi, due per blocco, non stanno in 32 bit
+#define MASSIMO_BLOCCHI_CACHE (1ul << 30)
+
+
+// BloccoCache descrive un blocco della cache: quale settore contiene e la
+// sua posizione nella lista LRU e nel secchio della tabella hash
+typedef struct
+{
+    unsigned long settore;
+
+    // Lista LRU: precedente e' piu' recente, successivo piu' vecchio
+    uint32_t precedente;
+    uint32_t successivo;
+
+    // Il prossimo blocco nello stesso secchio
+    uint32_t catena;
+} BloccoCache;
+
+
+// CacheBlocchi tiene in memoria gli ultimi blocchi letti dall'immagine,
+// indicizzati per numero di settore, e scarta quello usato meno di recente
+typedef struct
+{
+    unsigned long dimensione_blocco;
+    uint32_t capacita;
+    uint32_t usati;
+
+    BloccoCache *blocchi;
+    unsigned char *dati;
+
+    // Tabella hash: secchi[settore & maschera_secchi] e' il primo blocco
+    uint32_t *secchi;
+    uint32_t maschera_secchi;
+
+    // Il blocco usato piu' di recente e quello da scartare per primo
+    uint32_t recente;
+    uint32_t vecchio;
+
+    unsigned long successi;
+    unsigned long mancati;
+
+    pthread_mutex_t mutex;
+} CacheBlocchi;
+
+
+/**
+ * crea_cache_blocchi alloca una cache vuota.
+ *
+ * @param dimensione_blocco I byte di ogni blocco, di solito un settore
+ * @param numero_blocchi Quanti blocchi tenere al massimo, da 1 a MASSIMO_BLOCCHI_CACHE
+ *
+ * @returns La cache, o NULL in caso di errore
+ */
+inline CacheBlocchi *crea_cache_blocchi(unsigned long dimensione_blocco, unsigned long numero_blocchi)
+{
+    if (dimensione_blocco == 0 || numero_blocchi == 0 || numero_blocchi > MASSIMO_BLOCCHI_CACHE)
+        return NULL;
+
+    CacheBlocchi *cache = (CacheBlocchi *)calloc(1, sizeof(CacheBlocchi));
+    if (cache == NULL)
+        return NULL;
+
+    // almeno due secchi per blocco, in potenza di 2
+    uint32_t numero_secchi = 1;
+    while (numero_secchi < (uint32_t)numero_blocchi * 2)
+        numero_secchi <<= 1;
+
+    cache->dimensione_blocco = dimensione_blocco;
+    cache->capacita = numero_blocchi;
+    cache->blocchi = (BloccoCache *)malloc(numero_blocchi * sizeof(BloccoCache));
+    cache->dati = (unsigned char *)malloc(numero_blocchi * dimensione_blocco);
+    cache->secchi = (uint32_t *)malloc(numero_secchi * sizeof(uint32_t));
+    cache->maschera_secchi = numero_secchi - 1;
+    cache->recente = cache->vecchio = CACHE_NESSUNO;
+
+    if (cache->blocchi == NULL || cache->dati == NULL || cache->secchi == NULL)
+    {
+        free(cache->blocchi);
+        free(cache->dati);
+        free(cache->secchi);
+        free(cache);
+        return NULL;
+    }
+
+    memset(cache->secchi, 0xff, numero_secchi * sizeof(uint32_t));
+    pthread_mutex_init(&cache->mutex, NULL);
+    return cache;
+}
+
+
+inline void distruggi_cache_blocchi(CacheBlocchi *cache)
+{
+    if (cache == NULL)
+        return;
+
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache->blocchi);
+    free(cache->dati);
+    free(cache->secchi);
+    free(cache);
+}
+
+
+inline uint32_t secchio_settore(const CacheBlocchi *cache, unsigned long settore)
+{
+    // moltiplicazione di Fibonacci: i settori consecutivi finiscono lontani
+    return (uint32_t)((settore * 0x9e3779b97f4a7c15ull) >> 32) & cache->maschera_secchi;
+}
+
+
+inline void stacca_blocco(CacheBlocchi *cache, uint32_t i)
+{
+    BloccoCache *b = &cache->blocchi[i];
+    if (b->precedente != CACHE_NESSUNO)
+        cache->blocchi[b->precedente].successivo = b->successivo;
+    else
+        cache->recente = b->successivo;
+    if (b->successivo != CACHE_NESSUNO)
+        cache->blocchi[b->successivo].precedente = b->precedente;
+    else
+        cache->vecchio = b->precedente;
+}
+
+
+inline void metti_in_testa(CacheBlocchi *cache, uint32_t i)
+{
+    BloccoCache *b = &cache->blocchi[i];
+    b->precedente = CACHE_NESSUNO;
+    b->successivo = cache->recente;
+    if (cache->recente != CACHE_NESSUNO)
+        cache->blocchi[cache->recente].precedente = i;
+    cache->recente = i;
+    if (cache->vecchio == CACHE_NESSUNO)
+        cache->vecchio = i;
+}
+
+
+// trova_blocco va chiamata con il mutex preso
+inline uint32_t trova_blocco(const CacheBlocchi *cache, unsigned long settore)
+{
+    uint32_t i = cache->secchi[secchio_settore(cache, settore)];
+    while (i != CACHE_NESSUNO && cache->blocchi[i].settore != settore)
+        i = cache->blocchi[i].catena;
+    return i;
+}
+
+
+/**
+ * copia_blocco copia count byte del settore, a partire da inizio, se il
+ * settore e' nella cache, e lo segna come usato di recente.
+ *
+ * @returns 1 se il settore era nella cache, 0 altrimenti
+ */
+inline int copia_blocco(CacheBlocchi *cache, unsigned long settore, unsigned long inizio,
+                        unsigned long count, unsigned char *dest)
+{
+    pthread_mutex_lock(&cache->mutex);
+
+    uint32_t i = trova_blocco(cache, settore);
+    if (i == CACHE_NESSUNO)
+    {
+        cache->mancati++;
+        pthread_mutex_unlock(&cache->mutex);
+        return 0;
+    }
+
+    cache->successi++;
+    if (cache->recente != i)
+    {
+        stacca_blocco(cache, i);
+        metti_in_testa(cache, i);
+    }
+    memcpy(dest, cache->dati + (unsigned long)i * cache->dimensione_blocco + inizio, count);
+
+    pthread_mutex_unlock(&cache->mutex);
+    return 1;
+}
+
+
+/**
+ * inserisci_blocco mette nella cache il contenuto di un settore appena
+ * letto. Se la cache e' piena scarta il blocco usato meno di recente.
+ *
+ * @param dati Esattamente dimensione_blocco byte
+ */
+inline void inserisci_blocco(CacheBlocchi *cache, unsigned long settore, const unsigned char *dati)
+{
+    pthread_mutex_lock(&cache->mutex);
+
+    // un altro thread puo' averlo gia' inserito nel frattempo
+    uint32_t i = trova_blocco(cache, settore);
+    if (i != CACHE_NESSUNO)
+    {
+        stacca_blocco(cache, i);
+    }
+    else
+    {
+        if (cache->usati < cache->capacita)
+        {
+            i = cache->usati++;
+        }
+        else
+        {
+            // si scarta il piu' vecchio togliendolo anche dal suo secchio
+            i = cache->vecchio;
+            stacca_blocco(cache, i);
+
+            uint32_t *p = &cache->secchi[secchio_settore(cache, cache->blocchi[i].settore)];
+            while (*p != i)
+                p = &cache->blocchi[*p].catena;
+            *p = cache->blocchi[i].catena;
+        }
+
+        uint32_t *secchio = &cache->secchi[secchio_settore(cache, settore)];
+        cache->blocchi[i].settore = settore;
+        cache->blocchi[i].catena = *secchio;
+        *secchio = i;
+    }
+
+    memcpy(cache->dati + (unsigned long)i * cache->dimensione_blocco, dati, cache->dimensione_blocco);
+    metti_in_testa(cache, i);
+
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+#endif
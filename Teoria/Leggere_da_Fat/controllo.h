@@ -0,0 +1,231 @@
+#ifndef CONTROLLO_H
+#define CONTROLLO_H
+
+#include <stdio.h>
+#include <vector>
+
+#include "immagine.h"
+#include "fat.h"
+#include "esplora.h"
+#include "mappa_bit.h"
+
+
+// RisultatoControllo conta i problemi trovati da controlla_immagine
+typedef struct
+{
+    // Cluster raggiunti da due catene diverse
+    unsigned long incroci;
+
+    // Catene che tornano su un proprio cluster
+    unsigned long cicli;
+
+    // Catene che finiscono su un cluster libero, danneggiato o fuori dal volume
+    unsigned long catene_interrotte;
+
+    // File con un numero di cluster diverso da quello richiesto dalla dimensione
+    unsigned long dimensioni_errate;
+
+    // Catene occupate nella FAT ma non raggiungibili da nessuna voce
+    unsigned long catene_perse;
+    unsigned long cluster_persi;
+
+    // Settori in cui una copia della FAT differisce dalla prima
+    unsigned long settori_fat_diversi;
+} RisultatoControllo;
+
+
+inline unsigned long problemi_trovati(const RisultatoControllo *r)
+{
+    return r->incroci + r->cicli + r->catene_interrotte + r->dimensioni_errate +
+           r->catene_perse + r->settori_fat_diversi;
+}
+
+
+/**
+ * segna_catena percorre una catena segnando i suoi cluster in posseduti.
+ * corrente serve solo a riconoscere i cicli e torna vuota all'uscita.
+ *
+ * @returns Il numero di cluster validi della catena
+ */
+inline unsigned long segna_catena(const TabellaFat *fat, const char *percorso, uint32_t primo,
+                                  MappaBit *posseduti, MappaBit *corrente,
+                                  FILE *rapporto, RisultatoControllo *r)
+{
+    unsigned long lunghezza = 0;
+    uint32_t c = primo;
+
+    for (;;)
+    {
+        if (!cluster_valido(fat, c))
+        {
+            fprintf(rapporto, "catena interrotta: %s, cluster %lu fuori dal volume\n", percorso, (unsigned long)c);
+            r->catene_interrotte++;
+            break;
+        }
+        if (leggi_bit(corrente, c))
+        {
+            fprintf(rapporto, "ciclo: %s torna sul cluster %lu\n", percorso, (unsigned long)c);
+            r->cicli++;
+            break;
+        }
+        if (leggi_bit(posseduti, c))
+        {
+            fprintf(rapporto, "incrocio: il cluster %lu di %s appartiene anche a un'altra catena\n", (unsigned long)c, percorso);
+            r->incroci++;
+            break;
+        }
+
+        accendi_bit(posseduti, c);
+        accendi_bit(corrente, c);
+        lunghezza++;
+
+        uint32_t successivo = fat->prossimo[c];
+        if (successivo == CLUSTER_FINE)
+            break;
+        if (successivo == CLUSTER_LIBERO || successivo == CLUSTER_DANNEGGIATO || !cluster_valido(fat, successivo))
+        {
+            fprintf(rapporto, "catena interrotta: %s, il cluster %lu non ha un successore valido\n", percorso, (unsigned long)c);
+            r->catene_interrotte++;
+            break;
+        }
+        c = successivo;
+    }
+
+    // si ripulisce la mappa della catena corrente ripercorrendo gli stessi cluster
+    c = primo;
+    for (unsigned long i = 0; i < lunghezza; i++)
+    {
+        spegni_bit(corrente, c);
+        c = fat->prossimo[c];
+    }
+    return lunghezza;
+}
+
+
+/**
+ * confronta_copie_fat confronta ogni copia della FAT con la prima,
+ * un settore alla volta.
+ */
+inline void confronta_copie_fat(Immagine *img, const Volume *vol, FILE *rapporto, RisultatoControllo *r)
+{
+    std::vector<unsigned char> prima(vol->byte_per_settore), altra(vol->byte_per_settore);
+
+    for (unsigned long copia = 1; copia < vol->numero_fat; copia++)
+    {
+        unsigned long diversi = 0;
+        unsigned long inizio_copia = vol->inizio_area_fat + copia * vol->bytes_per_fat;
+
+        for (unsigned long pos = 0; pos < vol->bytes_per_fat; pos += vol->byte_per_settore)
+        {
+            const unsigned char *a = puntatore_immagine(img, vol->inizio_area_fat + pos, vol->byte_per_settore);
+            const unsigned char *b = puntatore_immagine(img, inizio_copia + pos, vol->byte_per_settore);
+            if (a == NULL || b == NULL)
+            {
+                read_buffer(img, vol->inizio_area_fat + pos, vol->byte_per_settore, prima.data());
+                read_buffer(img, inizio_copia + pos, vol->byte_per_settore, altra.data());
+                a = prima.data();
+                b = altra.data();
+            }
+            if (memcmp(a, b, vol->byte_per_settore) != 0)
+            {
+                if (diversi == 0)
+                    fprintf(rapporto, "copie della FAT diverse: la copia %lu differisce dalla prima dal byte 0x%lx\n", copia, pos);
+                diversi++;
+            }
+        }
+
+        if (diversi > 0)
+            fprintf(rapporto, "copie della FAT diverse: %lu settori diversi nella copia %lu\n", diversi, copia);
+        r->settori_fat_diversi += diversi;
+    }
+}
+
+
+/**
+ * controlla_immagine verifica la coerenza tra la FAT e l'albero delle
+ * directory in tempo O(cluster + voci), usando solo mappe di bit:
+ * incroci, cicli, catene interrotte, dimensioni che non tornano, catene
+ * perse e copie della FAT diverse tra loro.
+ *
+ * @param voci Tutte le voci dell'albero, come da esplora_albero
+ * @param rapporto Dove scrivere un problema per riga, non deve essere NULL
+ * @param r Il riassunto da riempire, non deve essere NULL
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+inline int controlla_immagine(Immagine *img, const Volume *vol, const TabellaFat *fat,
+                              const std::vector<Voce> &voci, FILE *rapporto, RisultatoControllo *r)
+{
+    memset(r, 0, sizeof(RisultatoControllo));
+
+    MappaBit posseduti, corrente;
+    if (crea_mappa_bit(&posseduti, fat->numero_voci) != 0)
+        return -1;
+    if (crea_mappa_bit(&corrente, fat->numero_voci) != 0)
+    {
+        distruggi_mappa_bit(&posseduti);
+        return -1;
+    }
+
+    // su FAT32 anche la root directory e' una catena
+    if (vol->cluster_root != 0)
+        segna_catena(fat, "/", vol->cluster_root, &posseduti, &corrente, rapporto, r);
+
+    for (const Voce &voce : voci)
+    {
+        unsigned long lunghezza = 0;
+        if (voce.primo_cluster != 0)
+            lunghezza = segna_catena(fat, voce.percorso.c_str(), voce.primo_cluster, &posseduti, &corrente, rapporto, r);
+
+        if (voce.attributi & ATTRIBUTO_DIRECTORY)
+            continue;
+
+        unsigned long attesi = (voce.dimensione + vol->byte_per_cluster - 1) / vol->byte_per_cluster;
+        if (lunghezza != attesi)
+        {
+            fprintf(rapporto, "dimensione errata: %s ha %lu byte ma %lu cluster invece di %lu\n",
+                    voce.percorso.c_str(), voce.dimensione, lunghezza, attesi);
+            r->dimensioni_errate++;
+        }
+    }
+
+    // i cluster occupati che nessuno possiede sono persi; le teste delle
+    // catene perse sono quelli a cui non punta nessun altro cluster perso
+    MappaBit puntati;
+    if (crea_mappa_bit(&puntati, fat->numero_voci) == 0)
+    {
+        for (unsigned long c = 2; c < fat->numero_voci; c++)
+        {
+            uint32_t v = fat->prossimo[c];
+            if (v == CLUSTER_LIBERO || v == CLUSTER_DANNEGGIATO || leggi_bit(&posseduti, c))
+                continue;
+            r->cluster_persi++;
+            if (cluster_valido(fat, v))
+                accendi_bit(&puntati, v);
+        }
+        for (unsigned long c = 2; c < fat->numero_voci; c++)
+        {
+            uint32_t v = fat->prossimo[c];
+            if (v == CLUSTER_LIBERO || v == CLUSTER_DANNEGGIATO || leggi_bit(&posseduti, c) || leggi_bit(&puntati, c))
+                continue;
+            fprintf(rapporto, "catena persa: inizia dal cluster %lu\n", c);
+            r->catene_perse++;
+        }
+
+        // cluster persi senza testa: formano solo anelli chiusi
+        if (r->cluster_persi > 0 && r->catene_perse == 0)
+        {
+            fprintf(rapporto, "catena persa: %lu cluster in anelli chiusi\n", r->cluster_persi);
+            r->catene_perse++;
+        }
+        distruggi_mappa_bit(&puntati);
+    }
+
+    confronta_copie_fat(img, vol, rapporto, r);
+
+    distruggi_mappa_bit(&corrente);
+    distruggi_mappa_bit(&posseduti);
+    return 0;
+}
+
+#endif
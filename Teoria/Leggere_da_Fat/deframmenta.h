@@ -0,0 +1,378 @@
+#ifndef DEFRAMMENTA_H
+#define DEFRAMMENTA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#include "fat.h"
+#include "esplora.h"
+#include "mappa_bit.h"
+#include "mappa_inversa.h"
+#include "scrittura.h"
+
+
+// La deframmentazione sposta i dati sul posto: se si interrompe a meta'
+// i cluster sono gia' stati mossi ma la FAT e le directory no. Per questo
+// la modalita' defrag lavora su una copia, e sull'originale solo se lo si
+// indica esplicitamente come uscita. L'ordine delle scritture limita i
+// danni di un'interruzione dopo gli spostamenti: FAT, directory e per
+// ultimo il boot sector con la root di FAT32.
+
+
+// La memoria per gli spostamenti: meta' per i dati da spostare, meta' per
+// quelli che occupano la destinazione
+#define DIMENSIONE_BUFFER_DEFRAMMENTAZIONE (1 << 24)
+
+
+// Frammentazione riassume in quante estensioni sono divise le catene
+// delle voci dell'albero
+typedef struct
+{
+    // Le voci con almeno un cluster
+    unsigned long catene;
+
+    // Le catene con piu' di un'estensione
+    unsigned long frammentate;
+
+    unsigned long estensioni;
+    unsigned long massimo_estensioni;
+} Frammentazione;
+
+
+// RisultatoDeframmentazione conta il lavoro fatto sui dati
+typedef struct
+{
+    // I cluster copiati, contando anche quelli spostati per fare posto
+    unsigned long cluster_copiati;
+
+    unsigned long letture;
+    unsigned long scritture;
+} RisultatoDeframmentazione;
+
+
+/**
+ * misura_frammentazione conta le estensioni di ogni voce nella mappa
+ * inversa. La catena della root di FAT32 non e' una voce e non si conta.
+ */
+inline void misura_frammentazione(const std::vector<IntervalloCluster> &intervalli, size_t numero_voci,
+                                  Frammentazione *f)
+{
+    memset(f, 0, sizeof(Frammentazione));
+    std::vector<unsigned long> estensioni(numero_voci, 0);
+    for (const IntervalloCluster &i : intervalli)
+        if (i.voce != VOCE_ROOT)
+            estensioni[i.voce]++;
+
+    for (unsigned long n : estensioni)
+    {
+        if (n == 0)
+            continue;
+        f->catene++;
+        f->estensioni += n;
+        if (n > 1)
+            f->frammentate++;
+        if (n > f->massimo_estensioni)
+            f->massimo_estensioni = n;
+    }
+}
+
+
+/**
+ * pianifica_deframmentazione assegna a ogni cluster delle catene
+ * dell'albero la sua posizione finale: la root di FAT32, poi le voci
+ * nell'ordine dei percorsi, ognuna di seguito alla precedente a partire
+ * dal cluster 2. Cosi' ogni directory precede il suo contenuto. I cluster
+ * danneggiati e quelli occupati da catene perse non si toccano e vengono
+ * saltati.
+ *
+ * @param intervalli La mappa inversa delle voci, da costruisci_mappa_inversa
+ * @param destinazione Riceve per ogni cluster la posizione finale, 0 se
+ *                     il cluster non appartiene a nessuna voce
+ *
+ * @returns 0 in caso di successo, -1 se due catene si incrociano
+ */
+inline int pianifica_deframmentazione(const TabellaFat *fat, const std::vector<IntervalloCluster> &intervalli,
+                                      std::vector<uint32_t> &destinazione)
+{
+    MappaBit posseduti;
+    if (crea_mappa_bit(&posseduti, fat->numero_voci) != 0)
+        return -1;
+
+    // gli intervalli sono in ordine di cluster: un incrocio e' una sovrapposizione tra vicini
+    for (size_t i = 0; i < intervalli.size(); i++)
+    {
+        if (i > 0 && intervalli[i].inizio < intervalli[i - 1].inizio + intervalli[i - 1].lunghezza)
+        {
+            distruggi_mappa_bit(&posseduti);
+            return -1;
+        }
+        for (uint32_t k = 0; k < intervalli[i].lunghezza; k++)
+            accendi_bit(&posseduti, intervalli[i].inizio + k);
+    }
+
+    // lo stesso insieme di estensioni, in ordine di voce e di posizione nel file
+    std::vector<IntervalloCluster> ordinati = intervalli;
+    std::sort(ordinati.begin(), ordinati.end(),
+              [](const IntervalloCluster &a, const IntervalloCluster &b)
+              {
+                  // VOCE_ROOT + 1 va a capo a 0: la root viene prima di tutto
+                  if (a.voce != b.voce)
+                      return a.voce + 1 < b.voce + 1;
+                  return a.primo_nel_file < b.primo_nel_file;
+              });
+
+    destinazione.assign(fat->numero_voci, 0);
+    uint32_t prossima = 2;
+    for (const IntervalloCluster &i : ordinati)
+        for (uint32_t k = 0; k < i.lunghezza; k++)
+        {
+            while (fat->prossimo[prossima] != CLUSTER_LIBERO && !leggi_bit(&posseduti, prossima))
+                prossima++;
+            destinazione[i.inizio + k] = prossima++;
+        }
+
+    distruggi_mappa_bit(&posseduti);
+    return 0;
+}
+
+
+/**
+ * sposta_cluster porta i dati di ogni cluster nella sua destinazione.
+ * Le destinazioni si riempiono in ordine crescente, a tratti in cui sia i
+ * dati sia la destinazione sono contigui: un tratto si legge e si scrive
+ * con una sola operazione. Se la destinazione contiene dati di altre voci
+ * ancora da sistemare, questi si leggono prima e finiscono nella parte
+ * della sorgente che il tratto lascia libera; verranno spostati di nuovo
+ * quando tocchera' a loro. Ogni cluster si copia quindi al massimo due
+ * volte per ogni volta che arriva a destinazione, e la memoria usata e'
+ * limitata da DIMENSIONE_BUFFER_DEFRAMMENTAZIONE.
+ *
+ * @param destinazione La posizione finale di ogni cluster, da pianifica_deframmentazione
+ *
+ * @returns 0 in caso di successo, -1 se una lettura o una scrittura fallisce
+ */
+inline int sposta_cluster(ScritturaFat *w, const std::vector<uint32_t> &destinazione, RisultatoDeframmentazione *r)
+{
+    unsigned long byte_per_cluster = w->vol.byte_per_cluster;
+    unsigned long massimo = DIMENSIONE_BUFFER_DEFRAMMENTAZIONE / 2 / byte_per_cluster;
+    if (massimo == 0)
+        massimo = 1;
+    unsigned char *dati = (unsigned char *)malloc(2 * massimo * byte_per_cluster);
+    if (dati == NULL)
+        return -1;
+    unsigned char *sfrattati = dati + massimo * byte_per_cluster;
+
+    // dove[t] e' la posizione attuale dei dati destinati a t, occupante[p]
+    // la destinazione dei dati che stanno in p; 0 vuol dire nessuno
+    unsigned long n = destinazione.size();
+    std::vector<uint32_t> dove(n, 0), occupante(n, 0);
+    for (unsigned long c = 2; c < n; c++)
+        if (destinazione[c] != 0)
+        {
+            dove[destinazione[c]] = c;
+            occupante[c] = destinazione[c];
+        }
+
+    auto leggi = [&](unsigned char *buffer, uint32_t cluster, unsigned long numero) -> int
+    {
+        unsigned long byte = numero * byte_per_cluster;
+        r->letture++;
+        return pread_tutto(w->fd, buffer, byte, posizione_cluster(&w->vol, cluster)) == byte ? 0 : -1;
+    };
+    auto scrivi = [&](const unsigned char *buffer, uint32_t cluster, unsigned long numero) -> int
+    {
+        r->scritture++;
+        w->scritture++;
+        return pwrite_tutto(w->fd, buffer, numero * byte_per_cluster, posizione_cluster(&w->vol, cluster));
+    };
+
+    int ret = 0;
+    std::vector<uint32_t> spostati;
+    for (unsigned long t = 2; t < n && ret == 0; t++)
+    {
+        uint32_t s = dove[t];
+        if (s == 0 || s == t)
+            continue;
+
+        // i cluster prima di t sono gia' sistemati, quindi i dati stanno tutti da t in poi
+        unsigned long lunghezza = 1;
+        while (lunghezza < massimo && t + lunghezza < n && dove[t + lunghezza] == s + lunghezza)
+            lunghezza++;
+
+        // la parte della destinazione fuori dalla sorgente e la parte
+        // della sorgente fuori dalla destinazione sono lunghe uguali
+        unsigned long sfratto = (s < t + lunghezza ? s : t + lunghezza) - t;
+        unsigned long libera = s + lunghezza - sfratto;
+
+        // dei cluster da sfrattare si copia solo il tratto tra il primo e l'ultimo occupato
+        unsigned long primo = sfratto, ultimo = 0;
+        for (unsigned long k = 0; k < sfratto; k++)
+            if (occupante[t + k] != 0)
+            {
+                primo = k < primo ? k : primo;
+                ultimo = k;
+            }
+
+        if (primo < sfratto && leggi(sfrattati, t + primo, ultimo - primo + 1) != 0)
+            ret = -1;
+        else if (leggi(dati, s, lunghezza) != 0 || scrivi(dati, t, lunghezza) != 0)
+            ret = -1;
+        else if (primo < sfratto && scrivi(sfrattati, libera + primo, ultimo - primo + 1) != 0)
+            ret = -1;
+        if (ret != 0)
+            break;
+        r->cluster_copiati += lunghezza + (primo < sfratto ? ultimo - primo + 1 : 0);
+
+        spostati.clear();
+        for (unsigned long k = primo; k < sfratto && k <= ultimo; k++)
+            spostati.push_back(occupante[t + k]);
+        for (unsigned long k = 0; k < lunghezza; k++)
+            occupante[s + k] = 0;
+        for (unsigned long k = 0; k < lunghezza; k++)
+        {
+            occupante[t + k] = t + k;
+            dove[t + k] = t + k;
+        }
+        for (size_t k = 0; k < spostati.size(); k++)
+            if (spostati[k] != 0)
+            {
+                occupante[libera + primo + k] = spostati[k];
+                dove[spostati[k]] = libera + primo + k;
+            }
+        t += lunghezza - 1;
+    }
+
+    free(dati);
+    return ret;
+}
+
+
+/**
+ * aggiorna_metadati riscrive, dopo sposta_cluster, tutto cio' che punta ai
+ * cluster: le catene nella FAT, il primo cluster in ogni riga delle
+ * directory (compresi "." e "..") e, su FAT32, il cluster della root in
+ * w->vol. FAT e directory restano in memoria fino a salva_scrittura, il
+ * boot sector si scrive poi con scrivi_cluster_root; anche le voci vengono
+ * aggiornate.
+ */
+inline void aggiorna_metadati(ScritturaFat *w, const std::vector<uint32_t> &destinazione, std::vector<Voce> &voci)
+{
+    TabellaFat *fat = w->fat;
+    unsigned long n = destinazione.size();
+
+    // la nuova FAT: le vecchie posizioni si liberano, le catene si
+    // ricostruiscono sulle destinazioni nello stesso ordine
+    std::vector<uint32_t> nuova(fat->prossimo, fat->prossimo + n);
+    for (unsigned long c = 2; c < n; c++)
+        if (destinazione[c] != 0)
+            nuova[c] = CLUSTER_LIBERO;
+    for (unsigned long c = 2; c < n; c++)
+        if (destinazione[c] != 0)
+        {
+            uint32_t successivo = fat->prossimo[c];
+            nuova[destinazione[c]] = cluster_valido(fat, successivo) ? destinazione[successivo] : CLUSTER_FINE;
+        }
+
+    uint32_t ultima = 1;
+    for (unsigned long c = 2; c < n; c++)
+    {
+        if (nuova[c] != fat->prossimo[c])
+            imposta_fat(w, c, nuova[c]);
+        if (destinazione[c] > ultima)
+            ultima = destinazione[c];
+    }
+    w->cursore = ultima + 1 < n ? ultima + 1 : 2;
+
+    auto nuovo_cluster = [&](uint32_t c) { return cluster_valido(fat, c) && destinazione[c] != 0 ? destinazione[c] : c; };
+
+    // le righe delle directory, lette dalla nuova posizione
+    std::vector<uint32_t> directory;
+    directory.push_back(nuovo_cluster(w->vol.cluster_root));
+    for (Voce &voce : voci)
+    {
+        voce.primo_cluster = nuovo_cluster(voce.primo_cluster);
+        if ((voce.attributi & ATTRIBUTO_DIRECTORY) && voce.primo_cluster != 0)
+            directory.push_back(voce.primo_cluster);
+    }
+    for (uint32_t primo : directory)
+    {
+        std::vector<uint32_t> blocchi;
+        if (primo == 0)
+            blocchi.push_back(0);
+        IteratoreCatena catena = inizia_catena(fat, primo);
+        uint32_t cluster;
+        while ((cluster = prossimo_cluster(&catena)) != 0)
+            blocchi.push_back(cluster);
+
+        for (uint32_t b : blocchi)
+        {
+            BloccoDirectory &blocco = blocco_directory(w, b);
+            for (unsigned long i = 0; i + 32 <= blocco.dati.size(); i += 32)
+            {
+                unsigned char *riga = blocco.dati.data() + i;
+                if (riga[0] == 0x00)
+                    break;
+                if (riga[0] == 0xe5 || riga_nome_lungo(riga) ||
+                    (riga[0x0b] & (ATTRIBUTO_ETICHETTA | ATTRIBUTO_DIRECTORY)) == ATTRIBUTO_ETICHETTA)
+                    continue;
+
+                uint32_t vecchio = riga[0x1a] | (riga[0x1b] << 8);
+                if (w->vol.tipo_fat == 32)
+                    vecchio |= (uint32_t)(riga[0x14] | (riga[0x15] << 8)) << 16;
+                uint32_t nuovo = nuovo_cluster(vecchio);
+                if (nuovo == vecchio)
+                    continue;
+                scrivi_16(riga + 0x14, w->vol.tipo_fat == 32 ? nuovo >> 16 : 0);
+                scrivi_16(riga + 0x1a, nuovo & 0xffff);
+                blocco.sporco = 1;
+            }
+        }
+    }
+
+    // su FAT32 il boot sector dice dov'e' la root: si aggiorna con
+    // scrivi_cluster_root, dopo che FAT e directory sono salvate
+    w->vol.cluster_root = nuovo_cluster(w->vol.cluster_root);
+}
+
+
+/**
+ * scrivi_cluster_root riporta nel boot sector di FAT32, e nella sua copia
+ * di riserva, il cluster della root di w->vol, se e' cambiato. Va chiamata
+ * dopo salva_scrittura: finche' la FAT non e' sul disco il boot sector
+ * deve continuare a indicare la root vecchia.
+ *
+ * @returns 0 in caso di successo, -1 se il boot sector non si puo' scrivere
+ */
+inline int scrivi_cluster_root(ScritturaFat *w)
+{
+    if (w->vol.tipo_fat != 32)
+        return 0;
+
+    unsigned char settore[512];
+    unsigned long inizio = w->vol.inizio_partizione;
+    if (pread_tutto(w->fd, settore, 512, inizio) != 512)
+        return -1;
+    uint32_t attuale = settore[0x2c] | (settore[0x2d] << 8) | (settore[0x2e] << 16) | ((uint32_t)settore[0x2f] << 24);
+    if ((attuale & 0x0fffffff) == w->vol.cluster_root)
+        return 0;
+
+    unsigned long copia = inizio + (settore[0x32] | (settore[0x33] << 8)) * w->vol.byte_per_settore;
+    scrivi_32(settore + 0x2c, w->vol.cluster_root);
+    if (pwrite_tutto(w->fd, settore, 512, inizio) != 0)
+        return -1;
+    w->scritture++;
+    if (copia != inizio && copia != inizio + 0xfffful * w->vol.byte_per_settore && copia < w->vol.inizio_area_fat)
+    {
+        if (pread_tutto(w->fd, settore, 512, copia) != 512)
+            return -1;
+        scrivi_32(settore + 0x2c, w->vol.cluster_root);
+        if (pwrite_tutto(w->fd, settore, 512, copia) != 0)
+            return -1;
+        w->scritture++;
+    }
+    return fsync(w->fd) == 0 ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef DISPOSIZIONE_H
+#define DISPOSIZIONE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "fat.h"
+#include "esplora.h"
+
+
+// Le classi dell'istogramma: la classe k conta i file la cui estensione
+// media e' lunga da 2^k a 2^(k+1) - 1 cluster; l'ultima prende il resto
+#define CLASSI_ESTENSIONE 16
+
+// Un file e' vicino alla sua directory se inizia entro questa distanza,
+// in byte, da uno dei cluster della directory
+#define DISTANZA_LOCALITA (4ul << 20)
+
+
+// Disposizione riassume come sono sistemati i dati nell'area dati
+typedef struct
+{
+    // I file (non le directory) con almeno un cluster
+    unsigned long file;
+    unsigned long frammentati;
+    unsigned long estensioni;
+    unsigned long massimo_estensioni;
+
+    // L'indice nelle voci del file con piu' estensioni
+    size_t piu_frammentato;
+
+    // I file per lunghezza media delle loro estensioni
+    unsigned long istogramma[CLASSI_ESTENSIONE];
+
+    // Le sequenze di cluster liberi consecutivi e la piu' lunga
+    unsigned long cluster_liberi;
+    unsigned long tratti_liberi;
+    unsigned long libero_massimo;
+    uint32_t inizio_libero_massimo;
+
+    // I file che iniziano vicino alla loro directory, su quelli con almeno un cluster
+    unsigned long file_vicini;
+} Disposizione;
+
+
+/**
+ * misura_spazio_libero trova in una passata sulla FAT in memoria le
+ * sequenze di cluster liberi e la piu' lunga.
+ */
+inline void misura_spazio_libero(const TabellaFat *fat, Disposizione *d)
+{
+    unsigned long inizio = 0, lunghezza = 0;
+    for (unsigned long c = 2; c <= fat->numero_voci; c++)
+    {
+        if (c < fat->numero_voci && fat->prossimo[c] == CLUSTER_LIBERO)
+        {
+            if (lunghezza++ == 0)
+                inizio = c;
+            continue;
+        }
+        if (lunghezza == 0)
+            continue;
+
+        d->cluster_liberi += lunghezza;
+        d->tratti_liberi++;
+        if (lunghezza > d->libero_massimo)
+        {
+            d->libero_massimo = lunghezza;
+            d->inizio_libero_massimo = inizio;
+        }
+        lunghezza = 0;
+    }
+}
+
+
+// distanza_da_estensioni e' quanti cluster separano cluster dall'estensione piu' vicina
+inline unsigned long distanza_da_estensioni(const std::vector<Estensione> &estensioni, uint32_t cluster)
+{
+    unsigned long minima = ~0ul;
+    for (const Estensione &e : estensioni)
+    {
+        unsigned long distanza = 0;
+        if (cluster < e.inizio)
+            distanza = e.inizio - cluster;
+        else if (cluster >= e.inizio + e.lunghezza)
+            distanza = cluster - (e.inizio + e.lunghezza - 1);
+        if (distanza < minima)
+            minima = distanza;
+    }
+    return minima;
+}
+
+
+/**
+ * analizza_disposizione misura senza scrivere nulla la frammentazione dei
+ * file, la lunghezza media delle loro estensioni, lo spazio libero e la
+ * localita' delle directory. Ogni catena si percorre una volta sola, per
+ * estensioni; delle directory si tengono le estensioni per confrontarle
+ * con il primo cluster dei file che contengono. La root ad area fissa di
+ * FAT12 e FAT16 sta subito prima del cluster 2.
+ *
+ * @param voci Le voci dell'albero, come da esplora_albero
+ * @param d Il riassunto da riempire, non deve essere NULL
+ */
+inline void analizza_disposizione(const Volume *vol, const TabellaFat *fat, const std::vector<Voce> &voci,
+                                  Disposizione *d)
+{
+    memset(d, 0, sizeof(Disposizione));
+    misura_spazio_libero(fat, d);
+
+    auto estensioni_di = [&](uint32_t primo, std::vector<Estensione> &estensioni)
+    {
+        estensioni.clear();
+        IteratoreCatena catena = inizia_catena(fat, primo);
+        Estensione estensione;
+        while (prossima_estensione(&catena, &estensione))
+            estensioni.push_back(estensione);
+    };
+
+    // le estensioni di ogni directory, per percorso; la root e' ""
+    std::unordered_map<std::string, std::vector<Estensione>> directory;
+    std::vector<Estensione> &root = directory[""];
+    if (vol->cluster_root != 0)
+        estensioni_di(vol->cluster_root, root);
+    else
+        root.push_back(Estensione{2, 1});
+    for (const Voce &voce : voci)
+        if (voce.attributi & ATTRIBUTO_DIRECTORY)
+            estensioni_di(voce.primo_cluster, directory[voce.percorso]);
+
+    unsigned long vicinanza = DISTANZA_LOCALITA / vol->byte_per_cluster;
+    std::vector<Estensione> estensioni;
+    for (size_t i = 0; i < voci.size(); i++)
+    {
+        const Voce &voce = voci[i];
+        if (voce.attributi & ATTRIBUTO_DIRECTORY)
+            continue;
+        estensioni_di(voce.primo_cluster, estensioni);
+        if (estensioni.empty())
+            continue;
+
+        unsigned long cluster = 0;
+        for (const Estensione &e : estensioni)
+            cluster += e.lunghezza;
+        d->file++;
+        d->estensioni += estensioni.size();
+        if (estensioni.size() > 1)
+            d->frammentati++;
+        if (estensioni.size() > d->massimo_estensioni)
+        {
+            d->massimo_estensioni = estensioni.size();
+            d->piu_frammentato = i;
+        }
+
+        int classe = 63 - __builtin_clzl(cluster / estensioni.size());
+        d->istogramma[classe < CLASSI_ESTENSIONE ? classe : CLASSI_ESTENSIONE - 1]++;
+
+        auto padre = directory.find(voce.percorso.substr(0, voce.percorso.rfind('/')));
+        if (padre != directory.end() && distanza_da_estensioni(padre->second, voce.primo_cluster) <= vicinanza)
+            d->file_vicini++;
+    }
+}
+
+#endif
@@ -0,0 +1,95 @@
+// Esempio d'uso di libreria_fat.h: elenca una directory e poi legge tutti i
+// file dell'immagine da piu' thread insieme con fat_pread, a pezzi di
+// dimensione variabile, confrontando il risultato con una lettura unica.
+//
+// g++ -O2 -pthread -o esempio_libreria esempio_libreria.cpp
+// ./esempio_libreria <immagine> [directory] [thread]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+
+#include "libreria_fat.h"
+
+
+// Somma FNV-1a del contenuto, per confrontare due letture
+uint64_t somma(const unsigned char *dati, unsigned long numero, uint64_t h)
+{
+    for (unsigned long i = 0; i < numero; i++)
+        h = (h ^ dati[i]) * 0x100000001b3ull;
+    return h;
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "uso: %s <immagine> [directory] [thread]\n", argv[0]);
+        return 1;
+    }
+    const char *directory = argc > 2 ? argv[2] : "/";
+    unsigned numero_thread = argc > 3 ? atoi(argv[3]) : 8;
+
+    FatImmagine *immagine = fat_open_image(argv[1]);
+    if (immagine == NULL)
+    {
+        fprintf(stderr, "Impossibile aprire '%s'\n", argv[1]);
+        return 1;
+    }
+
+    std::vector<Voce> voci;
+    if (fat_readdir(immagine, directory, voci) != 0)
+    {
+        fprintf(stderr, "Directory '%s' non trovata\n", directory);
+        fat_close_image(immagine);
+        return 1;
+    }
+    for (const Voce &voce : voci)
+        printf("%c %10lu %s\n", voce.attributi & ATTRIBUTO_DIRECTORY ? 'd' : '-', voce.dimensione, voce.percorso.c_str());
+
+
+    // tutti i thread leggono gli stessi file dalla stessa immagine
+    std::vector<Voce> tutte = esplora_albero(immagine->img, &immagine->vol, immagine->fat, 1);
+    std::atomic<unsigned long> diversi(0), letti(0);
+
+    auto lavora = [&](unsigned io)
+    {
+        std::vector<unsigned char> intero, pezzo(4096);
+        for (const Voce &voce : tutte)
+        {
+            FatFile *file = fat_open(immagine, voce.percorso.c_str());
+            if (file == NULL)
+                continue;
+
+            intero.resize(voce.dimensione);
+            long n = fat_pread(file, intero.data(), intero.size(), 0);
+            uint64_t attesa = somma(intero.data(), n < 0 ? 0 : n, 0xcbf29ce484222325ull);
+
+            // la stessa lettura a pezzi di lunghezza diversa per ogni thread
+            uint64_t h = 0xcbf29ce484222325ull;
+            unsigned long offset = 0, passo = 1 + (io * 977) % pezzo.size();
+            long m;
+            while ((m = fat_pread(file, pezzo.data(), passo, offset)) > 0)
+            {
+                h = somma(pezzo.data(), m, h);
+                offset += m;
+            }
+            if (h != attesa || offset != (unsigned long)n)
+                diversi++;
+            letti += offset;
+            fat_close(file);
+        }
+    };
+
+    std::vector<std::thread> thread;
+    for (unsigned i = 0; i < numero_thread; i++)
+        thread.emplace_back(lavora, i);
+    for (std::thread &t : thread)
+        t.join();
+
+    printf("%u thread, %lu byte letti, %lu letture diverse\n", numero_thread, letti.load(), diversi.load());
+    fat_close_image(immagine);
+    return diversi > 0 ? 1 : 0;
+}
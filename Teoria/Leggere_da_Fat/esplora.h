@@ -0,0 +1,411 @@
+#ifndef ESPLORA_H
+#define ESPLORA_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <strings.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "immagine.h"
+#include "fat.h"
+#include "nomi_lunghi.h"
+#include "scansione.h"
+
+
+#define ATTRIBUTO_SOLA_LETTURA 0x01
+#define ATTRIBUTO_NASCOSTO 0x02
+#define ATTRIBUTO_SISTEMA 0x04
+#define ATTRIBUTO_ETICHETTA 0x08
+#define ATTRIBUTO_DIRECTORY 0x10
+#define ATTRIBUTO_ARCHIVIO 0x20
+#define ATTRIBUTO_NOME_LUNGO 0x0f
+
+
+// Voce e' un file o una directory trovata esplorando l'albero
+struct Voce
+{
+    // Il percorso completo, con i nomi lunghi quando ci sono
+    std::string percorso;
+
+    // Il nome 8.3 della voce, ad esempio "DENTRO.TXT"
+    char nome_breve[13];
+
+    unsigned char attributi;
+    uint32_t primo_cluster;
+    unsigned long dimensione;
+
+    // Orari e date nel formato della FAT, decodificati solo in stampa
+    unsigned char centesimi_creazione;
+    uint16_t orario_creazione;
+    uint16_t data_creazione;
+    uint16_t orario_modifica;
+    uint16_t data_modifica;
+
+    // L'offset della riga nell'immagine
+    unsigned long posizione;
+};
+
+
+/**
+ * nome_corto scrive il nome 8.3 di una riga senza gli spazi di riempimento,
+ * ad esempio "CIAO.TXT".
+ *
+ * @param riga La riga di 32 byte della directory
+ * @param dest Il buffer di destinazione, almeno 13 byte
+ */
+inline void nome_corto(const unsigned char *riga, char *dest)
+{
+    int n = 0;
+    for (int i = 0; i < 8 && riga[i] != ' '; i++)
+        dest[n++] = riga[i];
+
+    // 0x05 in testa sta per 0xe5, che indicherebbe un file cancellato
+    if (n > 0 && riga[0] == 0x05)
+        dest[0] = (char)0xe5;
+
+    if (riga[8] != ' ')
+        dest[n++] = '.';
+    for (int i = 8; i < 11 && riga[i] != ' '; i++)
+        dest[n++] = riga[i];
+    dest[n] = '\0';
+}
+
+
+/**
+ * decodifica_voce riempie una Voce dalla riga di 32 byte. Su FAT32 la parola
+ * alta del primo cluster si trova a 0x14.
+ */
+inline void decodifica_voce(const unsigned char *riga, unsigned long posizione, int tipo_fat, Voce *voce)
+{
+    voce->attributi = riga[0x0b];
+    voce->centesimi_creazione = riga[0x0d];
+    voce->orario_creazione = riga[0x0e] | (riga[0x0f] << 8);
+    voce->data_creazione = riga[0x10] | (riga[0x11] << 8);
+    voce->orario_modifica = riga[0x16] | (riga[0x17] << 8);
+    voce->data_modifica = riga[0x18] | (riga[0x19] << 8);
+    voce->primo_cluster = riga[0x1a] | (riga[0x1b] << 8);
+    if (tipo_fat == 32)
+        voce->primo_cluster |= (uint32_t)(riga[0x14] | (riga[0x15] << 8)) << 16;
+    voce->dimensione = (unsigned long)riga[0x1c] | (riga[0x1d] << 8) |
+                       (riga[0x1e] << 16) | ((unsigned long)riga[0x1f] << 24);
+    voce->posizione = posizione;
+}
+
+
+/**
+ * scorri_directory passa a elabora le righe di una directory, un blocco
+ * contiguo alla volta. Il cluster 0 indica la root directory ad area
+ * fissa di FAT12 e FAT16.
+ *
+ * elabora riceve (righe, numero di righe, offset della prima riga) e
+ * restituisce 0 per fermarsi.
+ *
+ * @param buffer Buffer riutilizzabile, usato solo se l'immagine non e' mappata
+ */
+template <typename Elabora>
+void scorri_directory(Immagine *img, const Volume *vol, const TabellaFat *fat, uint32_t cluster,
+                      std::vector<unsigned char> &buffer, Elabora elabora)
+{
+    auto blocco = [&](unsigned long posizione, unsigned long byte) -> int
+    {
+        const unsigned char *righe = puntatore_immagine(img, posizione, byte);
+        if (righe == NULL)
+        {
+            buffer.resize(byte);
+            read_buffer(img, posizione, byte, buffer.data());
+            righe = buffer.data();
+        }
+        return elabora(righe, byte / 32, posizione);
+    };
+
+    if (cluster == 0)
+    {
+        blocco(vol->inizio_root_dir, vol->numero_righe_dir * 32);
+        return;
+    }
+
+    IteratoreCatena catena = inizia_catena(fat, cluster);
+    Estensione estensione;
+    while (prossima_estensione(&catena, &estensione))
+    {
+        if (!blocco(posizione_cluster(vol, estensione.inizio), estensione.lunghezza * vol->byte_per_cluster))
+            return;
+    }
+}
+
+
+/**
+ * leggi_directory aggiunge a voci i file e le sottodirectory contenuti
+ * direttamente nella directory indicata, saltando "." e "..". I nomi lunghi
+ * vengono ricomposti in nome_lungo, che il chiamante riutilizza.
+ */
+inline void leggi_directory(Immagine *img, const Volume *vol, const TabellaFat *fat, uint32_t cluster,
+                            const std::string &padre, std::vector<Voce> &voci,
+                            std::vector<unsigned char> &buffer, NomeLungo *nome_lungo)
+{
+    // indice della prossima riga attesa: un salto vuol dire righe cancellate
+    // in mezzo, che spezzano la sequenza di un nome lungo
+    unsigned long righe_viste = 0;
+    unsigned long successiva = 0;
+
+    azzera_nome_lungo(nome_lungo);
+    scorri_directory(img, vol, fat, cluster, buffer,
+                     [&](const unsigned char *righe, unsigned long numero, unsigned long posizione) -> int
+                     {
+                         for (unsigned long base = 0; base < numero; base += RIGHE_PER_MASCHERA)
+                         {
+                             unsigned long quante = numero - base < RIGHE_PER_MASCHERA ? numero - base : RIGHE_PER_MASCHERA;
+                             MaschereRighe maschere;
+                             classifica_righe(righe + base * 32, quante, &maschere);
+
+                             // si decodificano solo le righe vive prima della prima riga libera
+                             uint64_t prima_della_fine = maschere.libere ? (maschere.libere & -maschere.libere) - 1 : ~0ull;
+                             uint64_t da_leggere = (maschere.vive | maschere.lunghe) & prima_della_fine;
+
+                             while (da_leggere)
+                             {
+                                 unsigned long f = base + __builtin_ctzll(da_leggere);
+                                 da_leggere &= da_leggere - 1;
+
+                                 const unsigned char *riga = righe + f * 32;
+                                 if (righe_viste + f != successiva)
+                                     azzera_nome_lungo(nome_lungo);
+                                 successiva = righe_viste + f + 1;
+
+                                 if ((maschere.lunghe >> (f - base)) & 1)
+                                 {
+                                     aggiungi_frammento(nome_lungo, riga);
+                                     continue;
+                                 }
+                                 if (riga[0] == '.' ||
+                                     (riga[0x0b] & (ATTRIBUTO_ETICHETTA | ATTRIBUTO_DIRECTORY)) == ATTRIBUTO_ETICHETTA)
+                                 {
+                                     azzera_nome_lungo(nome_lungo);
+                                     continue;
+                                 }
+
+                                 Voce voce;
+                                 nome_corto(riga, voce.nome_breve);
+                                 const char *lungo = concludi_nome_lungo(nome_lungo, riga);
+                                 voce.percorso.reserve(padre.size() + 1 + strlen(lungo ? lungo : voce.nome_breve));
+                                 voce.percorso = padre;
+                                 voce.percorso += '/';
+                                 voce.percorso += lungo ? lungo : voce.nome_breve;
+                                 decodifica_voce(riga, posizione + f * 32, vol->tipo_fat, &voce);
+                                 voci.push_back(std::move(voce));
+                             }
+
+                             if (maschere.libere)
+                                 return 0;
+                         }
+                         righe_viste += numero;
+                         return 1;
+                     });
+}
+
+
+/**
+ * cerca_percorso trova una voce dal suo percorso (ad esempio "SUB/DENTRO.TXT"),
+ * scendendo una directory alla volta e senza distinguere maiuscole e minuscole.
+ * Ogni componente puo' essere il nome lungo o il nome 8.3.
+ *
+ * @returns 0 se la voce e' stata trovata, -1 altrimenti
+ */
+inline int cerca_percorso(Immagine *img, const Volume *vol, const TabellaFat *fat,
+                          const char *percorso, Voce *trovata)
+{
+    std::vector<Voce> voci;
+    std::vector<unsigned char> buffer;
+    NomeLungo nome_lungo;
+    std::string attuale;
+    uint32_t cluster = vol->cluster_root;
+
+    while (*percorso != '\0')
+    {
+        while (*percorso == '/')
+            percorso++;
+        const char *fine = strchr(percorso, '/');
+        std::string componente = fine ? std::string(percorso, fine) : std::string(percorso);
+        if (componente.empty())
+            break;
+
+        voci.clear();
+        leggi_directory(img, vol, fat, cluster, attuale, voci, buffer, &nome_lungo);
+
+        const Voce *prossima = NULL;
+        for (const Voce &voce : voci)
+        {
+            if (strcasecmp(voce.percorso.c_str() + attuale.size() + 1, componente.c_str()) == 0 ||
+                strcasecmp(voce.nome_breve, componente.c_str()) == 0)
+            {
+                prossima = &voce;
+                break;
+            }
+        }
+        if (prossima == NULL || (fine != NULL && !(prossima->attributi & ATTRIBUTO_DIRECTORY)))
+            return -1;
+
+        *trovata = *prossima;
+        attuale = prossima->percorso;
+        cluster = prossima->primo_cluster;
+        if (cluster == 0)
+            cluster = vol->cluster_root;
+        percorso = fine ? fine : percorso + componente.size();
+    }
+    return attuale.empty() ? -1 : 0;
+}
+
+
+// Compito e' una directory ancora da decodificare
+struct Compito
+{
+    std::string percorso;
+    uint32_t cluster;
+};
+
+
+// CodaLavoro e' la coda di un thread: il proprietario prende dal fondo,
+// gli altri thread rubano dalla testa.
+struct CodaLavoro
+{
+    std::mutex mutex;
+    std::deque<Compito> compiti;
+};
+
+
+/**
+ * esplora_albero visita tutte le directory dell'immagine a partire dalla
+ * root. Ogni sottodirectory diventa un compito di un pool di thread con
+ * work stealing; le voci trovate vengono poi unite e ordinate per percorso,
+ * cosi' il risultato non dipende dall'ordine di esecuzione. Un thread che
+ * non trova compiti dorme finche' non ne viene accodato uno o l'albero e'
+ * finito, invece di girare a vuoto mentre un altro legge una directory.
+ *
+ * @param numero_thread Il numero di thread da usare, almeno 1
+ *
+ * @returns Le voci di tutto l'albero ordinate per percorso
+ */
+inline std::vector<Voce> esplora_albero(Immagine *img, const Volume *vol, const TabellaFat *fat,
+                                        unsigned numero_thread)
+{
+    if (numero_thread == 0)
+        numero_thread = 1;
+
+    std::unique_ptr<CodaLavoro[]> code(new CodaLavoro[numero_thread]);
+    std::vector<std::vector<Voce>> risultati(numero_thread);
+    std::atomic<long> in_sospeso(1);
+
+    // accodati cambia solo sotto attesa: chi si addormenta dopo aver letto
+    // il valore vecchio non perde il risveglio di un compito appena accodato
+    std::mutex attesa;
+    std::condition_variable risveglio;
+    std::atomic<unsigned long> accodati(0);
+
+    // una directory gia' visitata non si accoda di nuovo: evita i cicli
+    std::unique_ptr<std::atomic<unsigned char>[]> visitata(new std::atomic<unsigned char>[fat->numero_voci]());
+
+    code[0].compiti.push_back(Compito{"", vol->cluster_root});
+    if (cluster_valido(fat, vol->cluster_root))
+        visitata[vol->cluster_root] = 1;
+
+    auto prendi = [&](unsigned io, Compito &compito) -> bool
+    {
+        {
+            std::lock_guard<std::mutex> blocco(code[io].mutex);
+            if (!code[io].compiti.empty())
+            {
+                compito = std::move(code[io].compiti.back());
+                code[io].compiti.pop_back();
+                return true;
+            }
+        }
+        for (unsigned i = 1; i < numero_thread; i++)
+        {
+            CodaLavoro &altra = code[(io + i) % numero_thread];
+            std::lock_guard<std::mutex> blocco(altra.mutex);
+            if (!altra.compiti.empty())
+            {
+                compito = std::move(altra.compiti.front());
+                altra.compiti.pop_front();
+                return true;
+            }
+        }
+        return false;
+    };
+
+    auto lavora = [&](unsigned io)
+    {
+        std::vector<unsigned char> buffer;
+        std::unique_ptr<NomeLungo> nome_lungo(new NomeLungo);
+        std::vector<Voce> &mie = risultati[io];
+        Compito compito;
+
+        while (in_sospeso.load() > 0)
+        {
+            unsigned long visti = accodati.load();
+            if (!prendi(io, compito))
+            {
+                std::unique_lock<std::mutex> blocco(attesa);
+                risveglio.wait(blocco, [&] { return accodati.load() != visti || in_sospeso.load() == 0; });
+                continue;
+            }
+
+            size_t prima = mie.size();
+            leggi_directory(img, vol, fat, compito.cluster, compito.percorso, mie, buffer, nome_lungo.get());
+
+            unsigned long nuovi = 0;
+            for (size_t i = prima; i < mie.size(); i++)
+            {
+                uint32_t cluster = mie[i].primo_cluster;
+                if (!(mie[i].attributi & ATTRIBUTO_DIRECTORY) || !cluster_valido(fat, cluster))
+                    continue;
+                if (visitata[cluster].exchange(1))
+                    continue;
+
+                in_sospeso++;
+                nuovi++;
+                std::lock_guard<std::mutex> blocco(code[io].mutex);
+                code[io].compiti.push_back(Compito{mie[i].percorso, cluster});
+            }
+            if (nuovi > 0)
+            {
+                {
+                    std::lock_guard<std::mutex> blocco(attesa);
+                    accodati += nuovi;
+                }
+                if (nuovi > 1)
+                    risveglio.notify_all();
+                else
+                    risveglio.notify_one();
+            }
+
+            if (--in_sospeso == 0)
+            {
+                std::lock_guard<std::mutex> blocco(attesa);
+                risveglio.notify_all();
+            }
+        }
+    };
+
+    std::vector<std::thread> thread;
+    for (unsigned i = 1; i < numero_thread; i++)
+        thread.emplace_back(lavora, i);
+    lavora(0);
+    for (std::thread &t : thread)
+        t.join();
+
+    std::vector<Voce> voci;
+    for (std::vector<Voce> &parziali : risultati)
+        voci.insert(voci.end(), std::make_move_iterator(parziali.begin()), std::make_move_iterator(parziali.end()));
+    std::sort(voci.begin(), voci.end(),
+              [](const Voce &a, const Voce &b) { return a.percorso < b.percorso; });
+    return voci;
+}
+
+#endif
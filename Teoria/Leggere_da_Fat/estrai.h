@@ -0,0 +1,141 @@
+#ifndef ESTRAI_H
+#define ESTRAI_H
+
+#include <sys/sendfile.h>
+
+#include "immagine.h"
+#include "fat.h"
+
+
+// Dimensione del buffer riutilizzato quando il kernel non puo' copiare da solo
+#define DIMENSIONE_BUFFER_ESTRAZIONE (1 << 20)
+
+
+/**
+ * scrivi_tutto scrive count byte sul descrittore, ripetendo le scritture
+ * parziali.
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+inline int scrivi_tutto(int fd, const unsigned char *dati, unsigned long count)
+{
+    while (count > 0)
+    {
+        ssize_t n = write(fd, dati, count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        dati += n;
+        count -= n;
+    }
+    return 0;
+}
+
+
+/**
+ * copia_nel_kernel prova a copiare un intervallo dell'immagine sul
+ * descrittore di uscita senza passare dallo spazio utente, con
+ * copy_file_range e poi con sendfile.
+ *
+ * @returns Il numero di byte copiati, che puo' essere 0 se nessuna delle
+ * due chiamate e' supportata per questa coppia di descrittori
+ */
+inline unsigned long copia_nel_kernel(Immagine *img, unsigned long pos, unsigned long count, int uscita)
+{
+    if (img->in_memoria)
+        return 0;
+
+    unsigned long copiati = 0;
+    while (copiati < count)
+    {
+        loff_t da = pos + copiati;
+        ssize_t n = copy_file_range(img->fd, &da, uscita, NULL, count - copiati, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        copiati += n;
+    }
+
+    while (copiati < count)
+    {
+        off_t da = pos + copiati;
+        ssize_t n = sendfile(uscita, img->fd, &da, count - copiati);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        copiati += n;
+    }
+    return copiati;
+}
+
+
+/**
+ * copia_intervallo copia un intervallo contiguo dell'immagine sul
+ * descrittore di uscita. Con l'immagine mappata si scrive direttamente
+ * dalla mappatura, altrimenti si passa dal buffer a dimensione fissa.
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+inline int copia_intervallo(Immagine *img, unsigned long pos, unsigned long count,
+                            int uscita, unsigned char *buffer)
+{
+    unsigned long copiati = copia_nel_kernel(img, pos, count, uscita);
+
+    const unsigned char *mappa = puntatore_immagine(img, pos, count);
+    if (mappa != NULL)
+        return scrivi_tutto(uscita, mappa + copiati, count - copiati);
+
+    while (copiati < count)
+    {
+        unsigned long quanti = count - copiati;
+        if (quanti > DIMENSIONE_BUFFER_ESTRAZIONE)
+            quanti = DIMENSIONE_BUFFER_ESTRAZIONE;
+        read_buffer(img, pos + copiati, quanti, buffer);
+        if (scrivi_tutto(uscita, buffer, quanti) != 0)
+            return -1;
+        copiati += quanti;
+    }
+    return 0;
+}
+
+
+/**
+ * estrai_contenuto copia il contenuto di un file dell'immagine sul
+ * descrittore di uscita, un'estensione alla volta e con memoria costante.
+ *
+ * @param img L'immagine, non deve essere NULL
+ * @param vol Il volume dell'immagine, non deve essere NULL
+ * @param fat La FAT caricata, non deve essere NULL
+ * @param primo_cluster Il primo cluster del file
+ * @param dimensione La dimensione del file in byte
+ * @param uscita Il descrittore su cui scrivere
+ * @param buffer Un buffer di DIMENSIONE_BUFFER_ESTRAZIONE byte, non deve essere NULL
+ *
+ * @returns Il numero di byte scritti, o -1 in caso di errore
+ */
+inline long estrai_contenuto(Immagine *img, const Volume *vol, const TabellaFat *fat,
+                             uint32_t primo_cluster, unsigned long dimensione,
+                             int uscita, unsigned char *buffer)
+{
+    if (img == NULL || vol == NULL || fat == NULL || buffer == NULL)
+        return -1;
+
+    unsigned long scritti = 0;
+    IteratoreCatena catena = inizia_catena(fat, primo_cluster);
+    Estensione estensione;
+    while (scritti < dimensione && prossima_estensione(&catena, &estensione))
+    {
+        unsigned long quanti = estensione.lunghezza * vol->byte_per_cluster;
+        if (quanti > dimensione - scritti)
+            quanti = dimensione - scritti;
+        if (copia_intervallo(img, posizione_cluster(vol, estensione.inizio), quanti, uscita, buffer) != 0)
+            return -1;
+        scritti += quanti;
+    }
+    return scritti;
+}
+
+#endif
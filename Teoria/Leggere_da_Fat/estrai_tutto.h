@@ -0,0 +1,480 @@
+#ifndef ESTRAI_TUTTO_H
+#define ESTRAI_TUTTO_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#include "immagine.h"
+#include "fat.h"
+#include "esplora.h"
+#include "anello_io.h"
+#include "parallelo.h"
+
+
+// La dimensione massima di una singola lettura o scrittura
+#define DIMENSIONE_PEZZO (1 << 18)
+
+// Quanti file dell'host si tengono aperti insieme: i file si copiano a lotti
+#define MASSIMO_FILE_APERTI 256
+
+
+// PezzoCopia e' un intervallo contiguo dell'immagine da copiare in un file
+// dell'host. I pezzi sono indipendenti e si possono completare in qualsiasi ordine.
+typedef struct
+{
+    int uscita;
+    unsigned long sorgente;
+    unsigned long destinazione;
+    unsigned long lunghezza;
+} PezzoCopia;
+
+
+// RisultatoEstrazione riassume un'estrazione di tutta l'immagine
+typedef struct
+{
+    unsigned long file;
+    unsigned long directory;
+    unsigned long byte;
+    unsigned long errori;
+
+    // 1 se la copia e' passata da io_uring, 0 se dal pool di thread
+    int anello;
+
+    // Chiamate a io_uring_enter: le letture e scritture dell'anello non
+    // passano da read e write e non compaiono altrove
+    unsigned long ingressi_anello;
+} RisultatoEstrazione;
+
+
+/**
+ * percorso_sicuro dice se un percorso dell'immagine si puo' ricreare sotto
+ * la cartella di destinazione: un nome lungo costruito ad arte potrebbe
+ * contenere componenti "." o ".." e uscirne.
+ */
+inline int percorso_sicuro(const std::string &percorso)
+{
+    size_t inizio = 0;
+    while (inizio < percorso.size())
+    {
+        size_t fine = percorso.find('/', inizio);
+        if (fine == std::string::npos)
+            fine = percorso.size();
+        std::string componente = percorso.substr(inizio, fine - inizio);
+        if (componente == "." || componente == "..")
+            return 0;
+        inizio = fine + 1;
+    }
+    return 1;
+}
+
+
+/**
+ * aggiungi_pezzi divide le estensioni di un file in pezzi da al massimo
+ * DIMENSIONE_PEZZO byte. I pezzi oltre la fine dell'immagine vengono
+ * tagliati: quei byte restano a zero nel file di uscita.
+ */
+inline void aggiungi_pezzi(const Immagine *img, const Volume *vol, const TabellaFat *fat,
+                           const Voce &voce, int uscita, std::vector<PezzoCopia> &pezzi)
+{
+    unsigned long pianificati = 0;
+    IteratoreCatena catena = inizia_catena(fat, voce.primo_cluster);
+    Estensione estensione;
+
+    while (pianificati < voce.dimensione && prossima_estensione(&catena, &estensione))
+    {
+        unsigned long sorgente = posizione_cluster(vol, estensione.inizio);
+        unsigned long quanti = estensione.lunghezza * vol->byte_per_cluster;
+        if (quanti > voce.dimensione - pianificati)
+            quanti = voce.dimensione - pianificati;
+
+        unsigned long utili = 0;
+        if (sorgente < img->dimensione)
+            utili = img->dimensione - sorgente < quanti ? img->dimensione - sorgente : quanti;
+
+        for (unsigned long fatto = 0; fatto < utili; fatto += DIMENSIONE_PEZZO)
+        {
+            unsigned long lunghezza = utili - fatto < DIMENSIONE_PEZZO ? utili - fatto : DIMENSIONE_PEZZO;
+            pezzi.push_back(PezzoCopia{uscita, sorgente + fatto, pianificati + fatto, lunghezza});
+        }
+        pianificati += quanti;
+    }
+}
+
+
+// Lo stato di uno dei posti in volo dell'anello
+typedef struct
+{
+    size_t pezzo;
+    unsigned long letti;
+    unsigned long scritti;
+} PostoCopia;
+
+
+// MotoreAnello e' l'io_uring di un'intera estrazione: si crea una volta e
+// serve tutti i lotti. Se l'immagine non e' mappata ogni posto ha il suo
+// buffer da DIMENSIONE_PEZZO byte.
+typedef struct
+{
+    AnelloIo anello;
+    unsigned profondita;
+    unsigned char *buffer;
+
+    // 1 dopo il primo completamento riuscito: da li' in poi un -EINVAL e'
+    // un errore del pezzo, non un kernel che non conosce le operazioni
+    int provato;
+
+    // 1 se nel kernel sono rimaste operazioni che non si sono potute
+    // aspettare: potrebbero ancora scrivere nel buffer, che non si libera
+    int bloccato;
+} MotoreAnello;
+
+
+/**
+ * crea_motore prepara l'anello e i buffer dei posti.
+ *
+ * @returns -1 se io_uring non e' disponibile o manca la memoria, 0 altrimenti
+ */
+inline int crea_motore(MotoreAnello *m, const Immagine *img, unsigned profondita)
+{
+    memset(m, 0, sizeof(MotoreAnello));
+    m->profondita = profondita;
+    if (crea_anello(&m->anello, profondita) != 0)
+        return -1;
+    if (img->dati == NULL)
+    {
+        m->buffer = (unsigned char *)malloc((unsigned long)profondita * DIMENSIONE_PEZZO);
+        if (m->buffer == NULL)
+        {
+            distruggi_anello(&m->anello);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+inline void distruggi_motore(MotoreAnello *m)
+{
+    distruggi_anello(&m->anello);
+    if (!m->bloccato)
+        free(m->buffer);
+    m->buffer = NULL;
+}
+
+
+/**
+ * copia_pezzi_anello copia i pezzi con io_uring tenendo in volo fino a
+ * profondita operazioni. Con l'immagine mappata ogni pezzo e' una sola
+ * scrittura dalla mappatura; altrimenti e' una lettura nel buffer del posto
+ * seguita da una scrittura. I pezzi finiscono in ordine sparso.
+ *
+ * Se l'anello smette di rispondere, o se il kernel rifiuta le operazioni
+ * al primo completamento, si aspettano quelle gia' inviate e si
+ * restituisce -1: il chiamante rifa' tutto il lotto con i thread, e
+ * l'anello non va piu' usato.
+ *
+ * @returns Il numero di byte scritti, o -1 se io_uring non e' utilizzabile
+ */
+inline long copia_pezzi_anello(Immagine *img, MotoreAnello *m, const std::vector<PezzoCopia> &pezzi,
+                               unsigned long *errori)
+{
+    AnelloIo *anello = &m->anello;
+    unsigned profondita = m->profondita;
+    unsigned char *buffer = m->buffer;
+
+    std::vector<PostoCopia> posti(profondita);
+    std::vector<unsigned> liberi;
+    for (unsigned i = 0; i < profondita; i++)
+        liberi.push_back(profondita - 1 - i);
+
+    // accoda il prossimo passo del posto: leggere quello che manca o scriverlo
+    auto avvia = [&](unsigned p)
+    {
+        const PezzoCopia &pezzo = pezzi[posti[p].pezzo];
+        PostoCopia &posto = posti[p];
+        if (img->dati != NULL)
+            accoda_operazione(anello, IORING_OP_WRITE, pezzo.uscita, img->dati + pezzo.sorgente + posto.scritti,
+                              pezzo.lunghezza - posto.scritti, pezzo.destinazione + posto.scritti, p);
+        else if (posto.letti < pezzo.lunghezza)
+            accoda_operazione(anello, IORING_OP_READ, img->fd, buffer + (unsigned long)p * DIMENSIONE_PEZZO + posto.letti,
+                              pezzo.lunghezza - posto.letti, pezzo.sorgente + posto.letti, p);
+        else
+            accoda_operazione(anello, IORING_OP_WRITE, pezzo.uscita, buffer + (unsigned long)p * DIMENSIONE_PEZZO + posto.scritti,
+                              pezzo.lunghezza - posto.scritti, pezzo.destinazione + posto.scritti, p);
+    };
+
+    long byte = 0;
+    unsigned long falliti = 0;
+    size_t prossimo = 0;
+    unsigned in_volo = 0;
+
+    // aspetta le operazioni gia' passate al kernel, che usano ancora i
+    // buffer; quelle accodate e mai inviate non partiranno piu'
+    auto abbandona = [&]() -> long
+    {
+        unsigned long nel_kernel = in_volo - anello->da_inviare;
+        anello->da_inviare = 0;
+        uint64_t dato;
+        int risultato;
+        while (nel_kernel > 0)
+        {
+            while (nel_kernel > 0 && prossimo_completamento(anello, &dato, &risultato))
+                nel_kernel--;
+            if (nel_kernel > 0 && invia_e_attendi(anello, 1) != 0)
+            {
+                m->bloccato = 1;
+                break;
+            }
+        }
+        return -1;
+    };
+
+    while (prossimo < pezzi.size() || in_volo > 0)
+    {
+        while (!liberi.empty() && prossimo < pezzi.size())
+        {
+            unsigned p = liberi.back();
+            liberi.pop_back();
+            posti[p] = PostoCopia{prossimo++, 0, 0};
+            avvia(p);
+            in_volo++;
+        }
+
+        if (invia_e_attendi(anello, 1) != 0)
+            return abbandona();
+
+        uint64_t dato;
+        int risultato;
+        while (prossimo_completamento(anello, &dato, &risultato))
+        {
+            unsigned p = dato;
+            PostoCopia &posto = posti[p];
+            const PezzoCopia &pezzo = pezzi[posto.pezzo];
+            int in_lettura = img->dati == NULL && posto.letti < pezzo.lunghezza;
+
+            // un kernel con io_uring ma senza IORING_OP_READ e WRITE
+            if (!m->provato && (risultato == -EINVAL || risultato == -EOPNOTSUPP))
+            {
+                in_volo--;
+                return abbandona();
+            }
+            if (risultato == -EINTR || risultato == -EAGAIN)
+            {
+                avvia(p);
+                continue;
+            }
+            if (risultato < 0 || (risultato == 0 && !in_lettura))
+            {
+                falliti++;
+                liberi.push_back(p);
+                in_volo--;
+                continue;
+            }
+            m->provato = 1;
+
+            if (in_lettura)
+            {
+                // fine dell'immagine: il resto del pezzo vale 0
+                if (risultato == 0)
+                {
+                    memset(buffer + (unsigned long)p * DIMENSIONE_PEZZO + posto.letti, 0, pezzo.lunghezza - posto.letti);
+                    posto.letti = pezzo.lunghezza;
+                }
+                else
+                    posto.letti += risultato;
+                avvia(p);
+                continue;
+            }
+
+            posto.scritti += risultato;
+            if (posto.scritti < pezzo.lunghezza)
+            {
+                avvia(p);
+                continue;
+            }
+            byte += pezzo.lunghezza;
+            liberi.push_back(p);
+            in_volo--;
+        }
+    }
+
+    *errori += falliti;
+    return byte;
+}
+
+
+/**
+ * pwrite_tutto scrive count byte da pos, ripetendo le scritture parziali.
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+inline int pwrite_tutto(int fd, const unsigned char *dati, unsigned long count, unsigned long pos)
+{
+    while (count > 0)
+    {
+        ssize_t n = pwrite(fd, dati, count, pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        dati += n;
+        count -= n;
+        pos += n;
+    }
+    return 0;
+}
+
+
+/**
+ * copia_pezzi_thread e' la versione senza io_uring: numero_thread thread
+ * si dividono i pezzi e li copiano con pread e pwrite.
+ *
+ * @returns Il numero di byte scritti
+ */
+inline long copia_pezzi_thread(Immagine *img, const std::vector<PezzoCopia> &pezzi,
+                               unsigned numero_thread, unsigned long *errori)
+{
+    if (numero_thread == 0)
+        numero_thread = 1;
+
+    std::atomic<long> byte(0);
+    std::atomic<unsigned long> falliti(0);
+    std::vector<std::vector<unsigned char>> buffer(numero_thread,
+                                                   std::vector<unsigned char>(img->dati == NULL ? DIMENSIONE_PEZZO : 0));
+
+    per_ogni_indice(pezzi.size(), numero_thread, [&](size_t i, unsigned lavoratore)
+    {
+        const PezzoCopia &pezzo = pezzi[i];
+        const unsigned char *dati = puntatore_immagine(img, pezzo.sorgente, pezzo.lunghezza);
+        if (dati == NULL)
+        {
+            // il contenuto dei file non passa dalla cache dei settori
+            unsigned char *proprio = buffer[lavoratore].data();
+            unsigned long letti = pread_tutto(img->fd, proprio, pezzo.lunghezza, pezzo.sorgente);
+            memset(proprio + letti, 0, pezzo.lunghezza - letti);
+            dati = proprio;
+        }
+        if (pwrite_tutto(pezzo.uscita, dati, pezzo.lunghezza, pezzo.destinazione) != 0)
+            falliti++;
+        else
+            byte += pezzo.lunghezza;
+    });
+
+    *errori += falliti;
+    return byte;
+}
+
+
+/**
+ * copia_lotto copia i pezzi di un lotto di file con il motore scelto,
+ * ripiegando sul pool di thread se io_uring non c'e' o non funziona.
+ *
+ * @param motore L'anello dell'estrazione; non usato se r->anello e' 0
+ */
+inline void copia_lotto(Immagine *img, MotoreAnello *motore, const std::vector<PezzoCopia> &pezzi,
+                        unsigned profondita, RisultatoEstrazione *r)
+{
+    if (pezzi.empty())
+        return;
+
+    long byte = -1;
+    if (r->anello)
+        byte = copia_pezzi_anello(img, motore, pezzi, &r->errori);
+    if (byte < 0)
+    {
+        r->anello = 0;
+        byte = copia_pezzi_thread(img, pezzi, profondita, &r->errori);
+    }
+    r->byte += byte;
+}
+
+
+/**
+ * estrai_albero ricrea sotto cartella tutte le directory e i file dell'albero.
+ * Le estensioni di MASSIMO_FILE_APERTI file alla volta vengono spezzate in
+ * pezzi e copiate insieme, con profondita operazioni in volo. L'io_uring
+ * si crea una volta sola e serve tutti i lotti.
+ *
+ * @param voci Le voci dell'albero ordinate per percorso, come da esplora_albero
+ * @param cartella La cartella di destinazione, deve esistere
+ * @param profondita Quante letture o scritture tenere in volo, almeno 1
+ * @param usa_anello 0 per usare sempre il pool di thread
+ * @param r Il riassunto da riempire, non deve essere NULL
+ */
+inline void estrai_albero(Immagine *img, const Volume *vol, const TabellaFat *fat,
+                          const std::vector<Voce> &voci, const char *cartella,
+                          unsigned profondita, int usa_anello, RisultatoEstrazione *r)
+{
+    memset(r, 0, sizeof(RisultatoEstrazione));
+    if (profondita == 0)
+        profondita = 1;
+
+    MotoreAnello motore;
+    int con_motore = usa_anello && crea_motore(&motore, img, profondita) == 0;
+    r->anello = con_motore;
+
+    std::vector<PezzoCopia> pezzi;
+    std::vector<int> aperti;
+
+    auto chiudi_lotto = [&]()
+    {
+        copia_lotto(img, &motore, pezzi, profondita, r);
+        for (int fd : aperti)
+            close(fd);
+        pezzi.clear();
+        aperti.clear();
+    };
+
+    for (const Voce &voce : voci)
+    {
+        if (!percorso_sicuro(voce.percorso))
+        {
+            fprintf(stderr, "Percorso non sicuro ignorato: %s\n", voce.percorso.c_str());
+            r->errori++;
+            continue;
+        }
+        std::string destinazione = std::string(cartella) + voce.percorso;
+
+        // le voci sono ordinate, quindi ogni directory arriva prima del suo contenuto
+        if (voce.attributi & ATTRIBUTO_DIRECTORY)
+        {
+            if (mkdir(destinazione.c_str(), 0755) != 0 && errno != EEXIST)
+            {
+                perror(destinazione.c_str());
+                r->errori++;
+            }
+            else
+                r->directory++;
+            continue;
+        }
+
+        int uscita = open(destinazione.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (uscita < 0)
+        {
+            perror(destinazione.c_str());
+            r->errori++;
+            continue;
+        }
+
+        // la dimensione si fissa subito: i pezzi possono arrivare in qualsiasi ordine
+        if (ftruncate(uscita, voce.dimensione) != 0)
+            r->errori++;
+        r->file++;
+
+        aggiungi_pezzi(img, vol, fat, voce, uscita, pezzi);
+        aperti.push_back(uscita);
+        if (aperti.size() == MASSIMO_FILE_APERTI)
+            chiudi_lotto();
+    }
+    chiudi_lotto();
+
+    if (con_motore)
+    {
+        r->ingressi_anello = motore.anello.ingressi;
+        distruggi_motore(&motore);
+    }
+}
+
+#endif
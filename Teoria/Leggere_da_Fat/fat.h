@@ -0,0 +1,432 @@
+#ifndef FAT_H
+#define FAT_H
+
+#include <stdint.h>
+
+#include "immagine.h"
+
+
+// Valori normalizzati delle voci della FAT, uguali per ogni tipo di FAT
+#define CLUSTER_LIBERO 0x00000000u
+#define CLUSTER_DANNEGGIATO 0x0FFFFFF7u
+#define CLUSTER_FINE 0x0FFFFFFFu
+
+
+// Volume raccoglie i dati del boot sector e le posizioni delle aree.
+typedef struct
+{
+    unsigned char nome_del_filesystem[9];
+    unsigned long byte_per_settore;
+    unsigned long byte_per_cluster;
+    unsigned long numero_settori_riservati;
+    unsigned long inizio_area_fat;
+    unsigned long numero_fat;
+    unsigned long numero_righe_dir;
+    unsigned long bytes_per_fat;
+    unsigned long inizio_root_dir;
+    unsigned long inizio_area_dati;
+    unsigned long dimensione_disco;
+    unsigned long numero_cluster;
+
+    // Il byte dell'immagine da cui parte il volume: 0, o l'inizio della partizione
+    unsigned long inizio_partizione;
+
+    // 12, 16 o 32, ricavato dal numero di cluster
+    int tipo_fat;
+
+    // Il primo cluster della root directory, 0 se la root ha un'area fissa
+    uint32_t cluster_root;
+
+    // Il numero di serie scritto alla formattazione
+    uint32_t numero_serie;
+} Volume;
+
+
+/**
+ * leggi_volume legge il boot sector e calcola le posizioni delle aree.
+ * Il tipo di FAT si ricava dal numero di cluster, come prescrive la
+ * specifica: meno di 4085 e' FAT12, meno di 65525 e' FAT16, altrimenti FAT32.
+ *
+ * Le posizioni sono relative all'inizio dell'immagine, anche quando il
+ * volume e' una partizione di un disco intero.
+ *
+ * @param img L'immagine da cui leggere, non deve essere NULL
+ * @param vol Il volume da riempire, non deve essere NULL
+ * @param inizio Il byte dell'immagine in cui inizia il volume, 0 se l'immagine e' il volume
+ *
+ * @returns -1 se il boot sector non e' valido, 0 altrimenti
+ */
+inline int leggi_volume(Immagine *img, Volume *vol, unsigned long inizio = 0)
+{
+    if (img == NULL || vol == NULL)
+        return -1;
+
+    memset(vol, 0, sizeof(Volume));
+    read_string(img, inizio + 0x03, 8, vol->nome_del_filesystem);
+    vol->byte_per_settore = read_number(img, inizio + 0x0b, 2);
+    vol->byte_per_cluster = vol->byte_per_settore * read_number(img, inizio + 0x0d, 1);
+    vol->numero_settori_riservati = read_number(img, inizio + 0x0e, 2);
+    vol->inizio_partizione = inizio;
+    vol->inizio_area_fat = inizio + vol->numero_settori_riservati * vol->byte_per_settore;
+    vol->numero_fat = read_number(img, inizio + 0x10, 1);
+    vol->numero_righe_dir = read_number(img, inizio + 0x11, 2);
+    vol->bytes_per_fat = vol->byte_per_settore * read_number(img, inizio + 0x16, 2);
+
+    // su FAT32 i settori per FAT a 16 bit valgono 0 e si usa il campo a 0x24
+    if (vol->bytes_per_fat == 0)
+        vol->bytes_per_fat = vol->byte_per_settore * read_number(img, inizio + 0x24, 4);
+
+    vol->inizio_root_dir = vol->inizio_area_fat + vol->bytes_per_fat * vol->numero_fat;
+    vol->inizio_area_dati = vol->inizio_root_dir + 32 * vol->numero_righe_dir;
+    vol->dimensione_disco = vol->byte_per_settore * read_number(img, inizio + 0x20, 4);
+    if (vol->dimensione_disco == 0)
+        vol->dimensione_disco = vol->byte_per_settore * read_number(img, inizio + 0x13, 2);
+
+    if (vol->byte_per_cluster == 0 || vol->bytes_per_fat == 0)
+        return -1;
+    if (inizio + vol->dimensione_disco > vol->inizio_area_dati)
+        vol->numero_cluster = (inizio + vol->dimensione_disco - vol->inizio_area_dati) / vol->byte_per_cluster;
+
+    if (vol->numero_cluster < 4085)
+        vol->tipo_fat = 12;
+    else if (vol->numero_cluster < 65525)
+        vol->tipo_fat = 16;
+    else
+        vol->tipo_fat = 32;
+
+    // su FAT32 la root directory e' una normale catena di cluster
+    // e la parte estesa del boot sector si sposta da 0x24 a 0x40
+    if (vol->tipo_fat == 32)
+    {
+        vol->cluster_root = read_number(img, inizio + 0x2c, 4) & 0x0FFFFFFF;
+        vol->inizio_root_dir = vol->inizio_area_dati + (vol->cluster_root - 2) * vol->byte_per_cluster;
+        vol->numero_serie = read_number(img, inizio + 0x43, 4);
+    }
+    else
+        vol->numero_serie = read_number(img, inizio + 0x27, 4);
+    return 0;
+}
+
+
+/**
+ * posizione_cluster restituisce l'offset in byte del cluster nell'immagine.
+ */
+inline unsigned long posizione_cluster(const Volume *vol, uint32_t cluster)
+{
+    // cluster 0 e 1 non esistono, l'area dati parte dal cluster 2
+    return vol->inizio_area_dati + (unsigned long)(cluster - 2) * vol->byte_per_cluster;
+}
+
+
+// TabellaFat contiene la FAT decodificata una sola volta in memoria:
+// prossimo[c] e' il cluster che segue c nella catena.
+typedef struct
+{
+    // Le voci decodificate, una per cluster
+    uint32_t *prossimo;
+
+    // Il numero di voci della tabella (cluster dati + 2)
+    unsigned long numero_voci;
+} TabellaFat;
+
+
+// VoceFat<BIT> sa leggere una voce grezza di una FAT a 12, 16 o 32 bit
+// e riportarla ai valori normalizzati. Ogni specializzazione viene
+// istanziata a parte, cosi' il ciclo di decodifica non controlla il tipo.
+template <int BIT>
+struct VoceFat;
+
+
+template <>
+struct VoceFat<12>
+{
+    static const uint32_t danneggiato = 0xFF7;
+    static const uint32_t fine = 0xFF8;
+
+    static unsigned long byte_per_voci(unsigned long voci) { return (voci * 3 + 1) / 2; }
+
+    static uint32_t leggi(const unsigned char *grezza, unsigned long c)
+    {
+        // due voci da 12 bit occupano tre byte
+        const unsigned char *p = grezza + c + c / 2;
+        uint32_t coppia = p[0] | (p[1] << 8);
+        return (c & 1) ? coppia >> 4 : coppia & 0xFFF;
+    }
+
+    static void scrivi(unsigned char *grezza, unsigned long c, uint32_t voce)
+    {
+        unsigned char *p = grezza + c + c / 2;
+        if (c & 1)
+        {
+            p[0] = (p[0] & 0x0f) | ((voce & 0x0f) << 4);
+            p[1] = voce >> 4;
+        }
+        else
+        {
+            p[0] = voce & 0xff;
+            p[1] = (p[1] & 0xf0) | ((voce >> 8) & 0x0f);
+        }
+    }
+};
+
+
+template <>
+struct VoceFat<16>
+{
+    static const uint32_t danneggiato = 0xFFF7;
+    static const uint32_t fine = 0xFFF8;
+
+    static unsigned long byte_per_voci(unsigned long voci) { return voci * 2; }
+
+    static uint32_t leggi(const unsigned char *grezza, unsigned long c)
+    {
+        return grezza[2 * c] | (grezza[2 * c + 1] << 8);
+    }
+
+    static void scrivi(unsigned char *grezza, unsigned long c, uint32_t voce)
+    {
+        grezza[2 * c] = voce & 0xff;
+        grezza[2 * c + 1] = voce >> 8;
+    }
+};
+
+
+template <>
+struct VoceFat<32>
+{
+    static const uint32_t danneggiato = 0x0FFFFFF7;
+    static const uint32_t fine = 0x0FFFFFF8;
+
+    static unsigned long byte_per_voci(unsigned long voci) { return voci * 4; }
+
+    static uint32_t leggi(const unsigned char *grezza, unsigned long c)
+    {
+        // i 4 bit alti sono riservati e vanno ignorati
+        const unsigned char *p = grezza + 4 * c;
+        return (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24)) & 0x0FFFFFFF;
+    }
+
+    static void scrivi(unsigned char *grezza, unsigned long c, uint32_t voce)
+    {
+        // i 4 bit alti si conservano come sono
+        unsigned char *p = grezza + 4 * c;
+        p[0] = voce & 0xff;
+        p[1] = voce >> 8;
+        p[2] = voce >> 16;
+        p[3] = (p[3] & 0xf0) | ((voce >> 24) & 0x0f);
+    }
+};
+
+
+template <int BIT>
+void decodifica_fat(const unsigned char *grezza, TabellaFat *fat)
+{
+    for (unsigned long c = 0; c < fat->numero_voci; c++)
+    {
+        uint32_t voce = VoceFat<BIT>::leggi(grezza, c);
+        if (voce >= VoceFat<BIT>::fine)
+            voce = CLUSTER_FINE;
+        else if (voce == VoceFat<BIT>::danneggiato)
+            voce = CLUSTER_DANNEGGIATO;
+        fat->prossimo[c] = voce;
+    }
+}
+
+
+// codifica_voce_fat scrive una voce normalizzata nella FAT grezza,
+// riportando fine catena e cluster danneggiato ai valori del tipo di FAT
+template <int BIT>
+void codifica_voce_fat(unsigned char *grezza, unsigned long c, uint32_t voce)
+{
+    if (voce == CLUSTER_FINE)
+        voce = VoceFat<BIT>::fine | 0x7;
+    else if (voce == CLUSTER_DANNEGGIATO)
+        voce = VoceFat<BIT>::danneggiato;
+    VoceFat<BIT>::scrivi(grezza, c, voce);
+}
+
+
+template <int BIT>
+int carica_voci_fat(Immagine *img, const Volume *vol, TabellaFat *fat)
+{
+    // non si va oltre le voci che la FAT puo' davvero contenere
+    fat->numero_voci = vol->numero_cluster + 2;
+    if (fat->numero_voci > vol->bytes_per_fat * 8 / BIT)
+        fat->numero_voci = vol->bytes_per_fat * 8 / BIT;
+
+    fat->prossimo = (uint32_t *)malloc(sizeof(uint32_t) * fat->numero_voci);
+    if (fat->prossimo == NULL)
+        return -1;
+
+    // con l'immagine mappata si decodifica direttamente dalla mappatura,
+    // altrimenti una sola lettura per tutta la FAT
+    unsigned long byte = VoceFat<BIT>::byte_per_voci(fat->numero_voci) + 1;
+    const unsigned char *grezza = puntatore_immagine(img, vol->inizio_area_fat, byte);
+    unsigned char *copia = NULL;
+    if (grezza == NULL)
+    {
+        copia = (unsigned char *)malloc(byte);
+        if (copia == NULL)
+            return -1;
+        read_buffer(img, vol->inizio_area_fat, byte, copia);
+        grezza = copia;
+    }
+
+    decodifica_fat<BIT>(grezza, fat);
+    free(copia);
+    return 0;
+}
+
+
+/**
+ * carica_tabella_fat legge la prima copia della FAT dall'immagine e la
+ * decodifica in un array di uint32_t, con il decodificatore del tipo di FAT
+ * del volume.
+ *
+ * @param img L'immagine da cui leggere, non deve essere NULL
+ * @param vol Il volume dell'immagine, non deve essere NULL
+ *
+ * @returns La tabella caricata, o NULL in caso di errore
+ */
+inline TabellaFat *carica_tabella_fat(Immagine *img, const Volume *vol)
+{
+    if (img == NULL || vol == NULL)
+        return NULL;
+
+    TabellaFat *fat = (TabellaFat *)calloc(1, sizeof(TabellaFat));
+    if (fat == NULL)
+        return NULL;
+
+    int ret = -1;
+    switch (vol->tipo_fat)
+    {
+    case 12:
+        ret = carica_voci_fat<12>(img, vol, fat);
+        break;
+    case 16:
+        ret = carica_voci_fat<16>(img, vol, fat);
+        break;
+    case 32:
+        ret = carica_voci_fat<32>(img, vol, fat);
+        break;
+    }
+
+    if (ret != 0)
+    {
+        free(fat->prossimo);
+        free(fat);
+        return NULL;
+    }
+    return fat;
+}
+
+
+/**
+ * distruggi_tabella_fat libera la tabella caricata con carica_tabella_fat.
+ *
+ * @param fat La tabella da liberare, non deve essere NULL
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+inline int distruggi_tabella_fat(TabellaFat *fat)
+{
+    if (fat == NULL)
+        return -1;
+
+    free(fat->prossimo);
+    free(fat);
+    return 0;
+}
+
+
+// IteratoreCatena scorre in ordine i cluster di un file seguendo la FAT.
+typedef struct
+{
+    // La tabella da seguire
+    const TabellaFat *fat;
+
+    // Il prossimo cluster da restituire, 0 a catena finita
+    uint32_t corrente;
+
+    // Quanti cluster sono stati restituiti, serve a fermare i cicli
+    unsigned long passi;
+} IteratoreCatena;
+
+
+inline int cluster_valido(const TabellaFat *fat, uint32_t cluster)
+{
+    return cluster >= 2 && cluster < fat->numero_voci;
+}
+
+
+inline IteratoreCatena inizia_catena(const TabellaFat *fat, uint32_t primo_cluster)
+{
+    IteratoreCatena it;
+    it.fat = fat;
+    it.corrente = cluster_valido(fat, primo_cluster) ? primo_cluster : 0;
+    it.passi = 0;
+    return it;
+}
+
+
+/**
+ * prossimo_cluster restituisce il prossimo cluster della catena.
+ *
+ * @param it L'iteratore, non deve essere NULL
+ *
+ * @returns Il cluster, o 0 quando la catena e' finita o non e' valida
+ */
+inline uint32_t prossimo_cluster(IteratoreCatena *it)
+{
+    uint32_t cluster = it->corrente;
+    if (cluster == 0)
+        return 0;
+
+    // una catena piu' lunga della FAT contiene per forza un ciclo
+    if (++it->passi > it->fat->numero_voci)
+    {
+        it->corrente = 0;
+        return 0;
+    }
+
+    uint32_t successivo = it->fat->prossimo[cluster];
+    it->corrente = cluster_valido(it->fat, successivo) ? successivo : 0;
+    return cluster;
+}
+
+
+// Estensione e' una sequenza di cluster consecutivi della stessa catena,
+// che si puo' leggere con un'unica operazione.
+typedef struct
+{
+    // Il primo cluster della sequenza
+    uint32_t inizio;
+
+    // Il numero di cluster consecutivi
+    uint32_t lunghezza;
+} Estensione;
+
+
+/**
+ * prossima_estensione unisce i prossimi cluster consecutivi della catena
+ * in un'unica estensione.
+ *
+ * @param it L'iteratore della catena, non deve essere NULL
+ * @param est L'estensione da riempire, non deve essere NULL
+ *
+ * @returns 1 se e' stata prodotta un'estensione, 0 a catena finita
+ */
+inline int prossima_estensione(IteratoreCatena *it, Estensione *est)
+{
+    uint32_t cluster = prossimo_cluster(it);
+    if (cluster == 0)
+        return 0;
+
+    est->inizio = cluster;
+    est->lunghezza = 1;
+    while (it->corrente == est->inizio + est->lunghezza && prossimo_cluster(it) != 0)
+        est->lunghezza++;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,44 @@
+// Genera un'immagine FAT12/16/32 sintetica per provare il lettore.
+//
+// g++ -O2 -o genera_immagine genera_immagine.cpp
+// ./genera_immagine <uscita> [tipo FAT] [MiB] [byte per cluster] [file]
+//                   [profondita'] [frammentazione %] [dimensione media file] [seme]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "generatore.h"
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "uso: %s <uscita> [tipo FAT] [MiB] [byte per cluster] [file] [profondita'] "
+                        "[frammentazione %%] [dimensione media file] [seme]\n", argv[0]);
+        return 1;
+    }
+
+    ParametriImmagine p;
+    p.tipo_fat = argc > 2 ? atoi(argv[2]) : 16;
+    p.dimensione = (argc > 3 ? strtoul(argv[3], NULL, 10) : 32) << 20;
+    p.byte_per_cluster = argc > 4 ? strtoul(argv[4], NULL, 10) : 2048;
+    p.numero_file = argc > 5 ? strtoul(argv[5], NULL, 10) : 1000;
+    p.profondita = argc > 6 ? atoi(argv[6]) : 3;
+    p.frammentazione = argc > 7 ? atoi(argv[7]) : 0;
+    p.dimensione_media_file = argc > 8 ? strtoul(argv[8], NULL, 10) : 8192;
+    p.seme = argc > 9 ? strtoul(argv[9], NULL, 10) : 1;
+
+    if (p.tipo_fat != 12 && p.tipo_fat != 16 && p.tipo_fat != 32)
+    {
+        fprintf(stderr, "Tipo di FAT non valido: %d\n", p.tipo_fat);
+        return 1;
+    }
+
+    if (genera_immagine(argv[1], &p) != 0)
+        return 1;
+
+    printf("%s: FAT%d, %lu MiB, cluster da %lu byte, %lu file, profondita' %u, frammentazione %u%%\n",
+           argv[1], p.tipo_fat, p.dimensione >> 20, p.byte_per_cluster, p.numero_file, p.profondita, p.frammentazione);
+    return 0;
+}
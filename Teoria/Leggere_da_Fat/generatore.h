@@ -0,0 +1,575 @@
+#ifndef GENERATORE_H
+#define GENERATORE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "nomi_lunghi.h"
+
+
+#define BYTE_PER_SETTORE_GENERATO 512
+
+
+// ParametriImmagine descrive l'immagine sintetica da generare
+typedef struct
+{
+    // 12, 16 o 32: deve corrispondere al numero di cluster che ne risulta
+    int tipo_fat;
+
+    // La dimensione dell'immagine in byte
+    unsigned long dimensione;
+
+    // Multiplo di 512 e potenza di 2, al massimo 64 KiB
+    unsigned long byte_per_cluster;
+
+    unsigned long numero_file;
+
+    // Quanti livelli di sottodirectory sotto la root, 0 per averle tutte nella root
+    unsigned profondita;
+
+    // Probabilita' in percentuale che il prossimo cluster di una catena non sia contiguo
+    unsigned frammentazione;
+
+    // I file hanno una dimensione casuale tra 0 e il doppio di questa
+    unsigned long dimensione_media_file;
+
+    // Lo stesso seme produce la stessa immagine; e' anche il numero di serie del volume
+    uint32_t seme;
+} ParametriImmagine;
+
+
+// GeneratoreFat contiene lo stato della generazione: l'immagine mappata,
+// la FAT in costruzione e il cursore dell'allocatore
+typedef struct
+{
+    unsigned char *dati;
+    unsigned long dimensione;
+    int tipo_fat;
+    unsigned long byte_per_cluster;
+    unsigned long settori_riservati;
+    unsigned long settori_per_fat;
+    unsigned long righe_root;
+    unsigned long inizio_area_dati;
+    unsigned long numero_cluster;
+
+    std::vector<uint32_t> fat;
+    uint32_t cursore;
+    unsigned long liberi;
+    uint64_t stato_casuale;
+} GeneratoreFat;
+
+
+struct DirectoryGenerata
+{
+    int padre;
+    unsigned livello;
+    unsigned char nome[11];
+    std::vector<int> sottodirectory;
+    std::vector<int> file;
+    std::vector<uint32_t> cluster;
+};
+
+
+struct FileGenerato
+{
+    unsigned char nome[11];
+    std::string nome_lungo;
+    unsigned long dimensione;
+    std::vector<uint32_t> cluster;
+};
+
+
+// xorshift64: veloce e uguale su ogni piattaforma, a differenza di rand()
+inline uint64_t casuale(GeneratoreFat *g)
+{
+    g->stato_casuale ^= g->stato_casuale << 13;
+    g->stato_casuale ^= g->stato_casuale >> 7;
+    g->stato_casuale ^= g->stato_casuale << 17;
+    return g->stato_casuale;
+}
+
+
+/**
+ * calcola_geometria trova quanti settori servono a ogni FAT, che dipendono
+ * dal numero di cluster, che a sua volta dipende dallo spazio delle FAT.
+ *
+ * @returns -1 se i parametri non danno il tipo di FAT richiesto, 0 altrimenti
+ */
+inline int calcola_geometria(GeneratoreFat *g, const ParametriImmagine *p)
+{
+    unsigned long totale = p->dimensione / BYTE_PER_SETTORE_GENERATO;
+    unsigned long settori_per_cluster = p->byte_per_cluster / BYTE_PER_SETTORE_GENERATO;
+
+    g->tipo_fat = p->tipo_fat;
+    g->byte_per_cluster = p->byte_per_cluster;
+    g->settori_riservati = p->tipo_fat == 32 ? 32 : 1;
+    g->righe_root = p->tipo_fat == 32 ? 0 : 512;
+    unsigned long settori_root = g->righe_root * 32 / BYTE_PER_SETTORE_GENERATO;
+
+    g->settori_per_fat = 1;
+    for (int giro = 0; giro < 64; giro++)
+    {
+        unsigned long occupati = g->settori_riservati + settori_root + 2 * g->settori_per_fat;
+        if (occupati >= totale)
+            return -1;
+        g->numero_cluster = (totale - occupati) / settori_per_cluster;
+
+        unsigned long byte_fat = ((g->numero_cluster + 2) * p->tipo_fat + 7) / 8;
+        unsigned long servono = (byte_fat + BYTE_PER_SETTORE_GENERATO - 1) / BYTE_PER_SETTORE_GENERATO;
+        if (servono <= g->settori_per_fat)
+            break;
+        g->settori_per_fat = servono;
+    }
+
+    g->inizio_area_dati = (g->settori_riservati + 2 * g->settori_per_fat + settori_root) * BYTE_PER_SETTORE_GENERATO;
+    g->dimensione = totale * BYTE_PER_SETTORE_GENERATO;
+
+    // il lettore decide il tipo dal numero di cluster, come la specifica
+    int tipo = g->numero_cluster < 4085 ? 12 : g->numero_cluster < 65525 ? 16 : 32;
+    if (tipo != p->tipo_fat)
+    {
+        fprintf(stderr, "Con questi parametri il volume ha %lu cluster, cioe' FAT%d e non FAT%d\n",
+                g->numero_cluster, tipo, p->tipo_fat);
+        return -1;
+    }
+    return 0;
+}
+
+
+// libero_dopo cerca il primo cluster libero dopo c, ricominciando dal 2
+inline uint32_t libero_dopo(GeneratoreFat *g, uint32_t c)
+{
+    uint32_t ultimo = g->numero_cluster + 1;
+    for (unsigned long giri = 0; giri < g->numero_cluster; giri++)
+    {
+        c = c >= ultimo ? 2 : c + 1;
+        if (g->fat[c] == 0)
+            return c;
+    }
+    return 0;
+}
+
+
+/**
+ * alloca_catena prende numero cluster liberi e li collega nella FAT. Con
+ * probabilita' frammentazione% ogni cluster salta in un punto a caso del
+ * volume invece di seguire il precedente.
+ *
+ * @returns -1 se non c'e' abbastanza spazio, 0 altrimenti
+ */
+inline int alloca_catena(GeneratoreFat *g, unsigned long numero, unsigned frammentazione,
+                         std::vector<uint32_t> &catena)
+{
+    if (numero > g->liberi)
+        return -1;
+
+    uint32_t eoc = g->tipo_fat == 12 ? 0xFFF : g->tipo_fat == 16 ? 0xFFFF : 0x0FFFFFFF;
+    for (unsigned long i = 0; i < numero; i++)
+    {
+        uint32_t partenza = g->cursore;
+        if (casuale(g) % 100 < frammentazione)
+            partenza = 2 + casuale(g) % g->numero_cluster;
+
+        uint32_t c = libero_dopo(g, partenza);
+        if (!catena.empty())
+            g->fat[catena.back()] = c;
+        g->fat[c] = eoc;
+        g->cursore = c;
+        g->liberi--;
+        catena.push_back(c);
+    }
+    return 0;
+}
+
+
+inline void scrivi_16(unsigned char *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+
+inline void scrivi_32(unsigned char *p, uint32_t v)
+{
+    scrivi_16(p, v & 0xffff);
+    scrivi_16(p + 2, v >> 16);
+}
+
+
+/**
+ * scrivi_riga compone una riga 8.3 con data e ora fisse.
+ */
+inline void scrivi_riga(unsigned char *riga, const unsigned char *nome, unsigned char attributi,
+                        uint32_t primo_cluster, unsigned long dimensione)
+{
+    const uint16_t orario = (13 << 11) | (45 << 5) | (30 / 2);
+    const uint16_t data = ((2024 - 1980) << 9) | (5 << 5) | 17;
+
+    memcpy(riga, nome, 11);
+    riga[0x0b] = attributi;
+    riga[0x0d] = 150;
+    scrivi_16(riga + 0x0e, orario);
+    scrivi_16(riga + 0x10, data);
+    scrivi_16(riga + 0x12, data);
+    scrivi_16(riga + 0x14, primo_cluster >> 16);
+    scrivi_16(riga + 0x16, orario);
+    scrivi_16(riga + 0x18, data);
+    scrivi_16(riga + 0x1a, primo_cluster & 0xffff);
+    scrivi_32(riga + 0x1c, dimensione);
+}
+
+
+// righe_nome_lungo dice quante righe 0x0f servono per un nome ASCII
+inline unsigned long righe_nome_lungo(const std::string &nome)
+{
+    return (nome.size() + CARATTERI_PER_FRAMMENTO - 1) / CARATTERI_PER_FRAMMENTO;
+}
+
+
+/**
+ * scrivi_nome_lungo scrive i frammenti di un nome ASCII, dall'ultimo al
+ * primo come sul disco, seguiti dalla riga 8.3 a cui si riferiscono.
+ *
+ * @returns Il numero di righe scritte
+ */
+inline unsigned long scrivi_nome_lungo(unsigned char *righe, const std::string &nome, const unsigned char *corto)
+{
+    static const int posizioni[CARATTERI_PER_FRAMMENTO] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+    unsigned long frammenti = righe_nome_lungo(nome);
+    unsigned char checksum = checksum_nome_corto(corto);
+
+    for (unsigned long k = frammenti; k >= 1; k--)
+    {
+        unsigned char *riga = righe + (frammenti - k) * 32;
+        memset(riga, 0, 32);
+        riga[0] = k | (k == frammenti ? 0x40 : 0);
+        riga[0x0b] = 0x0f;
+        riga[0x0d] = checksum;
+        for (int i = 0; i < CARATTERI_PER_FRAMMENTO; i++)
+        {
+            unsigned long indice = (k - 1) * CARATTERI_PER_FRAMMENTO + i;
+            uint16_t unita = indice < nome.size() ? (unsigned char)nome[indice] : indice == nome.size() ? 0x0000 : 0xffff;
+            scrivi_16(riga + posizioni[i], unita);
+        }
+    }
+    return frammenti;
+}
+
+
+inline unsigned char *indirizzo_cluster(GeneratoreFat *g, uint32_t cluster)
+{
+    return g->dati + g->inizio_area_dati + (unsigned long)(cluster - 2) * g->byte_per_cluster;
+}
+
+
+/**
+ * scrivi_directory compone le righe di una directory e le distribuisce sui
+ * suoi cluster, o nell'area fissa se e' la root di FAT12 e FAT16.
+ */
+inline void scrivi_directory(GeneratoreFat *g, const std::vector<DirectoryGenerata> &directory,
+                             const std::vector<FileGenerato> &file, int indice)
+{
+    const DirectoryGenerata &d = directory[indice];
+    std::vector<unsigned char> righe;
+    unsigned char riga[32] = {0};
+
+    if (indice != 0)
+    {
+        static const unsigned char punto[11] = {'.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '};
+        static const unsigned char due_punti[11] = {'.', '.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '};
+        uint32_t padre = d.padre == 0 ? 0 : directory[d.padre].cluster[0];
+        scrivi_riga(riga, punto, 0x10, d.cluster[0], 0);
+        righe.insert(righe.end(), riga, riga + 32);
+        scrivi_riga(riga, due_punti, 0x10, padre, 0);
+        righe.insert(righe.end(), riga, riga + 32);
+    }
+
+    for (int s : d.sottodirectory)
+    {
+        scrivi_riga(riga, directory[s].nome, 0x10, directory[s].cluster[0], 0);
+        righe.insert(righe.end(), riga, riga + 32);
+    }
+
+    for (int f : d.file)
+    {
+        const FileGenerato &fg = file[f];
+        size_t inizio = righe.size();
+        righe.resize(inizio + (righe_nome_lungo(fg.nome_lungo) + 1) * 32);
+        unsigned long n = scrivi_nome_lungo(righe.data() + inizio, fg.nome_lungo, fg.nome);
+        scrivi_riga(righe.data() + inizio + n * 32, fg.nome, 0x20, fg.cluster.empty() ? 0 : fg.cluster[0], fg.dimensione);
+    }
+
+    if (d.cluster.empty())
+    {
+        unsigned long inizio_root = (g->settori_riservati + 2 * g->settori_per_fat) * BYTE_PER_SETTORE_GENERATO;
+        memcpy(g->dati + inizio_root, righe.data(), righe.size());
+        return;
+    }
+    for (size_t i = 0; i * g->byte_per_cluster < righe.size(); i++)
+    {
+        unsigned long quanti = righe.size() - i * g->byte_per_cluster;
+        if (quanti > g->byte_per_cluster)
+            quanti = g->byte_per_cluster;
+        memcpy(indirizzo_cluster(g, d.cluster[i]), righe.data() + i * g->byte_per_cluster, quanti);
+    }
+}
+
+
+inline unsigned long righe_directory(const std::vector<DirectoryGenerata> &directory,
+                                     const std::vector<FileGenerato> &file, int indice)
+{
+    const DirectoryGenerata &d = directory[indice];
+    unsigned long righe = (indice != 0 ? 2 : 0) + d.sottodirectory.size();
+    for (int f : d.file)
+        righe += righe_nome_lungo(file[f].nome_lungo) + 1;
+    return righe;
+}
+
+
+/**
+ * scrivi_boot_sector compone il boot sector; su FAT32 anche il settore
+ * FSInfo e la copia di riserva del boot sector.
+ */
+inline void scrivi_boot_sector(GeneratoreFat *g, uint32_t seme, uint32_t cluster_root)
+{
+    unsigned char *b = g->dati;
+    unsigned long totale = g->dimensione / BYTE_PER_SETTORE_GENERATO;
+
+    b[0] = 0xeb;
+    b[1] = 0x3c;
+    b[2] = 0x90;
+    memcpy(b + 3, "MSWIN4.1", 8);
+    scrivi_16(b + 0x0b, BYTE_PER_SETTORE_GENERATO);
+    b[0x0d] = g->byte_per_cluster / BYTE_PER_SETTORE_GENERATO;
+    scrivi_16(b + 0x0e, g->settori_riservati);
+    b[0x10] = 2;
+    scrivi_16(b + 0x11, g->righe_root);
+    if (totale < 0x10000 && g->tipo_fat != 32)
+        scrivi_16(b + 0x13, totale);
+    else
+        scrivi_32(b + 0x20, totale);
+    b[0x15] = 0xf8;
+    scrivi_16(b + 0x18, 63);
+    scrivi_16(b + 0x1a, 255);
+
+    // la parte estesa sta a 0x24 su FAT12/16 e a 0x40 su FAT32
+    unsigned char *estesa = b + 0x24;
+    if (g->tipo_fat == 32)
+    {
+        scrivi_32(b + 0x24, g->settori_per_fat);
+        scrivi_32(b + 0x2c, cluster_root);
+        scrivi_16(b + 0x30, 1);
+        scrivi_16(b + 0x32, 6);
+        estesa = b + 0x40;
+    }
+    else
+        scrivi_16(b + 0x16, g->settori_per_fat);
+
+    estesa[0] = 0x80;
+    estesa[2] = 0x29;
+    scrivi_32(estesa + 3, seme);
+    memcpy(estesa + 7, "GENERATA   ", 11);
+    memcpy(estesa + 18, g->tipo_fat == 12 ? "FAT12   " : g->tipo_fat == 16 ? "FAT16   " : "FAT32   ", 8);
+    b[0x1fe] = 0x55;
+    b[0x1ff] = 0xaa;
+
+    if (g->tipo_fat == 32)
+    {
+        unsigned char *info = b + BYTE_PER_SETTORE_GENERATO;
+        scrivi_32(info, 0x41615252);
+        scrivi_32(info + 484, 0x61417272);
+        scrivi_32(info + 488, g->liberi);
+        scrivi_32(info + 492, g->cursore);
+        scrivi_32(info + 508, 0xaa550000);
+        memcpy(b + 6 * BYTE_PER_SETTORE_GENERATO, b, BYTE_PER_SETTORE_GENERATO);
+    }
+}
+
+
+/**
+ * scrivi_fat codifica la FAT in costruzione in tutte e due le copie.
+ */
+inline void scrivi_fat(GeneratoreFat *g)
+{
+    unsigned char *prima = g->dati + g->settori_riservati * BYTE_PER_SETTORE_GENERATO;
+    unsigned long byte_fat = g->settori_per_fat * BYTE_PER_SETTORE_GENERATO;
+
+    g->fat[0] = g->tipo_fat == 12 ? 0xFF8 : g->tipo_fat == 16 ? 0xFFF8 : 0x0FFFFFF8;
+    g->fat[1] = g->tipo_fat == 12 ? 0xFFF : g->tipo_fat == 16 ? 0xFFFF : 0x0FFFFFFF;
+    for (unsigned long c = 0; c < g->fat.size(); c++)
+    {
+        uint32_t v = g->fat[c];
+        if (g->tipo_fat == 32)
+            scrivi_32(prima + c * 4, v);
+        else if (g->tipo_fat == 16)
+            scrivi_16(prima + c * 2, v);
+        else if (c & 1)
+        {
+            unsigned char *p = prima + c * 3 / 2;
+            p[0] = (p[0] & 0x0f) | ((v & 0x0f) << 4);
+            p[1] = v >> 4;
+        }
+        else
+        {
+            unsigned char *p = prima + c * 3 / 2;
+            p[0] = v & 0xff;
+            p[1] = (p[1] & 0xf0) | ((v >> 8) & 0x0f);
+        }
+    }
+    memcpy(prima + byte_fat, prima, byte_fat);
+}
+
+
+/**
+ * genera_immagine scrive un'immagine FAT valida con un albero casuale di
+ * directory e file. I file hanno un nome lungo e un contenuto pseudocasuale
+ * riproducibile dal seme.
+ *
+ * @param percorso Il file da creare, viene sovrascritto
+ * @param p I parametri dell'immagine, non deve essere NULL
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+inline int genera_immagine(const char *percorso, const ParametriImmagine *p)
+{
+    GeneratoreFat g;
+    g.stato_casuale = p->seme * 0x9e3779b97f4a7c15ull + 1;
+    if (p->byte_per_cluster < BYTE_PER_SETTORE_GENERATO || p->byte_per_cluster > 65536 ||
+        (p->byte_per_cluster & (p->byte_per_cluster - 1)) != 0)
+    {
+        fprintf(stderr, "Dimensione del cluster non valida: %lu\n", p->byte_per_cluster);
+        return -1;
+    }
+    if (calcola_geometria(&g, p) != 0)
+        return -1;
+
+    g.fat.assign(g.numero_cluster + 2, 0);
+    g.cursore = 1;
+    g.liberi = g.numero_cluster;
+
+
+    // l'albero: prima una catena lunga profondita, poi directory a caso
+    std::vector<DirectoryGenerata> directory(1);
+    directory[0].padre = -1;
+    directory[0].livello = 0;
+    unsigned long numero_directory = p->profondita == 0 ? 1 : p->numero_file / 16 + p->profondita + 1;
+    for (unsigned long i = 1; i < numero_directory; i++)
+    {
+        DirectoryGenerata d;
+        d.padre = i <= p->profondita ? i - 1 : casuale(&g) % directory.size();
+        if (directory[d.padre].livello >= p->profondita)
+            d.padre = directory[d.padre].padre;
+
+        // si lascia nella root ad area fissa lo spazio per qualche file
+        if (d.padre == 0 && g.righe_root > 0 && directory[0].sottodirectory.size() >= g.righe_root / 2)
+            d.padre = 1;
+        d.livello = directory[d.padre].livello + 1;
+        char numero[24];
+        snprintf(numero, sizeof(numero), "D%07lu", i % 10000000);
+        memcpy(d.nome, numero, 8);
+        memset(d.nome + 8, ' ', 3);
+        directory[d.padre].sottodirectory.push_back(i);
+        directory.push_back(d);
+    }
+
+    std::vector<FileGenerato> file(p->numero_file);
+    for (unsigned long i = 0; i < p->numero_file; i++)
+    {
+        FileGenerato &f = file[i];
+        char numero[24];
+        snprintf(numero, sizeof(numero), "F%07lu", i % 10000000);
+        memcpy(f.nome, numero, 8);
+        memcpy(f.nome + 8, "BIN", 3);
+        f.nome_lungo = "file numero " + std::to_string(i) + " generato.bin";
+        f.dimensione = p->dimensione_media_file ? casuale(&g) % (2 * p->dimensione_media_file + 1) : 0;
+
+        // la root ad area fissa ha solo 512 righe
+        int d = casuale(&g) % directory.size();
+        if (d == 0 && g.righe_root > 0 &&
+            righe_directory(directory, file, 0) + righe_nome_lungo(f.nome_lungo) + 1 > g.righe_root)
+        {
+            if (directory.size() == 1)
+            {
+                fprintf(stderr, "La root directory di FAT%d non contiene %lu file: serve profondita' > 0\n",
+                        p->tipo_fat, p->numero_file);
+                return -1;
+            }
+            d = 1 + casuale(&g) % (directory.size() - 1);
+        }
+        directory[d].file.push_back(i);
+    }
+
+
+    int fd = open(percorso, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror(percorso);
+        return -1;
+    }
+    if (ftruncate(fd, g.dimensione) != 0)
+    {
+        perror(percorso);
+        close(fd);
+        return -1;
+    }
+    void *mappa = mmap(NULL, g.dimensione, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mappa == MAP_FAILED)
+    {
+        perror(percorso);
+        return -1;
+    }
+    g.dati = (unsigned char *)mappa;
+
+
+    // ogni directory prende i suoi cluster e subito dopo quelli dei suoi file,
+    // come farebbe un sistema operativo che copia un albero
+    int ret = 0;
+    for (size_t i = 0; i < directory.size() && ret == 0; i++)
+    {
+        DirectoryGenerata &d = directory[i];
+        if (i != 0 || g.tipo_fat == 32)
+        {
+            unsigned long byte = righe_directory(directory, file, i) * 32;
+            unsigned long cluster = byte / g.byte_per_cluster + 1;
+            ret = alloca_catena(&g, cluster, p->frammentazione, d.cluster);
+        }
+
+        for (int f : d.file)
+        {
+            FileGenerato &fg = file[f];
+            if (ret != 0)
+                break;
+            ret = alloca_catena(&g, (fg.dimensione + g.byte_per_cluster - 1) / g.byte_per_cluster,
+                                p->frammentazione, fg.cluster);
+            for (size_t k = 0; k < fg.cluster.size() && ret == 0; k++)
+            {
+                uint64_t *parole = (uint64_t *)indirizzo_cluster(&g, fg.cluster[k]);
+                for (unsigned long w = 0; w < g.byte_per_cluster / 8; w++)
+                    parole[w] = casuale(&g);
+            }
+        }
+    }
+    if (ret != 0)
+    {
+        fprintf(stderr, "L'immagine e' troppo piccola per %lu file da circa %lu byte\n",
+                p->numero_file, p->dimensione_media_file);
+        munmap(mappa, g.dimensione);
+        return -1;
+    }
+
+    for (size_t i = 0; i < directory.size(); i++)
+        scrivi_directory(&g, directory, file, i);
+    scrivi_fat(&g);
+    scrivi_boot_sector(&g, p->seme, g.tipo_fat == 32 ? directory[0].cluster[0] : 0);
+
+    munmap(mappa, g.dimensione);
+    return 0;
+}
+
+#endif
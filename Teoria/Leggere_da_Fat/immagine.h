@@ -0,0 +1,370 @@
+#ifndef IMMAGINE_H
+#define IMMAGINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache_blocchi.h"
+
+
+// Immagine rappresenta il file del file system aperto in sola lettura.
+// Se possibile il file viene mappato in memoria, cosi' ogni lettura diventa
+// un accesso a puntatore senza chiamate di sistema.
+typedef struct
+{
+    // Il descrittore del file aperto
+    int fd;
+
+    // La mappatura del file, NULL se si usa pread
+    const unsigned char *dati;
+
+    // La dimensione in byte dell'immagine
+    unsigned long dimensione;
+
+    // 1 se i dati sono stati copiati in memoria (pipe), 0 altrimenti
+    int in_memoria;
+
+    // I settori letti di recente con pread, NULL se non c'e' cache
+    CacheBlocchi *cache;
+} Immagine;
+
+
+// Le letture piu' lunghe di capacita / FRAZIONE_CACHE_BYPASS blocchi non
+// passano dalla cache, per non svuotarla copiando il contenuto dei file
+#define FRAZIONE_CACHE_BYPASS 4
+
+// Quanti settori mancanti consecutivi si leggono con una sola pread
+#define BLOCCHI_PER_LETTURA 16
+
+
+/**
+ * carica_stream legge tutto il contenuto di un descrittore non posizionabile
+ * (ad esempio una pipe) in un buffer allocato sullo heap.
+ *
+ * @param img L'immagine da riempire, non deve essere NULL
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+inline int carica_stream(Immagine *img)
+{
+    unsigned long capacita = 1 << 20;
+    unsigned long letti = 0;
+    unsigned char *buffer = (unsigned char *)malloc(capacita);
+
+    if (buffer == NULL)
+        return -1;
+
+    for (;;)
+    {
+        if (letti == capacita)
+        {
+            unsigned char *nuovo = (unsigned char *)realloc(buffer, capacita * 2);
+            if (nuovo == NULL)
+            {
+                free(buffer);
+                return -1;
+            }
+            buffer = nuovo;
+            capacita *= 2;
+        }
+
+        ssize_t n = read(img->fd, buffer + letti, capacita - letti);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            free(buffer);
+            return -1;
+        }
+        if (n == 0)
+            break;
+        letti += n;
+    }
+
+    img->dati = buffer;
+    img->dimensione = letti;
+    img->in_memoria = 1;
+    return 0;
+}
+
+
+/**
+ * apri_immagine apre un'immagine in sola lettura. Prova prima mmap, poi
+ * ripiega su pread; se il file non e' posizionabile lo carica in memoria.
+ *
+ * @param percorso Il percorso del file, non deve essere NULL
+ * @param usa_mmap 0 per leggere sempre con pread, ad esempio da dischi lenti
+ *
+ * @returns L'immagine aperta, o NULL in caso di errore
+ */
+inline Immagine *apri_immagine(const char *percorso, int usa_mmap = 1)
+{
+    if (percorso == NULL)
+        return NULL;
+
+    Immagine *img = (Immagine *)calloc(1, sizeof(Immagine));
+    if (img == NULL)
+        return NULL;
+
+    img->fd = open(percorso, O_RDONLY);
+    if (img->fd < 0)
+    {
+        free(img);
+        return NULL;
+    }
+
+    struct stat info;
+    if (usa_mmap && fstat(img->fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+    {
+        img->dimensione = info.st_size;
+        void *mappa = mmap(NULL, img->dimensione, PROT_READ, MAP_PRIVATE, img->fd, 0);
+        if (mappa != MAP_FAILED)
+        {
+            madvise(mappa, img->dimensione, MADV_WILLNEED);
+            img->dati = (const unsigned char *)mappa;
+            return img;
+        }
+    }
+
+    // niente mmap: se il file e' posizionabile si usa pread
+    off_t fine = lseek(img->fd, 0, SEEK_END);
+    if (fine >= 0)
+    {
+        img->dimensione = fine;
+        return img;
+    }
+
+    if (errno == ESPIPE && carica_stream(img) == 0)
+        return img;
+
+    close(img->fd);
+    free(img);
+    return NULL;
+}
+
+
+/**
+ * chiudi_immagine rilascia la mappatura e il descrittore dell'immagine.
+ *
+ * @param img L'immagine da chiudere, non deve essere NULL
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+inline int chiudi_immagine(Immagine *img)
+{
+    if (img == NULL)
+        return -1;
+
+    if (img->in_memoria)
+        free((void *)img->dati);
+    else if (img->dati != NULL)
+        munmap((void *)img->dati, img->dimensione);
+
+    distruggi_cache_blocchi(img->cache);
+    close(img->fd);
+    free(img);
+    return 0;
+}
+
+
+/**
+ * attiva_cache mette una cache LRU di settori sotto read_buffer. Serve solo
+ * quando l'immagine si legge con pread: con la mappatura non fa niente.
+ *
+ * @param dimensione_blocco I byte di ogni blocco, di solito byte_per_settore
+ * @param numero_blocchi La capacita' della cache in blocchi, al massimo MASSIMO_BLOCCHI_CACHE
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+inline int attiva_cache(Immagine *img, unsigned long dimensione_blocco, unsigned long numero_blocchi)
+{
+    if (img->dati != NULL)
+        return 0;
+
+    CacheBlocchi *cache = crea_cache_blocchi(dimensione_blocco, numero_blocchi);
+    if (cache == NULL)
+        return -1;
+
+    distruggi_cache_blocchi(img->cache);
+    img->cache = cache;
+    return 0;
+}
+
+
+/**
+ * puntatore_immagine restituisce un puntatore diretto ai byte richiesti,
+ * senza copiarli. Funziona solo quando l'immagine e' in memoria.
+ *
+ * @returns Il puntatore ai dati, o NULL se non disponibile o fuori dai limiti
+ */
+inline const unsigned char *puntatore_immagine(Immagine *img, unsigned long pos, unsigned long count)
+{
+    if (img->dati == NULL || pos > img->dimensione || count > img->dimensione - pos)
+        return NULL;
+    return img->dati + pos;
+}
+
+
+/**
+ * pread_tutto legge fino a count byte da pos, ripetendo le letture parziali.
+ *
+ * @returns Quanti byte sono stati letti, meno di count solo a fine file o su errore
+ */
+inline unsigned long pread_tutto(int fd, unsigned char *dest, unsigned long count, unsigned long pos)
+{
+    unsigned long letti = 0;
+    while (letti < count)
+    {
+        ssize_t n = pread(fd, dest + letti, count - letti, pos + letti);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        letti += n;
+    }
+    return letti;
+}
+
+
+// leggi_buco legge con una pread i settori mancanti da primo a primo + quanti,
+// li inserisce nella cache e copia in dest la parte richiesta
+inline void leggi_buco(Immagine *input, unsigned long primo, unsigned long quanti,
+                       unsigned long pos, unsigned long count, unsigned char *dest, unsigned char *appoggio)
+{
+    CacheBlocchi *cache = input->cache;
+    unsigned long inizio = primo * cache->dimensione_blocco;
+    unsigned long byte = quanti * cache->dimensione_blocco;
+
+    unsigned long letti = pread_tutto(input->fd, appoggio, byte, inizio);
+    memset(appoggio + letti, 0, byte - letti);
+    for (unsigned long i = 0; i < quanti; i++)
+        inserisci_blocco(cache, primo + i, appoggio + i * cache->dimensione_blocco);
+
+    unsigned long da = inizio > pos ? inizio : pos;
+    unsigned long a = inizio + byte < pos + count ? inizio + byte : pos + count;
+    memcpy(dest + (da - pos), appoggio + (da - inizio), a - da);
+}
+
+
+/**
+ * leggi_con_cache legge un settore alla volta dalla cache; i settori
+ * mancanti consecutivi si leggono insieme con una sola pread.
+ */
+inline void leggi_con_cache(Immagine *input, unsigned long pos, unsigned long count, unsigned char *dest)
+{
+    CacheBlocchi *cache = input->cache;
+    unsigned long dimensione = cache->dimensione_blocco;
+    unsigned long primo = pos / dimensione;
+    unsigned long ultimo = (pos + count - 1) / dimensione;
+    unsigned char *appoggio = NULL;
+    unsigned long inizio_buco = 0, buco = 0;
+
+    for (unsigned long settore = primo; settore <= ultimo; settore++)
+    {
+        unsigned long da = settore == primo ? pos % dimensione : 0;
+        unsigned long a = settore == ultimo ? (pos + count - 1) % dimensione + 1 : dimensione;
+
+        if (copia_blocco(cache, settore, da, a - da, dest + (settore * dimensione + da - pos)))
+        {
+            if (buco > 0)
+                leggi_buco(input, inizio_buco, buco, pos, count, dest, appoggio);
+            buco = 0;
+            continue;
+        }
+
+        if (appoggio == NULL)
+        {
+            appoggio = (unsigned char *)malloc(BLOCCHI_PER_LETTURA * dimensione);
+            if (appoggio == NULL)
+            {
+                // senza memoria si legge tutto direttamente
+                unsigned long letti = pread_tutto(input->fd, dest, count, pos);
+                memset(dest + letti, 0, count - letti);
+                return;
+            }
+        }
+        if (buco == 0)
+            inizio_buco = settore;
+        if (++buco == BLOCCHI_PER_LETTURA)
+        {
+            leggi_buco(input, inizio_buco, buco, pos, count, dest, appoggio);
+            buco = 0;
+        }
+    }
+
+    if (buco > 0)
+        leggi_buco(input, inizio_buco, buco, pos, count, dest, appoggio);
+    free(appoggio);
+}
+
+
+inline void read_buffer(Immagine *input, unsigned long pos, unsigned long count, unsigned char *dest)
+{
+    const unsigned char *sorgente = puntatore_immagine(input, pos, count);
+    if (sorgente != NULL)
+    {
+        memcpy(dest, sorgente, count);
+        return;
+    }
+    if (count == 0)
+        return;
+
+    CacheBlocchi *cache = input->cache;
+    if (input->dati == NULL && cache != NULL &&
+        count / cache->dimensione_blocco < cache->capacita / FRAZIONE_CACHE_BYPASS)
+    {
+        leggi_con_cache(input, pos, count, dest);
+        return;
+    }
+
+    // fuori dalla mappatura o in modalita' pread: i byte mancanti valgono 0
+    unsigned long letti = 0;
+    if (input->dati == NULL)
+        letti = pread_tutto(input->fd, dest, count, pos);
+    else if (pos < input->dimensione)
+    {
+        letti = input->dimensione - pos;
+        memcpy(dest, input->dati + pos, letti);
+    }
+    memset(dest + letti, 0, count - letti);
+}
+
+
+inline void read_string(Immagine *input, unsigned long pos, unsigned long count, unsigned char *dest)
+{
+    read_buffer(input, pos, count, dest);
+    dest[count] = '\0';
+}
+
+
+inline unsigned long read_number(Immagine *input, unsigned long pos, int count)
+{
+    unsigned long ret = 0;
+    unsigned char copia[8];
+
+
+    // Con l'immagine mappata si legge direttamente dalla memoria
+    const unsigned char *buffer = puntatore_immagine(input, pos, count);
+    if (buffer == NULL)
+    {
+        read_buffer(input, pos, count, copia);
+        buffer = copia;
+    }
+
+
+    // Questa implementazione funziona per Little Endian leggendo i byte a ritroso
+    for (int a = count - 1; a >= 0; a--)
+    {
+        ret = ret << 8;
+        ret += buffer[a];
+    }
+    return ret;
+}
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef IMPRONTE_H
+#define IMPRONTE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <vector>
+
+#include "immagine.h"
+#include "fat.h"
+#include "esplora.h"
+#include "parallelo.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IMPRONTE_X86 1
+#endif
+
+
+// Quanti byte alla volta legge ogni thread quando l'immagine non e' mappata:
+// la memoria usata e' questa per il numero di thread, qualunque sia la dimensione dei file
+#define DIMENSIONE_LETTURA_IMPRONTE (1 << 20)
+
+
+// CRC32C (Castagnoli), polinomio riflesso 0x82f63b78
+
+/**
+ * tabelle_crc32c restituisce le 8 tabelle per la versione slicing-by-8,
+ * calcolate al primo uso.
+ */
+inline const uint32_t (*tabelle_crc32c())[256]
+{
+    static uint32_t tabelle[8][256];
+    static const int pronte = [&]()
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c >> 1) ^ (0x82f63b78u & -(c & 1));
+            tabelle[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++)
+            for (int t = 1; t < 8; t++)
+                tabelle[t][i] = (tabelle[t - 1][i] >> 8) ^ tabelle[0][tabelle[t - 1][i] & 0xff];
+        return 1;
+    }();
+    (void)pronte;
+    return tabelle;
+}
+
+
+/**
+ * crc32c_scalare aggiorna il CRC leggendo otto byte alla volta con le tabelle.
+ * crc e' il valore gia' invertito: si parte da 0xffffffff e si inverte alla fine.
+ */
+inline uint32_t crc32c_scalare(uint32_t crc, const unsigned char *dati, unsigned long numero)
+{
+    const uint32_t(*t)[256] = tabelle_crc32c();
+
+    while (numero >= 8)
+    {
+        uint32_t basso, alto;
+        memcpy(&basso, dati, 4);
+        memcpy(&alto, dati + 4, 4);
+        basso ^= crc;
+        crc = t[7][basso & 0xff] ^ t[6][(basso >> 8) & 0xff] ^ t[5][(basso >> 16) & 0xff] ^ t[4][basso >> 24] ^
+              t[3][alto & 0xff] ^ t[2][(alto >> 8) & 0xff] ^ t[1][(alto >> 16) & 0xff] ^ t[0][alto >> 24];
+        dati += 8;
+        numero -= 8;
+    }
+    while (numero-- > 0)
+        crc = (crc >> 8) ^ t[0][(crc ^ *dati++) & 0xff];
+    return crc;
+}
+
+
+#ifdef IMPRONTE_X86
+
+/**
+ * crc32c_sse42 usa l'istruzione crc32 di SSE4.2, otto byte per istruzione.
+ */
+__attribute__((target("sse4.2"))) inline uint32_t crc32c_sse42(uint32_t crc, const unsigned char *dati, unsigned long numero)
+{
+#ifdef __x86_64__
+    uint64_t c = crc;
+    while (numero >= 8)
+    {
+        uint64_t parola;
+        memcpy(&parola, dati, 8);
+        c = _mm_crc32_u64(c, parola);
+        dati += 8;
+        numero -= 8;
+    }
+    crc = c;
+#endif
+    while (numero-- > 0)
+        crc = _mm_crc32_u8(crc, *dati++);
+    return crc;
+}
+
+#endif
+
+
+typedef uint32_t (*FunzioneCrc)(uint32_t, const unsigned char *, unsigned long);
+
+
+inline FunzioneCrc scegli_crc32c()
+{
+#ifdef IMPRONTE_X86
+    static const FunzioneCrc scelta = __builtin_cpu_supports("sse4.2") ? crc32c_sse42 : crc32c_scalare;
+    return scelta;
+#else
+    return crc32c_scalare;
+#endif
+}
+
+
+// SHA-256 (FIPS 180-4)
+
+typedef struct
+{
+    uint32_t stato[8];
+    uint64_t lunghezza;
+    unsigned char blocco[64];
+    unsigned long nel_blocco;
+} Sha256;
+
+
+inline void inizia_sha256(Sha256 *s)
+{
+    static const uint32_t iniziale[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(s->stato, iniziale, sizeof(iniziale));
+    s->lunghezza = 0;
+    s->nel_blocco = 0;
+}
+
+
+inline uint32_t ruota_destra(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+
+inline void comprimi_sha256(uint32_t *stato, const unsigned char *blocco)
+{
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)blocco[i * 4] << 24 | blocco[i * 4 + 1] << 16 | blocco[i * 4 + 2] << 8 | blocco[i * 4 + 3];
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = ruota_destra(w[i - 15], 7) ^ ruota_destra(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ruota_destra(w[i - 2], 17) ^ ruota_destra(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = stato[0], b = stato[1], c = stato[2], d = stato[3];
+    uint32_t e = stato[4], f = stato[5], g = stato[6], h = stato[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (ruota_destra(e, 6) ^ ruota_destra(e, 11) ^ ruota_destra(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        uint32_t t2 = (ruota_destra(a, 2) ^ ruota_destra(a, 13) ^ ruota_destra(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    stato[0] += a;
+    stato[1] += b;
+    stato[2] += c;
+    stato[3] += d;
+    stato[4] += e;
+    stato[5] += f;
+    stato[6] += g;
+    stato[7] += h;
+}
+
+
+inline void aggiorna_sha256(Sha256 *s, const unsigned char *dati, unsigned long numero)
+{
+    s->lunghezza += numero;
+
+    if (s->nel_blocco > 0)
+    {
+        unsigned long quanti = 64 - s->nel_blocco < numero ? 64 - s->nel_blocco : numero;
+        memcpy(s->blocco + s->nel_blocco, dati, quanti);
+        s->nel_blocco += quanti;
+        dati += quanti;
+        numero -= quanti;
+        if (s->nel_blocco < 64)
+            return;
+        comprimi_sha256(s->stato, s->blocco);
+        s->nel_blocco = 0;
+    }
+
+    // i blocchi interi si comprimono direttamente dai dati, senza copiarli
+    for (; numero >= 64; dati += 64, numero -= 64)
+        comprimi_sha256(s->stato, dati);
+
+    memcpy(s->blocco, dati, numero);
+    s->nel_blocco = numero;
+}
+
+
+inline void concludi_sha256(Sha256 *s, unsigned char *impronta)
+{
+    uint64_t bit = s->lunghezza * 8;
+
+    s->blocco[s->nel_blocco++] = 0x80;
+    if (s->nel_blocco > 56)
+    {
+        memset(s->blocco + s->nel_blocco, 0, 64 - s->nel_blocco);
+        comprimi_sha256(s->stato, s->blocco);
+        s->nel_blocco = 0;
+    }
+    memset(s->blocco + s->nel_blocco, 0, 56 - s->nel_blocco);
+    for (int i = 0; i < 8; i++)
+        s->blocco[56 + i] = bit >> (56 - 8 * i);
+    comprimi_sha256(s->stato, s->blocco);
+
+    for (int i = 0; i < 8; i++)
+    {
+        impronta[i * 4] = s->stato[i] >> 24;
+        impronta[i * 4 + 1] = s->stato[i] >> 16;
+        impronta[i * 4 + 2] = s->stato[i] >> 8;
+        impronta[i * 4 + 3] = s->stato[i];
+    }
+}
+
+
+
+// ImprontaFile raccoglie le impronte del contenuto di un file
+typedef struct
+{
+    uint32_t crc32c;
+    unsigned char sha256[32];
+
+    // 1 se la catena finisce prima della dimensione dichiarata o la lettura fallisce
+    int errore;
+} ImprontaFile;
+
+
+/**
+ * impronta_file legge le estensioni di un file nell'ordine della catena e
+ * aggiorna insieme CRC32C e SHA-256, senza mai tenere in memoria tutto il file.
+ *
+ * @param buffer Il buffer per le pread, da DIMENSIONE_LETTURA_IMPRONTE byte; non usato se l'immagine e' mappata
+ */
+inline void impronta_file(Immagine *img, const Volume *vol, const TabellaFat *fat, const Voce &voce,
+                          unsigned char *buffer, ImprontaFile *impronta)
+{
+    FunzioneCrc crc32c = scegli_crc32c();
+    uint32_t crc = 0xffffffff;
+    Sha256 sha;
+    inizia_sha256(&sha);
+    impronta->errore = 0;
+
+    unsigned long letti = 0;
+    IteratoreCatena catena = inizia_catena(fat, voce.primo_cluster);
+    Estensione estensione;
+    while (letti < voce.dimensione && prossima_estensione(&catena, &estensione))
+    {
+        unsigned long sorgente = posizione_cluster(vol, estensione.inizio);
+        unsigned long lunghezza = (unsigned long)estensione.lunghezza * vol->byte_per_cluster;
+        if (lunghezza > voce.dimensione - letti)
+            lunghezza = voce.dimensione - letti;
+
+        while (lunghezza > 0)
+        {
+            unsigned long quanti = lunghezza;
+            const unsigned char *dati = puntatore_immagine(img, sorgente, quanti);
+            if (dati == NULL)
+            {
+                if (img->dati != NULL)
+                    break;
+                if (quanti > DIMENSIONE_LETTURA_IMPRONTE)
+                    quanti = DIMENSIONE_LETTURA_IMPRONTE;
+                if (pread_tutto(img->fd, buffer, quanti, sorgente) != quanti)
+                    break;
+                dati = buffer;
+            }
+            crc = crc32c(crc, dati, quanti);
+            aggiorna_sha256(&sha, dati, quanti);
+            sorgente += quanti;
+            letti += quanti;
+            lunghezza -= quanti;
+        }
+        if (lunghezza > 0)
+            break;
+    }
+
+    impronta->errore = letti < voce.dimensione;
+    impronta->crc32c = ~crc;
+    concludi_sha256(&sha, impronta->sha256);
+}
+
+
+/**
+ * impronte_albero calcola le impronte di tutti i file di voci con
+ * numero_thread thread, ognuno dei quali prende il prossimo file libero.
+ * Le impronte delle directory restano a zero.
+ *
+ * @param impronte Riceve un'impronta per ogni voce, nello stesso ordine
+ * @returns Il numero di byte letti
+ */
+inline unsigned long impronte_albero(Immagine *img, const Volume *vol, const TabellaFat *fat,
+                                     const std::vector<Voce> &voci, unsigned numero_thread,
+                                     std::vector<ImprontaFile> &impronte)
+{
+    if (numero_thread == 0)
+        numero_thread = 1;
+    impronte.assign(voci.size(), ImprontaFile());
+
+    std::atomic<unsigned long> byte(0);
+    std::vector<std::vector<unsigned char>> buffer(numero_thread,
+                                                   std::vector<unsigned char>(img->dati == NULL ? DIMENSIONE_LETTURA_IMPRONTE : 0));
+
+    per_ogni_indice(voci.size(), numero_thread, [&](size_t i, unsigned lavoratore)
+    {
+        if (voci[i].attributi & ATTRIBUTO_DIRECTORY)
+            return;
+        impronta_file(img, vol, fat, voci[i], buffer[lavoratore].data(), &impronte[i]);
+        byte += voci[i].dimensione;
+    });
+
+    return byte;
+}
+
+#endif
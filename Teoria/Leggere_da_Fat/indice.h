@@ -0,0 +1,456 @@
+#ifndef INDICE_H
+#define INDICE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "immagine.h"
+#include "fat.h"
+#include "esplora.h"
+
+
+// L'indice dei percorsi e' una tabella hash da percorso a voce, salvata
+// accanto all'immagine (immagine + ESTENSIONE_INDICE). Il file ha lo stesso
+// formato che si usa in memoria, quindi basta mapparlo per cercare senza
+// leggere nessuna directory dell'immagine.
+//
+// Formato: IntestazioneIndice, numero_posti PostoIndice, numero_record
+// RecordIndice e infine byte_testo byte con chiavi e percorsi.
+
+#define MAGIA_INDICE "FATIDX03"
+#define ESTENSIONE_INDICE ".indice"
+#define POSTO_VUOTO 0xffffffffu
+
+
+typedef struct
+{
+    char magia[8];
+
+    // L'indice vale solo per l'immagine con questo numero di serie e questa
+    // FAT, finche' il file dell'immagine non cambia dimensione o data di
+    // modifica: una scrittura che tocca solo le directory lascia uguale la FAT
+    uint32_t numero_serie;
+    uint32_t tipo_fat;
+    uint64_t checksum_fat;
+    uint64_t dimensione_immagine;
+    int64_t modifica_immagine;
+
+    uint64_t numero_posti;
+    uint64_t numero_record;
+    uint64_t byte_testo;
+} IntestazioneIndice;
+
+
+// Un posto della tabella hash a indirizzamento aperto. La chiave e' il
+// percorso in minuscolo senza '/' iniziale; una voce con nome lungo ha due
+// chiavi, una con i nomi lunghi e una con i nomi 8.3, sullo stesso record.
+typedef struct
+{
+    uint64_t chiave;
+    uint32_t lunghezza_chiave;
+    uint32_t hash;
+    uint32_t record;
+    uint32_t riempimento;
+} PostoIndice;
+
+
+typedef struct
+{
+    uint64_t percorso;
+    uint32_t lunghezza_percorso;
+    uint32_t primo_cluster;
+    uint64_t dimensione;
+    uint64_t posizione;
+    uint16_t orario_creazione;
+    uint16_t data_creazione;
+    uint16_t orario_modifica;
+    uint16_t data_modifica;
+    uint8_t attributi;
+    uint8_t centesimi_creazione;
+    char nome_breve[13];
+    char riempimento[1];
+} RecordIndice;
+
+
+// IndicePercorsi e' un indice pronto per le ricerche, mappato dal file
+// o costruito in memoria
+typedef struct
+{
+    const unsigned char *dati;
+    unsigned long dimensione;
+    int mappato;
+
+    const IntestazioneIndice *testa;
+    const PostoIndice *posti;
+    const RecordIndice *record;
+    const char *testo;
+} IndicePercorsi;
+
+
+/**
+ * checksum_fat riassume la FAT decodificata in 64 bit: se un file cambia
+ * catena o si alloca un cluster, l'indice salvato non vale piu'.
+ */
+inline uint64_t checksum_fat(const TabellaFat *fat)
+{
+    uint64_t h = 0xcbf29ce484222325ull ^ fat->numero_voci;
+    unsigned long c = 0;
+    for (; c + 2 <= fat->numero_voci; c += 2)
+    {
+        uint64_t coppia = fat->prossimo[c] | (uint64_t)fat->prossimo[c + 1] << 32;
+        h = (h ^ coppia) * 0x100000001b3ull;
+        h ^= h >> 29;
+    }
+    if (c < fat->numero_voci)
+        h = (h ^ fat->prossimo[c]) * 0x100000001b3ull;
+    return h;
+}
+
+
+/**
+ * stato_immagine legge dimensione e data di modifica, in nanosecondi, del
+ * file dell'immagine: costano una fstat, mentre rileggere le directory
+ * costerebbe quanto esplorare l'albero.
+ */
+inline void stato_immagine(const Immagine *img, uint64_t *dimensione, int64_t *modifica)
+{
+    struct stat info;
+    *dimensione = 0;
+    *modifica = 0;
+    if (fstat(img->fd, &info) == 0)
+    {
+        *dimensione = info.st_size;
+        *modifica = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    }
+}
+
+
+/**
+ * chiave_percorso normalizza un percorso come lo interpreta cerca_percorso:
+ * niente '/' iniziali o doppi e lettere ASCII minuscole.
+ */
+inline void chiave_percorso(const char *percorso, std::string &chiave)
+{
+    chiave.clear();
+    for (const char *p = percorso; *p != '\0'; p++)
+    {
+        if (*p == '/' && (chiave.empty() || chiave.back() == '/'))
+            continue;
+        chiave += (*p >= 'A' && *p <= 'Z') ? *p - 'A' + 'a' : *p;
+    }
+    if (!chiave.empty() && chiave.back() == '/')
+        chiave.pop_back();
+}
+
+
+inline uint32_t hash_chiave(const char *chiave, unsigned long lunghezza)
+{
+    uint32_t h = 2166136261u;
+    for (unsigned long i = 0; i < lunghezza; i++)
+        h = (h ^ (unsigned char)chiave[i]) * 16777619u;
+    return h;
+}
+
+
+// collega_indice imposta i puntatori alle sezioni dopo aver controllato
+// che le dimensioni dichiarate nell'intestazione tornino
+inline int collega_indice(IndicePercorsi *indice)
+{
+    if (indice->dimensione < sizeof(IntestazioneIndice))
+        return -1;
+
+    const IntestazioneIndice *testa = (const IntestazioneIndice *)indice->dati;
+    if (memcmp(testa->magia, MAGIA_INDICE, 8) != 0 || testa->numero_posti == 0 ||
+        (testa->numero_posti & (testa->numero_posti - 1)) != 0 || testa->numero_posti > (1ull << 32) ||
+        testa->numero_record >= POSTO_VUOTO)
+        return -1;
+
+    unsigned long atteso = sizeof(IntestazioneIndice) + testa->numero_posti * sizeof(PostoIndice) +
+                           testa->numero_record * sizeof(RecordIndice) + testa->byte_testo;
+    if (atteso != indice->dimensione)
+        return -1;
+
+    indice->testa = testa;
+    indice->posti = (const PostoIndice *)(indice->dati + sizeof(IntestazioneIndice));
+    indice->record = (const RecordIndice *)(indice->posti + testa->numero_posti);
+    indice->testo = (const char *)(indice->record + testa->numero_record);
+    return 0;
+}
+
+
+/**
+ * costruisci_indice esplora tutto l'albero e compone l'indice nel formato
+ * del file.
+ *
+ * @param blob Riceve il contenuto del file dell'indice
+ */
+inline void costruisci_indice(Immagine *img, const Volume *vol, const TabellaFat *fat,
+                              unsigned numero_thread, std::vector<unsigned char> &blob)
+{
+    std::vector<Voce> voci = esplora_albero(img, vol, fat, numero_thread);
+
+    // le voci sono ordinate per percorso: ogni directory arriva prima del suo
+    // contenuto, quindi il percorso 8.3 del padre e' gia' noto
+    std::unordered_map<std::string, std::string> percorsi_brevi;
+    std::vector<std::string> chiavi;
+    std::vector<uint32_t> record_chiave;
+    std::string testo, chiave, breve, chiave_breve;
+
+    std::vector<RecordIndice> record(voci.size());
+    for (size_t i = 0; i < voci.size(); i++)
+    {
+        const Voce &voce = voci[i];
+        RecordIndice &r = record[i];
+        memset(&r, 0, sizeof(RecordIndice));
+        r.percorso = testo.size();
+        r.lunghezza_percorso = voce.percorso.size();
+        testo += voce.percorso;
+        r.primo_cluster = voce.primo_cluster;
+        r.dimensione = voce.dimensione;
+        r.posizione = voce.posizione;
+        r.orario_creazione = voce.orario_creazione;
+        r.data_creazione = voce.data_creazione;
+        r.orario_modifica = voce.orario_modifica;
+        r.data_modifica = voce.data_modifica;
+        r.attributi = voce.attributi;
+        r.centesimi_creazione = voce.centesimi_creazione;
+        memcpy(r.nome_breve, voce.nome_breve, sizeof(r.nome_breve));
+
+        size_t barra = voce.percorso.rfind('/');
+        auto padre = percorsi_brevi.find(voce.percorso.substr(0, barra));
+        breve = padre == percorsi_brevi.end() ? std::string() : padre->second;
+        breve += '/';
+        breve += voce.nome_breve;
+        if (voce.attributi & ATTRIBUTO_DIRECTORY)
+            percorsi_brevi[voce.percorso] = breve;
+
+        chiave_percorso(voce.percorso.c_str(), chiave);
+        chiavi.push_back(chiave);
+        record_chiave.push_back(i);
+        chiave_percorso(breve.c_str(), chiave_breve);
+        if (chiave_breve != chiave)
+        {
+            chiavi.push_back(chiave_breve);
+            record_chiave.push_back(i);
+        }
+    }
+
+    // la tabella resta piena al massimo a meta'
+    uint64_t numero_posti = 16;
+    while (numero_posti < chiavi.size() * 2)
+        numero_posti <<= 1;
+    std::vector<PostoIndice> posti(numero_posti);
+    for (PostoIndice &posto : posti)
+    {
+        memset(&posto, 0, sizeof(PostoIndice));
+        posto.record = POSTO_VUOTO;
+    }
+
+    for (size_t k = 0; k < chiavi.size(); k++)
+    {
+        uint32_t h = hash_chiave(chiavi[k].data(), chiavi[k].size());
+        uint64_t i = h & (numero_posti - 1);
+        while (posti[i].record != POSTO_VUOTO)
+        {
+            // due directory possono avere lo stesso nome: vale la prima, come in cerca_percorso
+            const PostoIndice &p = posti[i];
+            if (p.hash == h && p.lunghezza_chiave == chiavi[k].size() &&
+                memcmp(testo.data() + p.chiave, chiavi[k].data(), p.lunghezza_chiave) == 0)
+                break;
+            i = (i + 1) & (numero_posti - 1);
+        }
+        if (posti[i].record != POSTO_VUOTO)
+            continue;
+
+        posti[i].chiave = testo.size();
+        posti[i].lunghezza_chiave = chiavi[k].size();
+        posti[i].hash = h;
+        posti[i].record = record_chiave[k];
+        testo += chiavi[k];
+    }
+
+    IntestazioneIndice testa;
+    memset(&testa, 0, sizeof(testa));
+    memcpy(testa.magia, MAGIA_INDICE, 8);
+    testa.numero_serie = vol->numero_serie;
+    testa.tipo_fat = vol->tipo_fat;
+    testa.checksum_fat = checksum_fat(fat);
+    stato_immagine(img, &testa.dimensione_immagine, &testa.modifica_immagine);
+    testa.numero_posti = numero_posti;
+    testa.numero_record = record.size();
+    testa.byte_testo = testo.size();
+
+    blob.clear();
+    blob.reserve(sizeof(testa) + posti.size() * sizeof(PostoIndice) + record.size() * sizeof(RecordIndice) + testo.size());
+    blob.insert(blob.end(), (const unsigned char *)&testa, (const unsigned char *)(&testa + 1));
+    blob.insert(blob.end(), (const unsigned char *)posti.data(), (const unsigned char *)(posti.data() + posti.size()));
+    blob.insert(blob.end(), (const unsigned char *)record.data(), (const unsigned char *)(record.data() + record.size()));
+    blob.insert(blob.end(), testo.begin(), testo.end());
+}
+
+
+/**
+ * carica_indice mappa un indice salvato e controlla che appartenga a questa
+ * immagine: stesso numero di serie, stesso tipo, stessa FAT e file
+ * dell'immagine non modificato da quando l'indice e' stato costruito. Non
+ * si legge nessuna directory.
+ *
+ * @returns -1 se il file manca, e' rovinato o e' di un'altra immagine, 0 altrimenti
+ */
+inline int carica_indice(const char *percorso, Immagine *img, const Volume *vol, const TabellaFat *fat,
+                         IndicePercorsi *indice)
+{
+    memset(indice, 0, sizeof(IndicePercorsi));
+
+    int fd = open(percorso, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat info;
+    void *mappa = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+        mappa = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mappa == MAP_FAILED)
+        return -1;
+
+    indice->dati = (const unsigned char *)mappa;
+    indice->dimensione = info.st_size;
+    indice->mappato = 1;
+    uint64_t dimensione;
+    int64_t modifica;
+    stato_immagine(img, &dimensione, &modifica);
+    int valido = collega_indice(indice) == 0 && indice->testa->numero_serie == vol->numero_serie &&
+                 indice->testa->tipo_fat == (uint32_t)vol->tipo_fat && indice->testa->dimensione_immagine == dimensione &&
+                 indice->testa->modifica_immagine == modifica && indice->testa->checksum_fat == checksum_fat(fat);
+    if (!valido)
+    {
+        munmap(mappa, info.st_size);
+        memset(indice, 0, sizeof(IndicePercorsi));
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * salva_indice scrive l'indice in un file temporaneo e poi lo rinomina,
+ * cosi' chi legge nello stesso momento non vede mai un file a meta'.
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+inline int salva_indice(const char *percorso, const std::vector<unsigned char> &blob)
+{
+    std::string temporaneo = std::string(percorso) + ".tmp." + std::to_string(getpid());
+    int fd = open(temporaneo.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    unsigned long scritti = 0;
+    while (scritti < blob.size())
+    {
+        ssize_t n = write(fd, blob.data() + scritti, blob.size() - scritti);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        scritti += n;
+    }
+
+    if (close(fd) != 0 || scritti != blob.size() || rename(temporaneo.c_str(), percorso) != 0)
+    {
+        unlink(temporaneo.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * apri_indice usa l'indice salvato accanto all'immagine se e' ancora valido;
+ * altrimenti lo costruisce e prova a salvarlo per le prossime volte. Se la
+ * cartella non e' scrivibile l'indice resta solo in memoria.
+ *
+ * @param percorso_immagine Il percorso dell'immagine, da cui si ricava quello dell'indice
+ * @param memoria Dove tenere l'indice se non e' mappato; deve vivere quanto l'indice
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+inline int apri_indice(const char *percorso_immagine, Immagine *img, const Volume *vol, const TabellaFat *fat,
+                       unsigned numero_thread, std::vector<unsigned char> &memoria, IndicePercorsi *indice)
+{
+    std::string percorso = std::string(percorso_immagine) + ESTENSIONE_INDICE;
+    if (carica_indice(percorso.c_str(), img, vol, fat, indice) == 0)
+        return 0;
+
+    costruisci_indice(img, vol, fat, numero_thread, memoria);
+    salva_indice(percorso.c_str(), memoria);
+
+    memset(indice, 0, sizeof(IndicePercorsi));
+    indice->dati = memoria.data();
+    indice->dimensione = memoria.size();
+    return collega_indice(indice);
+}
+
+
+inline void chiudi_indice(IndicePercorsi *indice)
+{
+    if (indice->mappato)
+        munmap((void *)indice->dati, indice->dimensione);
+    memset(indice, 0, sizeof(IndicePercorsi));
+}
+
+
+/**
+ * cerca_nell_indice trova una voce come cerca_percorso, ma con un solo
+ * accesso alla tabella hash.
+ *
+ * @returns 0 se la voce e' stata trovata, -1 altrimenti
+ */
+inline int cerca_nell_indice(const IndicePercorsi *indice, const char *percorso, Voce *trovata)
+{
+    std::string chiave;
+    chiave_percorso(percorso, chiave);
+
+    uint64_t maschera = indice->testa->numero_posti - 1;
+    uint32_t h = hash_chiave(chiave.data(), chiave.size());
+    for (uint64_t i = h & maschera, giri = 0; giri <= maschera; i = (i + 1) & maschera, giri++)
+    {
+        const PostoIndice &posto = indice->posti[i];
+        if (posto.record == POSTO_VUOTO)
+            return -1;
+        if (posto.hash != h || posto.lunghezza_chiave != chiave.size() ||
+            posto.chiave + posto.lunghezza_chiave > indice->testa->byte_testo ||
+            memcmp(indice->testo + posto.chiave, chiave.data(), chiave.size()) != 0)
+            continue;
+        if (posto.record >= indice->testa->numero_record)
+            return -1;
+
+        const RecordIndice &r = indice->record[posto.record];
+        if (r.percorso + r.lunghezza_percorso > indice->testa->byte_testo)
+            return -1;
+        trovata->percorso.assign(indice->testo + r.percorso, r.lunghezza_percorso);
+        memcpy(trovata->nome_breve, r.nome_breve, sizeof(trovata->nome_breve));
+        trovata->nome_breve[sizeof(trovata->nome_breve) - 1] = '\0';
+        trovata->attributi = r.attributi;
+        trovata->primo_cluster = r.primo_cluster;
+        trovata->dimensione = r.dimensione;
+        trovata->centesimi_creazione = r.centesimi_creazione;
+        trovata->orario_creazione = r.orario_creazione;
+        trovata->data_creazione = r.data_creazione;
+        trovata->orario_modifica = r.orario_modifica;
+        trovata->data_modifica = r.data_modifica;
+        trovata->posizione = r.posizione;
+        return 0;
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef LIBRERIA_FAT_H
+#define LIBRERIA_FAT_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "immagine.h"
+#include "fat.h"
+#include "esplora.h"
+
+
+// L'interfaccia della libreria: un'immagine aperta e i file aperti al suo
+// interno. Dopo l'apertura nessuna delle due strutture cambia piu' e ogni
+// lettura e' posizionale (mappatura o pread), quindi piu' thread possono
+// usare la stessa immagine e lo stesso file insieme senza lock.
+
+
+// FatImmagine e' un'immagine aperta: il volume e la FAT gia' decodificati
+struct FatImmagine
+{
+    Immagine *img;
+    Volume vol;
+    TabellaFat *fat;
+};
+
+
+// FatFile e' un file aperto: la sua voce e le sue estensioni, con l'offset
+// nel file da cui parte ciascuna, per trovare in O(log n) dove leggere
+struct FatFile
+{
+    const FatImmagine *immagine;
+    Voce voce;
+    std::vector<Estensione> estensioni;
+    std::vector<unsigned long> inizio_estensione;
+};
+
+
+/**
+ * fat_open_image apre un'immagine, legge il boot sector e carica la FAT.
+ *
+ * @param percorso Il percorso dell'immagine, non deve essere NULL
+ * @param blocchi_cache La capacita' della cache dei settori se si legge con pread, 0 per nessuna
+ *
+ * @returns L'immagine aperta, o NULL in caso di errore
+ */
+inline FatImmagine *fat_open_image(const char *percorso, unsigned long blocchi_cache = 0)
+{
+    Immagine *img = apri_immagine(percorso);
+    if (img == NULL)
+        return NULL;
+
+    FatImmagine *immagine = new FatImmagine;
+    immagine->img = img;
+    immagine->fat = NULL;
+    if (leggi_volume(img, &immagine->vol) == 0)
+    {
+        if (blocchi_cache > 0)
+            attiva_cache(img, immagine->vol.byte_per_settore, blocchi_cache);
+        immagine->fat = carica_tabella_fat(img, &immagine->vol);
+    }
+
+    if (immagine->fat == NULL)
+    {
+        chiudi_immagine(img);
+        delete immagine;
+        return NULL;
+    }
+    return immagine;
+}
+
+
+/**
+ * fat_close_image chiude l'immagine. I file aperti al suo interno non si
+ * possono piu' usare.
+ */
+inline void fat_close_image(FatImmagine *immagine)
+{
+    if (immagine == NULL)
+        return;
+
+    distruggi_tabella_fat(immagine->fat);
+    chiudi_immagine(immagine->img);
+    delete immagine;
+}
+
+
+// voce_root descrive la root directory, che non ha una riga che la contenga
+inline void voce_root(const FatImmagine *immagine, Voce *voce)
+{
+    voce->percorso.clear();
+    strcpy(voce->nome_breve, "/");
+    voce->attributi = ATTRIBUTO_DIRECTORY;
+    voce->primo_cluster = immagine->vol.cluster_root;
+    voce->dimensione = 0;
+    voce->centesimi_creazione = 0;
+    voce->orario_creazione = voce->data_creazione = 0;
+    voce->orario_modifica = voce->data_modifica = 0;
+    voce->posizione = immagine->vol.inizio_root_dir;
+}
+
+
+/**
+ * fat_stat trova la voce di un percorso, ad esempio "SUB/DENTRO.TXT".
+ * "" e "/" indicano la root directory.
+ *
+ * @returns 0 se la voce esiste, -1 altrimenti
+ */
+inline int fat_stat(const FatImmagine *immagine, const char *percorso, Voce *voce)
+{
+    if (immagine == NULL || percorso == NULL || voce == NULL)
+        return -1;
+
+    const char *p = percorso;
+    while (*p == '/')
+        p++;
+    if (*p == '\0')
+    {
+        voce_root(immagine, voce);
+        return 0;
+    }
+    return cerca_percorso(immagine->img, &immagine->vol, immagine->fat, p, voce);
+}
+
+
+/**
+ * fat_readdir aggiunge a voci il contenuto di una directory, senza "." e "..".
+ *
+ * @returns 0 se la directory esiste, -1 altrimenti
+ */
+inline int fat_readdir(const FatImmagine *immagine, const char *percorso, std::vector<Voce> &voci)
+{
+    Voce directory;
+    if (fat_stat(immagine, percorso, &directory) != 0 || !(directory.attributi & ATTRIBUTO_DIRECTORY))
+        return -1;
+
+    // ".." che punta alla root ha primo cluster 0
+    uint32_t cluster = directory.primo_cluster;
+    if (cluster == 0)
+        cluster = immagine->vol.cluster_root;
+
+    std::vector<unsigned char> buffer;
+    NomeLungo nome_lungo;
+    leggi_directory(immagine->img, &immagine->vol, immagine->fat, cluster, directory.percorso,
+                    voci, buffer, &nome_lungo);
+    return 0;
+}
+
+
+/**
+ * fat_open apre un file dell'immagine e ne calcola subito le estensioni,
+ * cosi' le letture non seguono piu' la catena.
+ *
+ * @returns Il file aperto, o NULL se non esiste o e' una directory
+ */
+inline FatFile *fat_open(const FatImmagine *immagine, const char *percorso)
+{
+    FatFile *file = new FatFile;
+    if (fat_stat(immagine, percorso, &file->voce) != 0 || (file->voce.attributi & ATTRIBUTO_DIRECTORY))
+    {
+        delete file;
+        return NULL;
+    }
+    file->immagine = immagine;
+
+    unsigned long offset = 0;
+    IteratoreCatena catena = inizia_catena(immagine->fat, file->voce.primo_cluster);
+    Estensione estensione;
+    while (offset < file->voce.dimensione && prossima_estensione(&catena, &estensione))
+    {
+        file->estensioni.push_back(estensione);
+        file->inizio_estensione.push_back(offset);
+        offset += (unsigned long)estensione.lunghezza * immagine->vol.byte_per_cluster;
+    }
+    return file;
+}
+
+
+inline void fat_close(FatFile *file)
+{
+    delete file;
+}
+
+
+/**
+ * fat_pread legge fino a count byte del file a partire da offset, come
+ * pread: non c'e' una posizione corrente, quindi le chiamate concorrenti
+ * sullo stesso file non interferiscono.
+ *
+ * @returns Il numero di byte letti, 0 a fine file, -1 in caso di errore
+ */
+inline long fat_pread(const FatFile *file, void *buffer, unsigned long count, unsigned long offset)
+{
+    if (file == NULL || buffer == NULL)
+        return -1;
+    if (offset >= file->voce.dimensione)
+        return 0;
+    if (count > file->voce.dimensione - offset)
+        count = file->voce.dimensione - offset;
+
+    const FatImmagine *immagine = file->immagine;
+    unsigned long byte_per_cluster = immagine->vol.byte_per_cluster;
+    unsigned char *dest = (unsigned char *)buffer;
+
+    // l'ultima estensione che parte non oltre offset
+    size_t e = std::upper_bound(file->inizio_estensione.begin(), file->inizio_estensione.end(), offset) -
+               file->inizio_estensione.begin();
+    if (e == 0)
+        return -1;
+    e--;
+
+    unsigned long letti = 0;
+    while (letti < count && e < file->estensioni.size())
+    {
+        unsigned long dentro = offset + letti - file->inizio_estensione[e];
+        unsigned long lunghezza = (unsigned long)file->estensioni[e].lunghezza * byte_per_cluster;
+
+        // offset oltre l'ultima estensione di una catena troppo corta
+        if (dentro >= lunghezza)
+            break;
+        unsigned long quanti = lunghezza - dentro < count - letti ? lunghezza - dentro : count - letti;
+
+        read_buffer(immagine->img, posizione_cluster(&immagine->vol, file->estensioni[e].inizio) + dentro,
+                    quanti, dest + letti);
+        letti += quanti;
+        e++;
+    }
+
+    // una catena piu' corta della dimensione dichiarata finisce qui
+    return letti;
+}
+
+#endif
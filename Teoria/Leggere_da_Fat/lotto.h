@@ -0,0 +1,221 @@
+#ifndef LOTTO_H
+#define LOTTO_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "indice.h"
+
+
+// RisultatoLotto e' l'esito dell'elaborazione di un'immagine del lotto
+typedef struct
+{
+    std::string immagine;
+    std::string rapporto;
+    unsigned long dimensione;
+
+    // Il codice di uscita del processo, -1 se e' stato ucciso da un segnale
+    int codice;
+    int segnale;
+
+    double secondi;
+} RisultatoLotto;
+
+
+inline double adesso()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/**
+ * raccogli_immagini espande gli argomenti in un elenco di immagini: un file
+ * e' un'immagine, una directory contribuisce tutti i suoi file regolari
+ * (non le sottodirectory), in ordine di nome. Gli indici dei percorsi
+ * salvati accanto alle immagini vengono saltati.
+ *
+ * @returns 0 se tutti gli argomenti esistono, -1 altrimenti
+ */
+inline int raccogli_immagini(char *argomenti[], int numero, std::vector<std::string> &immagini)
+{
+    int ret = 0;
+    for (int i = 0; i < numero; i++)
+    {
+        struct stat info;
+        if (stat(argomenti[i], &info) != 0)
+        {
+            perror(argomenti[i]);
+            ret = -1;
+            continue;
+        }
+        if (!S_ISDIR(info.st_mode))
+        {
+            immagini.push_back(argomenti[i]);
+            continue;
+        }
+
+        DIR *directory = opendir(argomenti[i]);
+        if (directory == NULL)
+        {
+            perror(argomenti[i]);
+            ret = -1;
+            continue;
+        }
+        std::vector<std::string> contenuto;
+        struct dirent *voce;
+        while ((voce = readdir(directory)) != NULL)
+        {
+            std::string nome = voce->d_name;
+            size_t lunghezza_estensione = strlen(ESTENSIONE_INDICE);
+            if (nome[0] == '.' || (nome.size() > lunghezza_estensione &&
+                                   nome.compare(nome.size() - lunghezza_estensione, lunghezza_estensione, ESTENSIONE_INDICE) == 0))
+                continue;
+
+            std::string percorso = std::string(argomenti[i]) + "/" + nome;
+            if (stat(percorso.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+                contenuto.push_back(percorso);
+        }
+        closedir(directory);
+        std::sort(contenuto.begin(), contenuto.end());
+        immagini.insert(immagini.end(), contenuto.begin(), contenuto.end());
+    }
+    return ret;
+}
+
+
+/**
+ * nomi_rapporti sceglie il file del rapporto di ogni immagine:
+ * <cartella>/<nome dell'immagine>.txt, con un numero aggiunto se due
+ * immagini di directory diverse hanno lo stesso nome.
+ */
+inline void nomi_rapporti(const std::vector<std::string> &immagini, const char *cartella,
+                          std::vector<RisultatoLotto> &risultati)
+{
+    std::map<std::string, int> usati;
+    risultati.resize(immagini.size());
+    for (size_t i = 0; i < immagini.size(); i++)
+    {
+        std::string nome = immagini[i].substr(immagini[i].rfind('/') + 1);
+        int volte = usati[nome]++;
+        if (volte > 0)
+            nome += "_" + std::to_string(volte);
+
+        RisultatoLotto &r = risultati[i];
+        r.immagine = immagini[i];
+        r.rapporto = std::string(cartella) + "/" + nome + ".txt";
+        r.codice = -1;
+        r.segnale = 0;
+        r.secondi = 0;
+
+        struct stat info;
+        r.dimensione = stat(immagini[i].c_str(), &info) == 0 ? info.st_size : 0;
+    }
+}
+
+
+/**
+ * esegui_lotto elabora ogni immagine in un processo figlio, con al massimo
+ * numero_processi figli attivi insieme. Il figlio scrive standard output e
+ * standard error nel proprio rapporto, cosi' un'immagine che manda in crash
+ * il lettore o ne esaurisce la memoria non tocca le altre: il suo esito
+ * resta solo nel codice di uscita o nel segnale.
+ *
+ * elabora riceve la posizione in risultati del lavoro da fare e
+ * restituisce il codice di uscita.
+ *
+ * @param risultati Gia' preparati da nomi_rapporti, ricevono gli esiti
+ */
+template <typename Elabora>
+void esegui_lotto(std::vector<RisultatoLotto> &risultati, unsigned numero_processi, Elabora elabora)
+{
+    if (numero_processi == 0)
+        numero_processi = 1;
+
+    std::map<pid_t, size_t> attivi;
+    std::vector<double> inizio(risultati.size(), 0);
+    size_t prossima = 0;
+
+    // nulla di quanto stampato finora deve essere ripetuto dai figli
+    fflush(stdout);
+    fflush(stderr);
+
+    while (prossima < risultati.size() || !attivi.empty())
+    {
+        while (prossima < risultati.size() && attivi.size() < numero_processi)
+        {
+            RisultatoLotto &r = risultati[prossima];
+            inizio[prossima] = adesso();
+            pid_t figlio = fork();
+            if (figlio == 0)
+            {
+                int rapporto = open(r.rapporto.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (rapporto < 0)
+                    _exit(127);
+                dup2(rapporto, STDOUT_FILENO);
+                dup2(rapporto, STDERR_FILENO);
+                close(rapporto);
+
+                int codice = elabora(prossima);
+                fflush(stdout);
+                fflush(stderr);
+                _exit(codice);
+            }
+            if (figlio < 0)
+            {
+                // senza processi nuovi si aspetta che ne finisca uno
+                if (attivi.empty())
+                {
+                    perror("fork");
+                    r.codice = 126;
+                    prossima++;
+                }
+                break;
+            }
+            attivi[figlio] = prossima++;
+        }
+
+        // una fork fallita senza figli in corso: non c'e' nulla da aspettare
+        if (attivi.empty())
+            continue;
+
+        int stato;
+        pid_t finito = waitpid(-1, &stato, 0);
+        if (finito < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != ECHILD)
+                break;
+            // i figli non sono piu' aspettabili: si passa alle immagini rimaste
+            attivi.clear();
+            continue;
+        }
+        auto trovato = attivi.find(finito);
+        if (trovato == attivi.end())
+            continue;
+
+        RisultatoLotto &r = risultati[trovato->second];
+        r.secondi = adesso() - inizio[trovato->second];
+        if (WIFEXITED(stato))
+            r.codice = WEXITSTATUS(stato);
+        else if (WIFSIGNALED(stato))
+            r.segnale = WTERMSIG(stato);
+        attivi.erase(trovato);
+    }
+}
+
+#endif
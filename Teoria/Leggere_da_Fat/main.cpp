@@ -1,207 +1,1396 @@
 #include <stdio.h>
+#include <strings.h>
+
+#include "immagine.h"
+#include "fat.h"
+#include "estrai.h"
+#include "estrai_tutto.h"
+#include "esplora.h"
+#include "statistiche.h"
+#include "disposizione.h"
+#include "controllo.h"
+#include "indice.h"
+#include "mappa_inversa.h"
+#include "impronte.h"
+#include "ricerca.h"
+#include "recupero.h"
+#include "uscita.h"
+#include "lotto.h"
+#include "scrittura.h"
+#include "deframmenta.h"
+#include "partizioni.h"
+
+
+// Capacita' predefinita della cache dei settori quando si legge con pread
+#define BLOCCHI_CACHE_PREDEFINITI 4096
+
+// Quante letture o scritture tiene in volo l'estrazione di tutta l'immagine
+#define PROFONDITA_PREDEFINITA 32
+
+
+void stampa_voce(Immagine *file_system, const Volume *vol, const TabellaFat *fat,
+                 const Voce *voce, unsigned char *buffer)
+{
+    unsigned char sola_letture = 0, nascosto = 0,
+                  sistema = 0, sottodirectory = 0, archivio = 0;
+
+
+    unsigned long ora_creazione = 0;
+    unsigned long minuti_creazione = 0;
+    unsigned long secondi_creazione = 0;
+    unsigned long millisecondi_creazione = 0;
+
+
+    unsigned long giorno_creazione = 0;
+    unsigned long mese_creazione = 0;
+    unsigned long anno_creazione = 0;
+
+
+    sola_letture = voce->attributi & ATTRIBUTO_SOLA_LETTURA;
+    nascosto = voce->attributi & ATTRIBUTO_NASCOSTO;
+    sistema = voce->attributi & ATTRIBUTO_SISTEMA;
+    sottodirectory = voce->attributi & ATTRIBUTO_DIRECTORY;
+    archivio = voce->attributi & ATTRIBUTO_ARCHIVIO;
+
+
+    printf("\tfile %s\n", voce->percorso.c_str());
+
+
+    if (sola_letture)
+        printf("\t\tsola lettura\n");
+    if (nascosto)
+        printf("\t\tnascosto\n");
+    if (sistema)
+        printf("\t\tsistema\n");
+    if (sottodirectory)
+        printf("\t\tsottodirectory\n");
+    if (archivio)
+        printf("\t\tarchivio\n");
+
+
+    // FAT 16  HEPOX
+    // millisecondo presenti solo in creazione e non in modifica secondi dispari presenti solo creazione e non in modifche
+    // file con modifica in secondi dispari --> problema pk non e presente un bit per i milli secondi
+    // ambito unix si utilizza il 1970 pk prima non erano presenti i file prima di quella data
+
+
+    ora_creazione = voce->orario_creazione >> 11;
+    minuti_creazione = (voce->orario_creazione >> 5) & 0x3f;
+    secondi_creazione = (voce->orario_creazione & 0x1f) * 2;
+    millisecondi_creazione = voce->centesimi_creazione * 10;
+
+
+    if (millisecondi_creazione >= 1000)
+    {
+        millisecondi_creazione -= 1000;
+        secondi_creazione++;
+    }
+
+
+    printf("\t\tOra di creazione: %lu:%lu:%lu:%lu\n", ora_creazione, minuti_creazione, secondi_creazione, millisecondi_creazione);
+
 
+    giorno_creazione = voce->data_creazione & 0x1f;
+    mese_creazione = (voce->data_creazione >> 5) & 0x0f;
+    anno_creazione = ((voce->data_creazione >> 9) & 0x7f) + 1980;
 
-void read_buffer(FILE *input, int pos, int count, unsigned char *dest)
+
+    printf("\t\tData di creazione: %lu:%lu:%lu\n", giorno_creazione, mese_creazione, anno_creazione);
+
+
+    // cluster 0 e 1 non esistono per socorerli parto dal 2
+    printf("\t\tDimensione: %lu byte\n", voce->dimensione);
+    printf("\t\tPrimo cluster: %lu\n", (unsigned long)voce->primo_cluster);
+
+
+    if (archivio)
+    {
+        unsigned long numero_estensioni = 0;
+        IteratoreCatena catena = inizia_catena(fat, voce->primo_cluster);
+        Estensione estensione;
+        while (prossima_estensione(&catena, &estensione))
+            numero_estensioni++;
+        printf("\t\tEstensioni: %lu\n", numero_estensioni);
+
+
+        // il contenuto passa dal buffer fisso, anche se contiene byte nulli
+        printf("\t\tContenuto: ");
+        fflush(stdout);
+        estrai_contenuto(file_system, vol, fat, voce->primo_cluster, voce->dimensione, STDOUT_FILENO, buffer);
+        printf("\n");
+    }
+}
+
+
+void elenca(Immagine *file_system, const Volume *vol, const TabellaFat *fat,
+            unsigned numero_thread, unsigned char *buffer)
 {
-    fseek(input, pos, SEEK_SET);
-    fread(dest, 1, count, input);
+    printf("nome del file system: %s\n", vol->nome_del_filesystem);
+    printf("tipo di FAT: FAT%d\n", vol->tipo_fat);
+    printf("numero byte per settore: %lu\n", vol->byte_per_settore);
+    printf("numero byte per cluster: %lu\n", vol->byte_per_cluster);
+    printf("numero byte per fat: %lu\n", vol->bytes_per_fat);
+    printf("numero settori riservati: %lu\n", vol->numero_settori_riservati);
+    printf("ininzio area fat: 0x%lx\n", vol->inizio_area_fat);
+    printf("numero fat: %lu\n", vol->numero_fat);
+    printf("numero righe root directory: %lu\n", vol->numero_righe_dir);
+    printf("inizio root directory: 0x%lx\n", vol->inizio_root_dir);
+    printf("inizio area dati: 0x%lx\n", vol->inizio_area_dati);
+    printf("dimensione del disco: %lu\n", vol->dimensione_disco);
+
+
+    // tutto l'albero, non solo la root, ordinato per percorso
+    std::vector<Voce> voci = esplora_albero(file_system, vol, fat, numero_thread);
+    for (const Voce &voce : voci)
+        stampa_voce(file_system, vol, fat, &voce, buffer);
+}
+
+
+/**
+ * esporta scrive un record JSONL o CSV per ogni voce dell'albero, tutti
+ * attraverso un solo buffer grande invece di una printf per campo.
+ *
+ * @param formato "jsonl" o "csv"
+ * @returns 1 se il formato non esiste o la scrittura fallisce, 0 altrimenti
+ */
+int esporta(Immagine *file_system, const Volume *vol, const TabellaFat *fat,
+            const char *formato, unsigned numero_thread)
+{
+    FormatoUscita scelto;
+    if (strcmp(formato, "jsonl") == 0)
+        scelto = FORMATO_JSONL;
+    else if (strcmp(formato, "csv") == 0)
+        scelto = FORMATO_CSV;
+    else
+    {
+        fprintf(stderr, "Formato sconosciuto: %s (jsonl o csv)\n", formato);
+        return 1;
+    }
+
+
+    std::vector<Voce> voci = esplora_albero(file_system, vol, fat, numero_thread);
+    BufferUscita out;
+    if (crea_buffer_uscita(&out, STDOUT_FILENO) != 0)
+    {
+        fprintf(stderr, "Memoria insufficiente\n");
+        return 1;
+    }
+
+    // nessuna printf deve restare indietro nel buffer di stdio
+    fflush(stdout);
+    if (scelto == FORMATO_CSV)
+        scrivi_testo(&out, INTESTAZIONE_CSV, strlen(INTESTAZIONE_CSV));
+    for (const Voce &voce : voci)
+        scrivi_voce(&out, scelto, &voce);
+
+
+    if (distruggi_buffer_uscita(&out) != 0)
+    {
+        perror("scrittura");
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * estrai_file copia un file dell'immagine su un file dell'host, oppure
+ * sullo standard output se la destinazione e' NULL o "-". Il file si cerca
+ * nell'indice salvato accanto all'immagine, creato al primo uso; con
+ * FAT_INDICE=0 si scende invece nelle directory.
+ *
+ * @returns 1 in caso di errore, 0 altrimenti
+ */
+int estrai_file(Immagine *file_system, const Volume *vol, const TabellaFat *fat, const char *percorso_immagine,
+                const char *nome, const char *destinazione, unsigned numero_thread, unsigned char *buffer)
+{
+    Voce voce;
+    const char *usa_indice = getenv("FAT_INDICE");
+    IndicePercorsi indice;
+    std::vector<unsigned char> memoria_indice;
+    int trovato;
+
+    if ((usa_indice == NULL || strcmp(usa_indice, "0") != 0) &&
+        apri_indice(percorso_immagine, file_system, vol, fat, numero_thread, memoria_indice, &indice) == 0)
+    {
+        trovato = cerca_nell_indice(&indice, nome, &voce);
+        chiudi_indice(&indice);
+    }
+    else
+        trovato = cerca_percorso(file_system, vol, fat, nome, &voce);
+
+    if (trovato != 0)
+    {
+        fprintf(stderr, "File '%s' non trovato\n", nome);
+        return 1;
+    }
+    if (voce.attributi & ATTRIBUTO_DIRECTORY)
+    {
+        fprintf(stderr, "'%s' e' una directory\n", nome);
+        return 1;
+    }
+
+
+    int uscita = STDOUT_FILENO;
+    if (destinazione != NULL && strcmp(destinazione, "-") != 0)
+    {
+        uscita = open(destinazione, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (uscita < 0)
+        {
+            perror(destinazione);
+            return 1;
+        }
+    }
+
+
+    long scritti = estrai_contenuto(file_system, vol, fat, voce.primo_cluster, voce.dimensione, uscita, buffer);
+
+
+    if (uscita != STDOUT_FILENO)
+        close(uscita);
+    if (scritti < 0 || (unsigned long)scritti != voce.dimensione)
+    {
+        fprintf(stderr, "Estrazione di '%s' incompleta\n", nome);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * estrai_tutto ricrea tutto l'albero dell'immagine nella cartella indicata.
+ * FAT_CODA sceglie quante operazioni tenere in volo, FAT_IO_URING=0 forza
+ * il pool di thread al posto di io_uring.
+ *
+ * @returns 1 se qualcosa non e' stato estratto, 0 altrimenti
+ */
+int estrai_tutto(Immagine *file_system, const Volume *vol, const TabellaFat *fat,
+                 const char *cartella, unsigned numero_thread)
+{
+    if (mkdir(cartella, 0755) != 0 && errno != EEXIST)
+    {
+        perror(cartella);
+        return 1;
+    }
+
+
+    const char *coda = getenv("FAT_CODA");
+    const char *io_uring = getenv("FAT_IO_URING");
+    unsigned profondita = coda ? strtoul(coda, NULL, 10) : PROFONDITA_PREDEFINITA;
+
+
+    std::vector<Voce> voci = esplora_albero(file_system, vol, fat, numero_thread);
+    RisultatoEstrazione r;
+    estrai_albero(file_system, vol, fat, voci, cartella, profondita,
+                  io_uring == NULL || strcmp(io_uring, "0") != 0, &r);
+
+
+    printf("directory create: %lu\n", r.directory);
+    printf("file estratti: %lu\n", r.file);
+    printf("byte estratti: %lu\n", r.byte);
+    printf("errori: %lu\n", r.errori);
+    printf("motore: %s\n", r.anello ? "io_uring" : "thread");
+
+
+    return r.errori > 0 ? 1 : 0;
 }
 
 
-void read_string(FILE *input, int pos, int count, unsigned char *dest)
+/**
+ * proprietari dice, per ogni offset dell'immagine, in quale area cade e
+ * quale file o directory possiede il cluster corrispondente. Gli offset
+ * possono essere decimali o esadecimali con 0x.
+ *
+ * @returns 1 se un offset non e' valido, 0 altrimenti
+ */
+int proprietari(Immagine *file_system, const Volume *vol, const TabellaFat *fat,
+                char *offset[], int numero_offset, unsigned numero_thread)
 {
-    read_buffer(input, pos, count, dest);
-    dest[count] = '\0';
+    std::vector<Voce> voci = esplora_albero(file_system, vol, fat, numero_thread);
+    std::vector<IntervalloCluster> intervalli;
+    costruisci_mappa_inversa(vol, fat, voci, intervalli);
+
+
+    int ret = 0;
+    for (int i = 0; i < numero_offset; i++)
+    {
+        char *fine;
+        unsigned long posizione = strtoul(offset[i], &fine, 0);
+        if (*fine != '\0')
+        {
+            fprintf(stderr, "Offset non valido: %s\n", offset[i]);
+            ret = 1;
+            continue;
+        }
+
+
+        uint32_t cluster;
+        switch (area_di_offset(vol, posizione, &cluster))
+        {
+        case AREA_RISERVATA:
+            printf("0x%lx: settori riservati (boot sector)\n", posizione);
+            continue;
+        case AREA_FAT:
+            printf("0x%lx: FAT numero %lu\n", posizione, (posizione - vol->inizio_area_fat) / vol->bytes_per_fat);
+            continue;
+        case AREA_ROOT:
+            printf("0x%lx: root directory\n", posizione);
+            continue;
+        case AREA_FUORI:
+            printf("0x%lx: fuori dal volume\n", posizione);
+            continue;
+        case AREA_DATI:
+            break;
+        }
+
+
+        const IntervalloCluster *intervallo = cerca_proprietario(intervalli, cluster);
+        if (intervallo == NULL)
+        {
+            printf("0x%lx: cluster %lu, %s\n", posizione, (unsigned long)cluster,
+                   fat->prossimo[cluster] == CLUSTER_LIBERO ? "libero" : "occupato ma di nessun file");
+            continue;
+        }
+
+
+        // il byte del file che si trova a quell'offset
+        unsigned long nel_file = (unsigned long)(intervallo->primo_nel_file + cluster - intervallo->inizio) * vol->byte_per_cluster +
+                                 (posizione - vol->inizio_area_dati) % vol->byte_per_cluster;
+        const char *percorso = intervallo->voce == VOCE_ROOT ? "/" : voci[intervallo->voce].percorso.c_str();
+        printf("0x%lx: cluster %lu, %s, byte %lu\n", posizione, (unsigned long)cluster, percorso, nel_file);
+    }
+    return ret;
 }
 
 
-unsigned long read_number(FILE *input, int pos, int count)
+/**
+ * impronte stampa per ogni file dell'immagine SHA-256, CRC32C, dimensione
+ * e percorso, in ordine di percorso. I file si dividono tra i thread.
+ *
+ * @returns 1 se qualche file non si e' potuto leggere per intero, 0 altrimenti
+ */
+int impronte(Immagine *file_system, const Volume *vol, const TabellaFat *fat, unsigned numero_thread)
 {
-    unsigned long ret = 0;
+    std::vector<Voce> voci = esplora_albero(file_system, vol, fat, numero_thread);
+    std::vector<ImprontaFile> risultati;
+    impronte_albero(file_system, vol, fat, voci, numero_thread, risultati);
 
 
-    // Questa implementazione funziona per Little Endian leggendo i byte a ritroso
-    unsigned char buffer[count];
-    read_buffer(input, pos, count, buffer);
+    int ret = 0;
+    for (size_t i = 0; i < voci.size(); i++)
+    {
+        if (voci[i].attributi & ATTRIBUTO_DIRECTORY)
+            continue;
 
+        char esadecimale[65];
+        for (int b = 0; b < 32; b++)
+            sprintf(esadecimale + 2 * b, "%02x", risultati[i].sha256[b]);
+        printf("%s %08x %10lu %s\n", esadecimale, risultati[i].crc32c, voci[i].dimensione, voci[i].percorso.c_str());
 
-    for (int a = count - 1; a >= 0; a--)
+        if (risultati[i].errore)
+        {
+            fprintf(stderr, "%s: catena piu' corta della dimensione\n", voci[i].percorso.c_str());
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+/**
+ * cerca_contenuto stampa "offset percorso" per ogni occorrenza del modello
+ * nel contenuto dei file, in ordine di percorso e di offset. Il riassunto
+ * va sullo standard error, cosi' lo standard output resta fatto solo di
+ * occorrenze.
+ *
+ * @returns 1 in caso di errore, 0 altrimenti
+ */
+int cerca_contenuto(Immagine *file_system, const Volume *vol, const TabellaFat *fat,
+                    const char *testo, unsigned numero_thread)
+{
+    std::string modello;
+    if (decodifica_modello(testo, modello) != 0)
     {
-        ret = ret << 8;
-        ret += buffer[a];
+        fprintf(stderr, "Modello non valido: %s\n", testo);
+        return 1;
     }
+
+    std::vector<Voce> voci = esplora_albero(file_system, vol, fat, numero_thread);
+    std::vector<RisultatoRicerca> risultati;
+    double inizio = adesso();
+    unsigned long byte = cerca_nell_albero(file_system, vol, fat, voci, modello, numero_thread, risultati);
+    double durata = adesso() - inizio;
+
+
+    int ret = 0;
+    unsigned long occorrenze = 0, file = 0;
+    for (size_t i = 0; i < voci.size(); i++)
+    {
+        for (unsigned long posizione : risultati[i].posizioni)
+            printf("%10lu %s\n", posizione, voci[i].percorso.c_str());
+        occorrenze += risultati[i].posizioni.size();
+        file += !risultati[i].posizioni.empty();
+
+        if (risultati[i].errore)
+        {
+            fprintf(stderr, "%s: catena piu' corta della dimensione\n", voci[i].percorso.c_str());
+            ret = 1;
+        }
+    }
+    fprintf(stderr, "%lu occorrenze in %lu file, %lu byte letti in %.2f s (%.1f MB/s)\n", occorrenze, file, byte,
+            durata, durata > 0 ? byte / durata / 1e6 : 0);
     return ret;
 }
 
 
-int main()
+/**
+ * recupera elenca i file e le directory cancellati che si trovano nelle
+ * directory vive, con quanto resta dei loro cluster. Se cartella non e'
+ * NULL vi salva i file ancora integri.
+ *
+ * @returns 1 se il salvataggio ha avuto errori, 0 altrimenti
+ */
+int recupera(Immagine *file_system, const Volume *vol, const TabellaFat *fat,
+             const char *cartella, unsigned numero_thread)
 {
-    unsigned char nome_del_filesystem[9];
-    unsigned long byte_per_settore = 0;
-    unsigned long byte_per_cluster = 0;
-    unsigned long numero_settori_riservati = 0;
-    unsigned long inizio_area_fat = 0;
-    unsigned long numero_fat = 0;
-    unsigned long numero_righe_dir = 0;
-    unsigned long bytes_per_fat = 0;
-    unsigned long inizio_root_dir = 0;
-    unsigned long inizio_area_dati = 0;
-    unsigned long dimensione_disco = 0;
+    static const char *stati[] = {"integro", "parziale", "sovrascritto", "vuoto"};
 
+    std::vector<Voce> voci = esplora_albero(file_system, vol, fat, numero_thread);
+    std::vector<VoceCancellata> cancellate;
+    cerca_cancellate(file_system, vol, fat, voci, cancellate);
 
-    FILE *file_system = fopen("fat", "rb");
 
+    unsigned long per_stato[4] = {0, 0, 0, 0};
+    for (const VoceCancellata &c : cancellate)
+    {
+        printf("%c %-12s %10lu %10lu %lu/%lu %s\n", c.voce.attributi & ATTRIBUTO_DIRECTORY ? 'd' : '-',
+               stati[c.stato], (unsigned long)c.voce.primo_cluster, c.voce.dimensione,
+               c.cluster_liberi, c.cluster_necessari, c.voce.percorso.c_str());
+        per_stato[c.stato]++;
+    }
+    printf("cancellati: %zu (%lu integri, %lu parziali, %lu sovrascritti, %lu vuoti)\n", cancellate.size(),
+           per_stato[RECUPERO_INTEGRO], per_stato[RECUPERO_PARZIALE], per_stato[RECUPERO_SOVRASCRITTO], per_stato[RECUPERO_VUOTO]);
 
-    if (file_system == NULL)
+    if (cartella == NULL)
+        return 0;
+    if (mkdir(cartella, 0755) != 0 && errno != EEXIST)
     {
-        perror("Errore nell'apertura del file 'fat'");
+        perror(cartella);
         return 1;
     }
 
 
-    read_string(file_system, 0x03, 8, nome_del_filesystem);
-    byte_per_settore = read_number(file_system, 0x0b, 2);
-    byte_per_cluster = byte_per_settore * read_number(file_system, 0x0d, 1);
-    numero_settori_riservati = read_number(file_system, 0x0e, 2);
-    inizio_area_fat = numero_settori_riservati * byte_per_settore;
-    numero_fat = read_number(file_system, 0x10, 1);
-    numero_righe_dir = read_number(file_system, 0x11, 2);
-    bytes_per_fat = byte_per_settore * read_number(file_system, 0x16, 2);
-    inizio_root_dir = inizio_area_fat + bytes_per_fat * numero_fat;
-    inizio_area_dati = inizio_root_dir + 32 * numero_righe_dir;
-    dimensione_disco = byte_per_settore * read_number(file_system, 0x20, 4);
+    RisultatoEstrazione r;
+    recupera_cancellate(file_system, vol, cancellate, cartella, &r);
+    printf("file recuperati: %lu\n", r.file);
+    printf("byte recuperati: %lu\n", r.byte);
+    printf("errori: %lu\n", r.errori);
+    return r.errori > 0 ? 1 : 0;
+}
 
 
-    printf("nome del file system: %s\n", nome_del_filesystem);
-    printf("numero byte per settore: %lu\n", byte_per_settore);
-    printf("numero byte per cluster: %lu\n", byte_per_cluster);
-    printf("numero byte per fat: %lu\n", bytes_per_fat);
-    printf("numero settori riservati: %lu\n", numero_settori_riservati);
-    printf("ininzio area fat: 0x%lx\n", inizio_area_fat);
-    printf("numero fat: %lu\n", numero_fat);
-    printf("numero righe root directory: %lu\n", numero_righe_dir);
-    printf("inizio root directory: 0x%lx\n", inizio_root_dir);
-    printf("inizio area dati: 0x%lx\n", inizio_area_dati);
-    printf("dimensione del disco: %lu\n", dimensione_disco);
+void stampa_statistiche(const Volume *vol, const TabellaFat *fat)
+{
+    StatisticheFat stat;
+    if (calcola_statistiche(fat, &stat) != 0)
+        return;
+
+
+    printf("cluster totali: %lu\n", stat.totali);
+    printf("cluster usati: %lu\n", stat.usati);
+    printf("cluster liberi: %lu\n", stat.liberi);
+    printf("cluster danneggiati: %lu\n", stat.danneggiati);
+    printf("catene (fine catena): %lu\n", stat.fine_catena);
+    printf("byte usati: %lu\n", stat.usati * vol->byte_per_cluster);
+    printf("byte liberi: %lu\n", stat.liberi * vol->byte_per_cluster);
+}
+
+
+/**
+ * stampa_disposizione stampa in poche righe come sono sistemati i dati:
+ * frammentazione dei file, istogramma della lunghezza media delle loro
+ * estensioni, spazio libero e localita' delle directory. Non scrive nulla.
+ */
+void stampa_disposizione(Immagine *file_system, const Volume *vol, const TabellaFat *fat, unsigned numero_thread)
+{
+    std::vector<Voce> voci = esplora_albero(file_system, vol, fat, numero_thread);
+    Disposizione d;
+    analizza_disposizione(vol, fat, voci, &d);
+
+
+    printf("file: %lu, frammentati: %lu (%.1f%%)\n", d.file, d.frammentati,
+           d.file ? 100.0 * d.frammentati / d.file : 0.0);
+    printf("estensioni: %lu, %.2f per file, massimo %lu%s%s\n", d.estensioni,
+           d.file ? (double)d.estensioni / d.file : 0.0, d.massimo_estensioni,
+           d.massimo_estensioni > 1 ? " in " : "", d.massimo_estensioni > 1 ? voci[d.piu_frammentato].percorso.c_str() : "");
+    printf("lunghezza media delle estensioni (cluster da %lu byte):\n", vol->byte_per_cluster);
+    for (int k = 0; k < CLASSI_ESTENSIONE; k++)
+    {
+        if (d.istogramma[k] == 0)
+            continue;
+        char classe[32];
+        if (k == 0)
+            snprintf(classe, sizeof(classe), "1");
+        else if (k == CLASSI_ESTENSIONE - 1)
+            snprintf(classe, sizeof(classe), ">= %lu", 1ul << k);
+        else
+            snprintf(classe, sizeof(classe), "%lu-%lu", 1ul << k, (2ul << k) - 1);
+        printf("  %12s: %lu file\n", classe, d.istogramma[k]);
+    }
+    printf("spazio libero: %lu cluster in %lu tratti, il piu' lungo %lu cluster (%lu byte) dal cluster %lu\n",
+           d.cluster_liberi, d.tratti_liberi, d.libero_massimo, d.libero_massimo * vol->byte_per_cluster,
+           (unsigned long)d.inizio_libero_massimo);
+    printf("localita' delle directory: %.1f%% dei file entro %lu KiB dalla loro directory\n",
+           d.file ? 100.0 * d.file_vicini / d.file : 100.0, DISTANZA_LOCALITA >> 10);
+}
 
 
-    for (int f = 0; f < numero_righe_dir; f++)
+/**
+ * controlla stampa i problemi trovati nell'immagine e un riassunto.
+ *
+ * @returns 1 se ci sono problemi o errori, 0 se l'immagine e' coerente
+ */
+int controlla(Immagine *file_system, const Volume *vol, const TabellaFat *fat, unsigned numero_thread)
+{
+    std::vector<Voce> voci = esplora_albero(file_system, vol, fat, numero_thread);
+    RisultatoControllo r;
+    if (controlla_immagine(file_system, vol, fat, voci, stdout, &r) != 0)
     {
-        unsigned long inizio_riga = inizio_root_dir + f * 32;
+        fprintf(stderr, "Memoria insufficiente per il controllo\n");
+        return 1;
+    }
 
 
-        unsigned char nome[9];
-        unsigned char estensione[4];
+    printf("voci controllate: %zu\n", voci.size());
+    printf("incroci: %lu\n", r.incroci);
+    printf("cicli: %lu\n", r.cicli);
+    printf("catene interrotte: %lu\n", r.catene_interrotte);
+    printf("dimensioni errate: %lu\n", r.dimensioni_errate);
+    printf("catene perse: %lu (%lu cluster)\n", r.catene_perse, r.cluster_persi);
+    printf("settori FAT diversi tra le copie: %lu\n", r.settori_fat_diversi);
 
 
-        unsigned char attribute[3];
-        unsigned char sola_letture = 0, nascosto = 0,
-                      sistema = 0, sottodirectory = 0, archivio = 0;
+    return problemi_trovati(&r) > 0 ? 1 : 0;
+}
 
 
-        unsigned long orario_creazione = 0;
-        unsigned long ora_creazione = 0;
-        unsigned long minuti_creazione = 0;
-        unsigned long secondi_creazione = 0;
-        unsigned long millisecondi_creazione = 0;
+/**
+ * partizione_richiesta legge FAT_PARTIZIONE, il numero dell'unica
+ * partizione da elaborare di un disco intero; 0 se non e' indicata.
+ */
+unsigned partizione_richiesta()
+{
+    const char *richiesta = getenv("FAT_PARTIZIONE");
+    return richiesta ? strtoul(richiesta, NULL, 10) : 0;
+}
 
 
-        unsigned long data_creazione = 0;
-        unsigned long giorno_creazione = 0;
-        unsigned long mese_creazione = 0;
-        unsigned long anno_creazione = 0;
+/**
+ * percorso_indice e' il percorso da cui si ricava l'indice dei percorsi di
+ * un volume: l'immagine stessa o, per una partizione, l'immagine con
+ * ".p<numero>", cosi' l'indice di una partizione non prende il posto di
+ * quello di un'altra.
+ */
+std::string percorso_indice(const char *percorso, unsigned numero_partizione)
+{
+    std::string indice = percorso;
+    if (numero_partizione != 0)
+        indice += ".p" + std::to_string(numero_partizione);
+    return indice;
+}
 
 
-        unsigned long dimensione = 0;
-        unsigned long primo_cluster = 0;
+/**
+ * rimuovi_indice cancella l'indice dei percorsi di un volume appena
+ * modificato, che non descrive piu' l'albero.
+ */
+void rimuovi_indice(const char *percorso, unsigned numero_partizione)
+{
+    std::string indice = percorso_indice(percorso, numero_partizione) + ESTENSIONE_INDICE;
+    if (unlink(indice.c_str()) != 0 && errno != ENOENT)
+        perror(indice.c_str());
+}
 
 
-        read_string(file_system, inizio_riga, 8, nome);
+/**
+ * scegli_volume trova il volume su cui lavorare per le modalita' che ne
+ * vogliono uno solo: l'immagine stessa, l'unica partizione FAT del disco o
+ * quella scelta con FAT_PARTIZIONE.
+ *
+ * @param volume Riceve la partizione scelta, con numero 0 se l'immagine e' il volume
+ * @returns 0 in caso di successo, -1 altrimenti
+ */
+int scegli_volume(const char *percorso, Partizione *volume)
+{
+    Immagine *img = apri_immagine(percorso, 0);
+    if (img == NULL)
+    {
+        fprintf(stderr, "Errore nell'apertura del file '%s': %s\n", percorso, strerror(errno));
+        return -1;
+    }
 
+    std::vector<Partizione> volumi;
+    int ret = volumi_fat(img, partizione_richiesta(), volumi);
+    chiudi_immagine(img);
+    if (ret != 0)
+    {
+        fprintf(stderr, "Nessuna partizione FAT da elaborare in '%s'\n", percorso);
+        return -1;
+    }
+    if (volumi.size() > 1)
+    {
+        fprintf(stderr, "'%s' contiene %zu partizioni FAT: sceglierne una con FAT_PARTIZIONE\n", percorso, volumi.size());
+        return -1;
+    }
+    *volume = volumi[0];
+    return 0;
+}
+
+
+/**
+ * leggi_file_host legge tutto un file dell'host, "-" per lo standard input.
+ *
+ * @returns 0 in caso di successo, -1 altrimenti
+ */
+int leggi_file_host(const char *percorso, std::vector<unsigned char> &contenuto)
+{
+    int fd = strcmp(percorso, "-") == 0 ? STDIN_FILENO : open(percorso, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    contenuto.clear();
+    unsigned char blocco[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, blocco, sizeof(blocco))) > 0 || (n < 0 && errno == EINTR))
+        if (n > 0)
+            contenuto.insert(contenuto.end(), blocco, blocco + n);
+    if (fd != STDIN_FILENO)
+        close(fd);
+    return n < 0 ? -1 : 0;
+}
 
-        if (nome[0] == 0 || nome[0] == 0xe5)
+
+/**
+ * scrivi_immagine esegue i comandi di un file (o dello standard input con
+ * "-"), uno per riga:
+ *   mkdir <percorso>                  crea la directory e quelle intermedie
+ *   create <percorso> [file host]     crea o svuota il file, con il contenuto indicato
+ *   append <percorso> <file host>     aggiunge il contenuto in coda al file
+ *   truncate <percorso> <dimensione>  accorcia o allunga il file
+ * Se una riga contiene un tab gli argomenti sono separati dai tab, cosi' i
+ * nomi possono contenere spazi. Le righe vuote e quelle con # si saltano.
+ * FAT e directory si scrivono una volta sola alla fine; se un comando
+ * fallisce non si scrive nulla.
+ *
+ * @returns 1 in caso di errore, 0 altrimenti
+ */
+int scrivi_immagine(const char *percorso, const char *comandi)
+{
+    FILE *ingresso = strcmp(comandi, "-") == 0 ? stdin : fopen(comandi, "r");
+    if (ingresso == NULL)
+    {
+        perror(comandi);
+        return 1;
+    }
+    Partizione volume;
+    ScritturaFat *w = scegli_volume(percorso, &volume) == 0 ? apri_scrittura(percorso, volume.inizio) : NULL;
+    if (w == NULL)
+    {
+        fprintf(stderr, "Impossibile aprire '%s' in scrittura\n", percorso);
+        if (ingresso != stdin)
+            fclose(ingresso);
+        return 1;
+    }
+
+
+    char *riga = NULL;
+    size_t capacita = 0;
+    unsigned long numero_riga = 0, eseguiti = 0;
+    int errore = 0;
+    std::vector<unsigned char> contenuto;
+    while (!errore && getline(&riga, &capacita, ingresso) >= 0)
+    {
+        numero_riga++;
+        riga[strcspn(riga, "\r\n")] = '\0';
+        const char *separatori = strchr(riga, '\t') ? "\t" : " ";
+        std::vector<char *> argomenti;
+        char *resto;
+        for (char *parola = strtok_r(riga, separatori, &resto); parola != NULL; parola = strtok_r(NULL, separatori, &resto))
+            argomenti.push_back(parola);
+        if (argomenti.empty() || argomenti[0][0] == '#')
             continue;
 
 
-        read_string(file_system, inizio_riga + 0x08, 3, estensione);
+        const char *comando = argomenti[0];
+        int esito = -1;
+        if (strcmp(comando, "mkdir") == 0 && argomenti.size() == 2)
+            esito = crea_directory(w, argomenti[1]);
+        else if (strcmp(comando, "create") == 0 && (argomenti.size() == 2 || argomenti.size() == 3))
+        {
+            esito = crea_file(w, argomenti[1]);
+            if (esito == 0 && argomenti.size() == 3)
+                esito = leggi_file_host(argomenti[2], contenuto) != 0 ? -1 : aggiungi_a_file(w, argomenti[1], contenuto.data(), contenuto.size());
+        }
+        else if (strcmp(comando, "append") == 0 && argomenti.size() == 3)
+            esito = leggi_file_host(argomenti[2], contenuto) != 0 ? -1 : aggiungi_a_file(w, argomenti[1], contenuto.data(), contenuto.size());
+        else if (strcmp(comando, "truncate") == 0 && argomenti.size() == 3)
+            esito = tronca_file(w, argomenti[1], strtoul(argomenti[2], NULL, 10));
+        else
+        {
+            fprintf(stderr, "riga %lu: comando non valido\n", numero_riga);
+            errore = 1;
+            continue;
+        }
 
+        if (esito != 0)
+        {
+            fprintf(stderr, "riga %lu: %s %s non riuscito\n", numero_riga, comando, argomenti[1]);
+            errore = 1;
+        }
+        else
+            eseguiti++;
+    }
+    free(riga);
+    if (ingresso != stdin)
+        fclose(ingresso);
 
-        read_buffer(file_system, inizio_riga + 0x0b, 1, attribute);
 
+    if (errore)
+    {
+        fprintf(stderr, "nessuna modifica scritta\n");
+        chiudi_scrittura(w);
+        return 1;
+    }
+    if (salva_scrittura(w) != 0)
+    {
+        perror(percorso);
+        errore = 1;
+    }
+    else
+        rimuovi_indice(percorso, volume.numero);
 
-        sola_letture = attribute[0] & 0x01;
-        nascosto = attribute[0] & 0x02;
-        sistema = attribute[0] & 0x04;
-        sottodirectory = attribute[0] & 0x10;
-        archivio = attribute[0] & 0x20;
 
+    printf("comandi eseguiti: %lu\n", eseguiti);
+    printf("cluster liberi: %lu\n", w->numero_liberi);
+    printf("scritture: %lu\n", w->scritture);
+    chiudi_scrittura(w);
+    return errore;
+}
 
-        printf("\tfile %s.%s\n", nome, estensione);
 
+/**
+ * copia_immagine copia il file percorso in uscita, che non deve esistere.
+ * copy_file_range lascia la copia al kernel, che non passa i dati dalla
+ * memoria del processo e, dove il file system lo permette, condivide i
+ * blocchi; se non e' disponibile si copia a blocchi con pread e pwrite.
+ * In *creata mette 1 se uscita e' stato creato qui, anche se la copia poi
+ * fallisce, cosi' il chiamante sa se puo' cancellarlo.
+ *
+ * @returns 0 in caso di successo, -1 altrimenti
+ */
+int copia_immagine(const char *percorso, const char *uscita, int *creata)
+{
+    *creata = 0;
+    int ingresso = open(percorso, O_RDONLY);
+    if (ingresso < 0)
+        return -1;
+    int destinazione = open(uscita, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (destinazione < 0)
+    {
+        close(ingresso);
+        return -1;
+    }
+    *creata = 1;
 
-        if (sola_letture)
-            printf("\t\tsola lettura\n");
-        if (nascosto)
-            printf("\t\tnascosto\n");
-        if (sistema)
-            printf("\t\tsistema\n");
-        if (sottodirectory)
-            printf("\t\tsottodirectory\n");
-        if (archivio)
-            printf("\t\tarchivio\n");
+    ssize_t n;
+    while ((n = copy_file_range(ingresso, NULL, destinazione, NULL, 1ul << 30, 0)) > 0 || (n < 0 && errno == EINTR))
+        ;
+    if (n < 0)
+    {
+        // file system diversi o kernel senza copy_file_range: si riparte da dove si e' arrivati
+        std::vector<unsigned char> blocco(1 << 20);
+        off_t posizione = lseek(ingresso, 0, SEEK_CUR);
+        while (posizione >= 0 && (n = pread(ingresso, blocco.data(), blocco.size(), posizione)) != 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 || pwrite_tutto(destinazione, blocco.data(), n, posizione) != 0)
+            {
+                n = -1;
+                break;
+            }
+            posizione += n;
+        }
+    }
 
+    close(ingresso);
+    if (close(destinazione) != 0)
+        n = -1;
+    return n == 0 ? 0 : -1;
+}
 
-        // FAT 16  HEPOX
-        // millisecondo presenti solo in creazione e non in modifica secondi dispari presenti solo creazione e non in modifche
-        // file con modifica in secondi dispari --> problema pk non e presente un bit per i milli secondi
-        // ambito unix si utilizza il 1970 pk prima non erano presenti i file prima di quella data
+
+// stampa_frammentazione stampa una riga del confronto prima/dopo
+void stampa_frammentazione(const char *quando, const Frammentazione *f)
+{
+    printf("%s: %lu catene, %lu frammentate, %lu estensioni (%.2f per catena, massimo %lu)\n", quando,
+           f->catene, f->frammentate, f->estensioni,
+           f->catene ? (double)f->estensioni / f->catene : 0.0, f->massimo_estensioni);
+}
 
 
-        orario_creazione = read_number(file_system, inizio_riga + 0x0e, 2);
-        ora_creazione = orario_creazione >> 11;
-        minuti_creazione = (orario_creazione >> 5) & 0x3f;
-        secondi_creazione = (orario_creazione & 0x1f) * 2;
-        millisecondi_creazione = read_number(file_system, inizio_riga + 0x0d, 1) * 10;
+/**
+ * deframmenta_immagine scrive in uscita una copia dell'immagine in cui ogni
+ * file e ogni directory occupa cluster consecutivi, nell'ordine dei
+ * percorsi. Se uscita e' l'immagine stessa la riscrive sul posto: un
+ * errore o un'interruzione a meta' la lasciano rovinata, per questo va
+ * chiesto esplicitamente. Prima controlla che le catene siano coerenti:
+ * con incroci, cicli o catene interrotte non si copia e non si sposta nulla.
+ *
+ * @returns 1 in caso di errore, 0 altrimenti
+ */
+int deframmenta_immagine(const char *percorso, const char *uscita, unsigned numero_thread)
+{
+    Partizione volume;
+    if (scegli_volume(percorso, &volume) != 0)
+        return 1;
 
+    Immagine *img = apri_immagine(percorso, 0);
+    Volume vol;
+    TabellaFat *fat = NULL;
+    if (img != NULL && leggi_volume(img, &vol, volume.inizio) == 0)
+        fat = carica_tabella_fat(img, &vol);
+    if (fat == NULL)
+    {
+        fprintf(stderr, "Impossibile leggere '%s'\n", percorso);
+        if (img != NULL)
+            chiudi_immagine(img);
+        return 1;
+    }
 
-        if (millisecondi_creazione >= 1000)
+    std::vector<Voce> voci = esplora_albero(img, &vol, fat, numero_thread);
+    RisultatoControllo controllo;
+    int incoerente = controlla_immagine(img, &vol, fat, voci, stderr, &controllo) != 0 ||
+                     controllo.incroci + controllo.cicli + controllo.catene_interrotte > 0;
+    distruggi_tabella_fat(fat);
+    chiudi_immagine(img);
+    if (incoerente)
+    {
+        fprintf(stderr, "Catene non coerenti, nessuna modifica scritta\n");
+        return 1;
+    }
+
+
+    struct stat originale, esistente;
+    int sul_posto = stat(uscita, &esistente) == 0 && stat(percorso, &originale) == 0 &&
+                    originale.st_dev == esistente.st_dev && originale.st_ino == esistente.st_ino;
+    int creata = 0;
+    if (!sul_posto && copia_immagine(percorso, uscita, &creata) != 0)
+    {
+        // si cancella solo la copia a meta': un file che c'era gia' non e' nostro
+        fprintf(stderr, "Impossibile copiare '%s' in '%s': %s\n", percorso, uscita, strerror(errno));
+        if (creata)
+            unlink(uscita);
+        return 1;
+    }
+
+    ScritturaFat *w = apri_scrittura(uscita, volume.inizio);
+    if (w == NULL)
+    {
+        fprintf(stderr, "Impossibile aprire '%s' in scrittura\n", uscita);
+        if (!sul_posto)
+            unlink(uscita);
+        return 1;
+    }
+
+    std::vector<IntervalloCluster> intervalli;
+    std::vector<uint32_t> destinazione;
+    Frammentazione prima, dopo;
+    RisultatoDeframmentazione r;
+    memset(&r, 0, sizeof(r));
+    costruisci_mappa_inversa(&w->vol, w->fat, voci, intervalli);
+    misura_frammentazione(intervalli, voci.size(), &prima);
+    stampa_frammentazione("prima", &prima);
+
+    int errore = 0;
+    if (pianifica_deframmentazione(w->fat, intervalli, destinazione) != 0)
+    {
+        fprintf(stderr, "Memoria insufficiente o catene incrociate\n");
+        errore = 1;
+    }
+    else
+    {
+        // il boot sector per ultimo: fino ad allora indica la root vecchia
+        errore = sposta_cluster(w, destinazione, &r) != 0;
+        if (!errore)
         {
-            millisecondi_creazione -= 1000;
-            secondi_creazione++;
+            aggiorna_metadati(w, destinazione, voci);
+            errore = salva_scrittura(w) != 0 || scrivi_cluster_root(w) != 0;
         }
+        if (errore)
+            perror(uscita);
+
+        // da qui l'immagine e' cambiata comunque: l'indice non la descrive piu'
+        rimuovi_indice(uscita, volume.numero);
+    }
+
+    if (!errore)
+    {
+        costruisci_mappa_inversa(&w->vol, w->fat, voci, intervalli);
+        misura_frammentazione(intervalli, voci.size(), &dopo);
+        stampa_frammentazione("dopo", &dopo);
+    }
+    printf("cluster copiati: %lu (%lu byte)\n", r.cluster_copiati, r.cluster_copiati * w->vol.byte_per_cluster);
+    printf("letture: %lu\n", r.letture);
+    printf("scritture: %lu\n", w->scritture);
+    chiudi_scrittura(w);
+
+    if (errore && !sul_posto)
+    {
+        fprintf(stderr, "Copia '%s' rimossa, l'originale non e' stato modificato\n", uscita);
+        unlink(uscita);
+    }
+    else if (errore)
+        fprintf(stderr, "'%s' potrebbe essere rovinata: i cluster spostati non sono tutti registrati\n", uscita);
+    return errore;
+}
 
 
-        printf("\t\tOra di creazione: %lu:%lu:%lu:%lu\n", ora_creazione, minuti_creazione, secondi_creazione, millisecondi_creazione);
+// Le modalita' riconosciute e quanti argomenti vogliono dopo l'immagine
+static const struct
+{
+    const char *nome;
+    int argomenti;
+} modalita[] = {
+    {"list", 0},
+    {"extract", 1},
+    {"dump", 1},
+    {"owner", 1},
+    {"export", 0},
+    {"hash", 0},
+    {"search", 1},
+    {"undelete", 0},
+    {"stats", 0},
+    {"layout", 0},
+    {"check", 0},
+    {"batch", 2},
+    {"write", 1},
+    {"defrag", 1},
+    {"partitions", 0},
+};
+
+
+void uso(const char *programma)
+{
+    fprintf(stderr, "uso: %s [list] [immagine]\n", programma);
+    fprintf(stderr, "     %s extract <immagine> <percorso> [destinazione]\n", programma);
+    fprintf(stderr, "     %s dump <immagine> <cartella>\n", programma);
+    fprintf(stderr, "     %s owner <immagine> <offset>...\n", programma);
+    fprintf(stderr, "     %s export [immagine] [jsonl|csv]\n", programma);
+    fprintf(stderr, "     %s hash [immagine]\n", programma);
+    fprintf(stderr, "     %s search <immagine> <modello, \\xNN per un byte>\n", programma);
+    fprintf(stderr, "     %s undelete [immagine] [cartella]\n", programma);
+    fprintf(stderr, "     %s stats [immagine]\n", programma);
+    fprintf(stderr, "     %s layout [immagine]\n", programma);
+    fprintf(stderr, "     %s check [immagine]\n", programma);
+    fprintf(stderr, "     %s write <immagine> <comandi|->\n", programma);
+    fprintf(stderr, "     %s defrag <immagine> <copia da creare, o l'immagine stessa per lavorare sul posto>\n", programma);
+    fprintf(stderr, "     %s partitions [immagine]\n", programma);
+    fprintf(stderr, "     %s batch <modalita'> <cartella rapporti> <immagini o directory>...\n", programma);
+    fprintf(stderr, "variabili: FAT_MMAP=0 legge con pread, FAT_CACHE=<settori> capacita' della cache (0 la disattiva)\n");
+    fprintf(stderr, "           FAT_CODA=<operazioni> in volo per dump, FAT_IO_URING=0 usa i thread\n");
+    fprintf(stderr, "           FAT_INDICE=0 non usa l'indice dei percorsi <immagine>%s\n", ESTENSIONE_INDICE);
+    fprintf(stderr, "           FAT_LAVORI=<processi> immagini elaborate insieme da batch\n");
+    fprintf(stderr, "           FAT_PARTIZIONE=<numero> elabora solo quella partizione di un disco intero\n");
+}
 
 
-        data_creazione = read_number(file_system, inizio_riga + 0x10, 2);
-        giorno_creazione = data_creazione & 0x1f;
-        mese_creazione = (data_creazione >> 5) & 0x0f;
-        anno_creazione = ((data_creazione >> 9) & 0x7f) + 1980;
+/**
+ * elabora_volume esegue una modalita' sul volume FAT che inizia al byte
+ * inizio dell'immagine gia' aperta. argv segue la riga di comando: gli
+ * argomenti della modalita' partono da argv[3].
+ *
+ * @param percorso_indice Il percorso da cui si ricava quello dell'indice dei percorsi
+ * @returns Il codice di uscita del programma
+ */
+int elabora_volume(const char *modo, Immagine *file_system, unsigned long inizio, const char *percorso_indice,
+                   int argc, char *argv[], unsigned numero_thread)
+{
+    const char *cache_richiesta = getenv("FAT_CACHE");
 
 
-        printf("\t\tData di creazione: %lu:%lu:%lu\n", giorno_creazione, mese_creazione, anno_creazione);
+    Volume vol;
+    if (leggi_volume(file_system, &vol, inizio) != 0)
+    {
+        fprintf(stderr, "Boot sector non valido\n");
+        return 1;
+    }
 
 
-        // cluster 0 e 1 non esistono per socorerli parto dal 2
-        dimensione = read_number(file_system, inizio_riga + 0x1c, 4);
-        primo_cluster = read_number(file_system, inizio_riga + 0x1a, 2);
+    // senza mappatura i settori del boot sector, della FAT e delle directory
+    // riletti piu' volte arrivano dalla cache
+    unsigned long blocchi_cache = BLOCCHI_CACHE_PREDEFINITI;
+    if (cache_richiesta != NULL)
+    {
+        char *fine;
+        errno = 0;
+        blocchi_cache = strtoul(cache_richiesta, &fine, 10);
+        if (errno != 0 || fine == cache_richiesta || *fine != '\0' || strchr(cache_richiesta, '-') != NULL ||
+            blocchi_cache > MASSIMO_BLOCCHI_CACHE)
+        {
+            fprintf(stderr, "FAT_CACHE deve essere un numero di settori da 0 a %lu\n", MASSIMO_BLOCCHI_CACHE);
+            return 1;
+        }
+    }
+    if (blocchi_cache > 0 && attiva_cache(file_system, vol.byte_per_settore, blocchi_cache) != 0)
+        fprintf(stderr, "Cache dei settori non disponibile\n");
+
+
+    // la FAT viene letta una volta sola e poi consultata in memoria
+    TabellaFat *fat = carica_tabella_fat(file_system, &vol);
+    unsigned char *buffer = (unsigned char *)malloc(DIMENSIONE_BUFFER_ESTRAZIONE);
+    if (fat == NULL || buffer == NULL)
+    {
+        fprintf(stderr, "Errore nella lettura della FAT\n");
+        free(buffer);
+        distruggi_tabella_fat(fat);
+        return 1;
+    }
 
 
-        printf("\t\tDimensione: %lu byte\n", dimensione);
-        printf("\t\tPrimo cluster: %lu\n", primo_cluster);
+    int ret = 0;
+    if (strcmp(modo, "extract") == 0)
+        ret = estrai_file(file_system, &vol, fat, percorso_indice, argv[3], argc > 4 ? argv[4] : NULL, numero_thread, buffer);
+    else if (strcmp(modo, "dump") == 0)
+        ret = estrai_tutto(file_system, &vol, fat, argv[3], numero_thread);
+    else if (strcmp(modo, "owner") == 0)
+        ret = proprietari(file_system, &vol, fat, argv + 3, argc - 3, numero_thread);
+    else if (strcmp(modo, "export") == 0)
+        ret = esporta(file_system, &vol, fat, argc > 3 ? argv[3] : "jsonl", numero_thread);
+    else if (strcmp(modo, "hash") == 0)
+        ret = impronte(file_system, &vol, fat, numero_thread);
+    else if (strcmp(modo, "search") == 0)
+        ret = cerca_contenuto(file_system, &vol, fat, argv[3], numero_thread);
+    else if (strcmp(modo, "undelete") == 0)
+        ret = recupera(file_system, &vol, fat, argc > 3 ? argv[3] : NULL, numero_thread);
+    else if (strcmp(modo, "stats") == 0)
+        stampa_statistiche(&vol, fat);
+    else if (strcmp(modo, "layout") == 0)
+        stampa_disposizione(file_system, &vol, fat, numero_thread);
+    else if (strcmp(modo, "check") == 0)
+        ret = controlla(file_system, &vol, fat, numero_thread);
+    else
+        elenca(file_system, &vol, fat, numero_thread, buffer);
+
+
+    if (cache_richiesta != NULL && file_system->cache != NULL)
+        fprintf(stderr, "cache dei settori: %lu successi, %lu mancati\n",
+                file_system->cache->successi, file_system->cache->mancati);
+
+
+    free(buffer);
+    distruggi_tabella_fat(fat);
+    return ret;
+}
 
 
-        if (archivio)
+/**
+ * elenca_partizioni stampa la tabella delle partizioni: numero, tipo,
+ * inizio e dimensione in byte e, per quelle FAT, il tipo di FAT.
+ */
+void elenca_partizioni(Immagine *file_system)
+{
+    std::vector<Partizione> partizioni;
+    if (sembra_boot_sector(file_system, 0) || cerca_partizioni(file_system, partizioni) == 0)
+    {
+        printf("nessuna tabella delle partizioni: l'immagine e' un volume\n");
+        return;
+    }
+
+    for (const Partizione &p : partizioni)
+    {
+        Volume vol;
+        char formato[16] = "-";
+        if (p.fat && leggi_volume(file_system, &vol, p.inizio) == 0)
+            snprintf(formato, sizeof(formato), "FAT%d", vol.tipo_fat);
+        printf("%3u 0x%02x %12lu %12lu %s\n", p.numero, p.tipo, p.inizio, p.dimensione, formato);
+    }
+}
+
+
+/**
+ * elabora_partizioni esegue la modalita' su tutte le partizioni FAT di un
+ * disco insieme, ognuna in un processo figlio che eredita l'immagine gia'
+ * aperta, e quindi la stessa mappatura: nulla va ritagliato a mano e un
+ * volume rovinato non ferma gli altri. Le uscite dei figli si raccolgono in
+ * file temporanei, in TMPDIR o in /tmp, e si stampano alla fine,
+ * partizione per partizione.
+ * dump e undelete scrivono in <cartella>/partizione<numero>.
+ *
+ * @returns 1 se qualche partizione non e' stata elaborata senza problemi, 0 altrimenti
+ */
+int elabora_partizioni(const char *modo, Immagine *file_system, const char *percorso,
+                       const std::vector<Partizione> &volumi, int argc, char *argv[], unsigned numero_thread)
+{
+    int per_cartella = (strcmp(modo, "dump") == 0 || strcmp(modo, "undelete") == 0) && argc > 3;
+    if (per_cartella && mkdir(argv[3], 0755) != 0 && errno != EEXIST)
+    {
+        perror(argv[3]);
+        return 1;
+    }
+
+
+    const char *cartella_temporanea = getenv("TMPDIR");
+    if (cartella_temporanea == NULL || cartella_temporanea[0] == '\0')
+        cartella_temporanea = "/tmp";
+
+    std::vector<RisultatoLotto> risultati(volumi.size());
+    for (size_t i = 0; i < volumi.size(); i++)
+    {
+        RisultatoLotto &r = risultati[i];
+        std::string temporaneo = std::string(cartella_temporanea) + "/fat_partizioneXXXXXX";
+        int fd = mkstemp(&temporaneo[0]);
+        if (fd < 0)
         {
-            unsigned char contenuto[1 + dimensione];
-            unsigned long posizione = inizio_area_dati + (primo_cluster - 2) * byte_per_cluster;
-            read_string(file_system, posizione, dimensione, contenuto);
-            printf("\t\tContenuto: %s\n", contenuto);
+            perror(temporaneo.c_str());
+            for (size_t j = 0; j < i; j++)
+                unlink(risultati[j].rapporto.c_str());
+            return 1;
         }
+        close(fd);
+
+        r.immagine = percorso;
+        r.rapporto = temporaneo;
+        r.dimensione = volumi[i].dimensione;
+        r.codice = -1;
+        r.segnale = 0;
+        r.secondi = 0;
     }
-    fclose(file_system);
 
+    unsigned thread_per_partizione = numero_thread > volumi.size() ? numero_thread / volumi.size() : 1;
+    esegui_lotto(risultati, volumi.size(),
+                 [&](size_t i) -> int
+                 {
+                     const Partizione &p = volumi[i];
+                     std::string indice_partizione = percorso_indice(percorso, p.numero);
+                     std::vector<char *> argomenti(argv, argv + argc);
+                     argomenti.push_back(NULL);
+
+                     std::string cartella;
+                     if (per_cartella)
+                     {
+                         cartella = std::string(argv[3]) + "/partizione" + std::to_string(p.numero);
+                         argomenti[3] = &cartella[0];
+                     }
+                     return elabora_volume(modo, file_system, p.inizio, indice_partizione.c_str(), argc,
+                                           argomenti.data(), thread_per_partizione);
+                 });
+
+
+    int ret = 0;
+    for (size_t i = 0; i < volumi.size(); i++)
+    {
+        const Partizione &p = volumi[i];
+        const RisultatoLotto &r = risultati[i];
+        printf("== partizione %u: tipo 0x%02x, inizio %lu, %lu byte ==\n", p.numero, p.tipo, p.inizio, p.dimensione);
+        fflush(stdout);
+
+        int fd = open(r.rapporto.c_str(), O_RDONLY);
+        unsigned char blocco[1 << 16];
+        ssize_t n;
+        while (fd >= 0 && (n = read(fd, blocco, sizeof(blocco))) > 0)
+            if (write(STDOUT_FILENO, blocco, n) != n)
+                break;
+        if (fd >= 0)
+            close(fd);
+        unlink(r.rapporto.c_str());
+
+        if (r.segnale != 0)
+            fprintf(stderr, "partizione %u: interrotta dal segnale %d\n", p.numero, r.segnale);
+        if (r.codice != 0)
+            ret = 1;
+    }
+    return ret;
+}
 
-    return 0;
+
+/**
+ * elabora_immagine apre un'immagine ed esegue una modalita' sul volume che
+ * contiene o, se e' un disco intero, su ognuna delle sue partizioni FAT.
+ * FAT_PARTIZIONE ne sceglie una sola. argv segue la riga di comando: gli
+ * argomenti della modalita' partono da argv[3].
+ *
+ * @returns Il codice di uscita del programma
+ */
+int elabora_immagine(const char *modo, const char *percorso, int argc, char *argv[], unsigned numero_thread)
+{
+    const char *mmap_richiesta = getenv("FAT_MMAP");
+    Immagine *file_system = apri_immagine(percorso, mmap_richiesta == NULL || strcmp(mmap_richiesta, "0") != 0);
+
+
+    if (file_system == NULL)
+    {
+        fprintf(stderr, "Errore nell'apertura del file '%s': %s\n", percorso, strerror(errno));
+        return 1;
+    }
+    if (strcmp(modo, "partitions") == 0)
+    {
+        elenca_partizioni(file_system);
+        chiudi_immagine(file_system);
+        return 0;
+    }
+
+
+    std::vector<Partizione> volumi;
+    int ret = 1;
+    if (volumi_fat(file_system, partizione_richiesta(), volumi) != 0)
+        fprintf(stderr, "Nessuna partizione FAT da elaborare in '%s'\n", percorso);
+    else if (volumi.size() == 1)
+    {
+        std::string indice = percorso_indice(percorso, volumi[0].numero);
+        ret = elabora_volume(modo, file_system, volumi[0].inizio, indice.c_str(), argc, argv, numero_thread);
+    }
+    else if (strcmp(modo, "extract") == 0)
+        fprintf(stderr, "'%s' contiene %zu partizioni FAT: sceglierne una con FAT_PARTIZIONE\n", percorso, volumi.size());
+    else
+        ret = elabora_partizioni(modo, file_system, percorso, volumi, argc, argv, numero_thread);
+
+
+    chiudi_immagine(file_system);
+    return ret;
+}
+
+
+// Le modalita' che si possono chiedere per un lotto: quelle senza argomenti
+static const char *modalita_lotto[] = {"list", "export", "hash", "undelete", "stats", "layout", "check", "partitions"};
+
+
+/**
+ * lotto esegue una modalita' su molte immagini, ognuna in un processo a
+ * parte, e riassume gli esiti. Gli argomenti sono
+ * batch <modalita'> <cartella dei rapporti> <immagini o directory>...
+ * FAT_LAVORI sceglie quante immagini elaborare insieme; i thread della
+ * macchina si dividono tra loro.
+ *
+ * @returns 1 se qualche immagine non e' stata elaborata senza problemi, 0 altrimenti
+ */
+int lotto(int argc, char *argv[], unsigned numero_thread)
+{
+    const char *operazione = argv[2];
+    const char *cartella = argv[3];
+
+    int valida = 0;
+    for (const char *m : modalita_lotto)
+        valida |= strcmp(operazione, m) == 0;
+    if (!valida)
+    {
+        fprintf(stderr, "Modalita' non disponibile in un lotto: %s\n", operazione);
+        return 1;
+    }
+    if (mkdir(cartella, 0755) != 0 && errno != EEXIST)
+    {
+        perror(cartella);
+        return 1;
+    }
+
+
+    std::vector<std::string> immagini;
+    int ret = raccogli_immagini(argv + 4, argc - 4, immagini) != 0;
+    std::vector<RisultatoLotto> risultati;
+    nomi_rapporti(immagini, cartella, risultati);
+
+    const char *lavori = getenv("FAT_LAVORI");
+    unsigned numero_processi = lavori ? strtoul(lavori, NULL, 10) : numero_thread;
+    if (numero_processi == 0)
+        numero_processi = 1;
+    unsigned thread_per_immagine = numero_thread > numero_processi ? numero_thread / numero_processi : 1;
+
+
+    double inizio = adesso();
+    esegui_lotto(risultati, numero_processi,
+                 [&](size_t i) -> int
+                 {
+                     const char *immagine = risultati[i].immagine.c_str();
+                     char *argomenti[] = {argv[0], (char *)operazione, (char *)immagine, NULL};
+                     return elabora_immagine(operazione, immagine, 3, argomenti, thread_per_immagine);
+                 });
+    double durata = adesso() - inizio;
+
+
+    // il riassunto va sullo standard output e nella cartella dei rapporti
+    std::string percorso_riassunto = std::string(cartella) + "/riassunto.txt";
+    FILE *riassunto = fopen(percorso_riassunto.c_str(), "w");
+    unsigned long riuscite = 0, con_problemi = 0, interrotte = 0, byte = 0;
+    for (const RisultatoLotto &r : risultati)
+    {
+        char esito[32];
+        if (r.segnale != 0)
+        {
+            snprintf(esito, sizeof(esito), "segnale %d", r.segnale);
+            interrotte++;
+        }
+        else if (r.codice == 0)
+        {
+            snprintf(esito, sizeof(esito), "ok");
+            riuscite++;
+        }
+        else
+        {
+            snprintf(esito, sizeof(esito), "uscita %d", r.codice);
+            con_problemi++;
+        }
+        byte += r.dimensione;
+
+        for (FILE *f : {stdout, riassunto})
+            if (f != NULL)
+                fprintf(f, "%-12s %8.2f s %12lu %s -> %s\n", esito, r.secondi, r.dimensione,
+                        r.immagine.c_str(), r.rapporto.c_str());
+    }
+    for (FILE *f : {stdout, riassunto})
+        if (f != NULL)
+        {
+            fprintf(f, "immagini: %zu (%lu ok, %lu con problemi, %lu interrotte)\n",
+                    risultati.size(), riuscite, con_problemi, interrotte);
+            fprintf(f, "processi: %u, thread per immagine: %u\n", numero_processi, thread_per_immagine);
+            fprintf(f, "tempo: %.2f s, %.1f immagini/s, %.1f MB/s\n", durata,
+                    durata > 0 ? risultati.size() / durata : 0, durata > 0 ? byte / durata / 1e6 : 0);
+        }
+    if (riassunto != NULL)
+        fclose(riassunto);
+
+
+    return ret || riuscite < risultati.size() ? 1 : 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *percorso = "fat";
+    const char *modo = "list";
+    int primo_argomento = 1;
+    unsigned numero_thread = std::thread::hardware_concurrency();
+
+
+    for (size_t m = 0; argc > 1 && m < sizeof(modalita) / sizeof(modalita[0]); m++)
+    {
+        if (strcmp(argv[1], modalita[m].nome) != 0)
+            continue;
+        modo = argv[1];
+        primo_argomento = 2;
+        if (modalita[m].argomenti > 0 && argc < 3 + modalita[m].argomenti)
+        {
+            uso(argv[0]);
+            return 1;
+        }
+    }
+    if (argc > primo_argomento)
+        percorso = argv[primo_argomento];
+
+
+    if (strcmp(modo, "batch") == 0)
+        return lotto(argc, argv, numero_thread);
+    if (strcmp(modo, "write") == 0)
+        return scrivi_immagine(percorso, argv[3]);
+    if (strcmp(modo, "defrag") == 0)
+        return deframmenta_immagine(percorso, argv[3], numero_thread);
+    return elabora_immagine(modo, percorso, argc, argv, numero_thread);
 }
@@ -0,0 +1,53 @@
+#ifndef MAPPA_BIT_H
+#define MAPPA_BIT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+// MappaBit e' un insieme di cluster con un bit per cluster
+typedef struct
+{
+    uint64_t *parole;
+    unsigned long numero_bit;
+} MappaBit;
+
+
+/**
+ * crea_mappa_bit alloca una mappa di numero_bit bit, tutti a 0.
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+inline int crea_mappa_bit(MappaBit *mappa, unsigned long numero_bit)
+{
+    mappa->numero_bit = numero_bit;
+    mappa->parole = (uint64_t *)calloc((numero_bit + 63) / 64 + 1, sizeof(uint64_t));
+    return mappa->parole == NULL ? -1 : 0;
+}
+
+
+inline void distruggi_mappa_bit(MappaBit *mappa)
+{
+    free(mappa->parole);
+    mappa->parole = NULL;
+}
+
+
+inline int leggi_bit(const MappaBit *mappa, unsigned long i)
+{
+    return (mappa->parole[i / 64] >> (i % 64)) & 1;
+}
+
+
+inline void accendi_bit(MappaBit *mappa, unsigned long i)
+{
+    mappa->parole[i / 64] |= 1ull << (i % 64);
+}
+
+
+inline void spegni_bit(MappaBit *mappa, unsigned long i)
+{
+    mappa->parole[i / 64] &= ~(1ull << (i % 64));
+}
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef MAPPA_INVERSA_H
+#define MAPPA_INVERSA_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "fat.h"
+#include "esplora.h"
+
+
+// La voce "proprietaria" della catena della root directory su FAT32
+#define VOCE_ROOT 0xffffffffu
+
+
+// IntervalloCluster dice che i cluster da inizio a inizio + lunghezza
+// appartengono a una voce, a partire dal suo cluster numero primo_nel_file
+typedef struct
+{
+    uint32_t inizio;
+    uint32_t lunghezza;
+    uint32_t voce;
+    uint32_t primo_nel_file;
+} IntervalloCluster;
+
+
+// Dove cade un offset dell'immagine
+enum AreaImmagine
+{
+    AREA_RISERVATA,
+    AREA_FAT,
+    AREA_ROOT,
+    AREA_DATI,
+    AREA_FUORI
+};
+
+
+/**
+ * costruisci_mappa_inversa percorre una volta le catene di tutte le voci e
+ * registra un intervallo per ogni estensione, poi li ordina per cluster.
+ * Lo spazio e' proporzionale al numero di estensioni, non di cluster.
+ *
+ * @param voci Le voci dell'albero; gli intervalli si riferiscono ai loro indici
+ * @param intervalli Riceve gli intervalli ordinati per inizio
+ */
+inline void costruisci_mappa_inversa(const Volume *vol, const TabellaFat *fat, const std::vector<Voce> &voci,
+                                     std::vector<IntervalloCluster> &intervalli)
+{
+    intervalli.clear();
+
+    auto aggiungi = [&](uint32_t primo, uint32_t voce)
+    {
+        uint32_t nel_file = 0;
+        IteratoreCatena catena = inizia_catena(fat, primo);
+        Estensione estensione;
+        while (prossima_estensione(&catena, &estensione))
+        {
+            intervalli.push_back(IntervalloCluster{estensione.inizio, estensione.lunghezza, voce, nel_file});
+            nel_file += estensione.lunghezza;
+        }
+    };
+
+    if (vol->cluster_root != 0)
+        aggiungi(vol->cluster_root, VOCE_ROOT);
+    for (size_t i = 0; i < voci.size(); i++)
+        if (voci[i].primo_cluster != 0)
+            aggiungi(voci[i].primo_cluster, i);
+
+    std::sort(intervalli.begin(), intervalli.end(),
+              [](const IntervalloCluster &a, const IntervalloCluster &b) { return a.inizio < b.inizio; });
+}
+
+
+/**
+ * cerca_proprietario trova con una ricerca binaria l'intervallo che contiene
+ * il cluster. Se due catene si incrociano viene restituita una sola delle due.
+ *
+ * @returns L'intervallo, o NULL se il cluster non appartiene a nessuna voce
+ */
+inline const IntervalloCluster *cerca_proprietario(const std::vector<IntervalloCluster> &intervalli, uint32_t cluster)
+{
+    auto dopo = std::upper_bound(intervalli.begin(), intervalli.end(), cluster,
+                                 [](uint32_t c, const IntervalloCluster &i) { return c < i.inizio; });
+    if (dopo == intervalli.begin())
+        return NULL;
+
+    const IntervalloCluster &candidato = *(dopo - 1);
+    if (cluster - candidato.inizio >= candidato.lunghezza)
+        return NULL;
+    return &candidato;
+}
+
+
+/**
+ * area_di_offset dice in quale area del volume cade un offset e, se cade
+ * nell'area dati, in quale cluster.
+ */
+inline AreaImmagine area_di_offset(const Volume *vol, unsigned long offset, uint32_t *cluster)
+{
+    *cluster = 0;
+    if (offset < vol->inizio_partizione || offset >= vol->inizio_partizione + vol->dimensione_disco)
+        return AREA_FUORI;
+    if (offset < vol->inizio_area_fat)
+        return AREA_RISERVATA;
+    if (offset < vol->inizio_area_fat + vol->numero_fat * vol->bytes_per_fat)
+        return AREA_FAT;
+    if (offset < vol->inizio_area_dati)
+        return AREA_ROOT;
+
+    unsigned long indice = (offset - vol->inizio_area_dati) / vol->byte_per_cluster;
+    if (indice >= vol->numero_cluster)
+        return AREA_FUORI;
+    *cluster = indice + 2;
+    return AREA_DATI;
+}
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef NOMI_LUNGHI_H
+#define NOMI_LUNGHI_H
+
+#include <stdint.h>
+#include <string.h>
+
+
+// Un nome lungo VFAT e' diviso in al massimo 20 frammenti da 13 caratteri
+#define FRAMMENTI_NOME_LUNGO 20
+#define CARATTERI_PER_FRAMMENTO 13
+
+
+// NomeLungo raccoglie i frammenti di un nome lungo mentre si scorre una
+// directory. Ogni thread ne usa uno solo per tutte le directory che
+// legge, cosi' la decodifica di un nome non alloca memoria.
+typedef struct
+{
+    // I caratteri UTF-16 raccolti finora, nella posizione del loro frammento
+    uint16_t unita[FRAMMENTI_NOME_LUNGO * CARATTERI_PER_FRAMMENTO + 1];
+
+    // Il nome convertito in UTF-8, nel caso peggiore 3 byte per unita'
+    char utf8[FRAMMENTI_NOME_LUNGO * CARATTERI_PER_FRAMMENTO * 3 + 1];
+
+    // Il numero di frammenti del nome, 0 se non si sta raccogliendo nulla
+    int frammenti;
+
+    // Il prossimo numero di sequenza atteso (i frammenti arrivano a ritroso)
+    int atteso;
+
+    // Il checksum del nome corto riportato in ogni frammento
+    unsigned char checksum;
+} NomeLungo;
+
+
+/**
+ * checksum_nome_corto calcola il checksum degli 11 byte del nome 8.3, che
+ * ogni frammento del nome lungo deve riportare.
+ */
+inline unsigned char checksum_nome_corto(const unsigned char *riga)
+{
+    unsigned char somma = 0;
+    for (int i = 0; i < 11; i++)
+        somma = (unsigned char)(((somma & 1) << 7) + (somma >> 1) + riga[i]);
+    return somma;
+}
+
+
+inline void azzera_nome_lungo(NomeLungo *nome)
+{
+    nome->frammenti = 0;
+    nome->atteso = 0;
+}
+
+
+/**
+ * aggiungi_frammento accoda una riga con attributo 0x0f al nome in
+ * costruzione. Un frammento fuori sequenza scarta quanto raccolto.
+ */
+inline void aggiungi_frammento(NomeLungo *nome, const unsigned char *riga)
+{
+    int sequenza = riga[0] & 0x1f;
+
+    // il primo frammento trovato e' l'ultimo del nome e ha il bit 0x40
+    if (riga[0] & 0x40)
+    {
+        nome->frammenti = sequenza;
+        nome->atteso = sequenza;
+        nome->checksum = riga[0x0d];
+    }
+
+    if (sequenza == 0 || sequenza > FRAMMENTI_NOME_LUNGO ||
+        sequenza != nome->atteso || riga[0x0d] != nome->checksum)
+    {
+        azzera_nome_lungo(nome);
+        return;
+    }
+
+    // i 13 caratteri sono sparsi in tre gruppi dentro la riga
+    static const unsigned char offset[CARATTERI_PER_FRAMMENTO] = {
+        1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+    uint16_t *dest = nome->unita + (sequenza - 1) * CARATTERI_PER_FRAMMENTO;
+    for (int i = 0; i < CARATTERI_PER_FRAMMENTO; i++)
+        dest[i] = riga[offset[i]] | (riga[offset[i] + 1] << 8);
+
+    nome->atteso--;
+}
+
+
+/**
+ * utf16_a_utf8 converte le unita' UTF-16 in UTF-8 fino al terminatore 0x0000
+ * o al riempimento 0xffff. I tratti ASCII si copiano quattro unita' alla
+ * volta con un solo controllo.
+ *
+ * @returns La lunghezza in byte del nome convertito
+ */
+inline int utf16_a_utf8(const uint16_t *unita, int numero, char *dest)
+{
+    int n = 0;
+    int i = 0;
+
+    while (i < numero)
+    {
+        // percorso veloce: quattro unita' ASCII non nulle di fila
+        if (i + 4 <= numero)
+        {
+            uint64_t blocco;
+            memcpy(&blocco, unita + i, sizeof(blocco));
+            uint64_t alti = blocco & 0xff80ff80ff80ff80ull;
+            uint64_t nulli = (blocco - 0x0001000100010001ull) & ~blocco & 0x8000800080008000ull;
+            if ((alti | nulli) == 0)
+            {
+                dest[n] = (char)unita[i];
+                dest[n + 1] = (char)unita[i + 1];
+                dest[n + 2] = (char)unita[i + 2];
+                dest[n + 3] = (char)unita[i + 3];
+                n += 4;
+                i += 4;
+                continue;
+            }
+        }
+
+        uint32_t c = unita[i++];
+        if (c == 0x0000 || c == 0xffff)
+            break;
+
+        if (c < 0x80)
+        {
+            dest[n++] = (char)c;
+            continue;
+        }
+
+        // coppia surrogata: un carattere fuori dal piano base
+        if (c >= 0xd800 && c < 0xdc00 && i < numero && unita[i] >= 0xdc00 && unita[i] < 0xe000)
+            c = 0x10000 + ((c - 0xd800) << 10) + (unita[i++] - 0xdc00);
+        else if (c >= 0xd800 && c < 0xe000)
+            c = 0xfffd;
+
+        if (c < 0x800)
+        {
+            dest[n++] = (char)(0xc0 | (c >> 6));
+        }
+        else if (c < 0x10000)
+        {
+            dest[n++] = (char)(0xe0 | (c >> 12));
+            dest[n++] = (char)(0x80 | ((c >> 6) & 0x3f));
+        }
+        else
+        {
+            dest[n++] = (char)(0xf0 | (c >> 18));
+            dest[n++] = (char)(0x80 | ((c >> 12) & 0x3f));
+            dest[n++] = (char)(0x80 | ((c >> 6) & 0x3f));
+        }
+        dest[n++] = (char)(0x80 | (c & 0x3f));
+    }
+
+    dest[n] = '\0';
+    return n;
+}
+
+
+/**
+ * concludi_nome_lungo va chiamata sulla riga del nome corto che segue i
+ * frammenti. Se la sequenza e' completa e il checksum coincide restituisce
+ * il nome lungo in UTF-8, altrimenti NULL. In entrambi i casi il nome
+ * in costruzione viene azzerato.
+ */
+inline const char *concludi_nome_lungo(NomeLungo *nome, const unsigned char *riga)
+{
+    const char *risultato = NULL;
+
+    if (nome->frammenti > 0 && nome->atteso == 0 && nome->checksum == checksum_nome_corto(riga))
+    {
+        utf16_a_utf8(nome->unita, nome->frammenti * CARATTERI_PER_FRAMMENTO, nome->utf8);
+        if (nome->utf8[0] != '\0')
+            risultato = nome->utf8;
+    }
+
+    azzera_nome_lungo(nome);
+    return risultato;
+}
+
+#endif
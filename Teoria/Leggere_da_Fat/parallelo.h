@@ -0,0 +1,37 @@
+#ifndef PARALLELO_H
+#define PARALLELO_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+
+/**
+ * per_ogni_indice chiama f(i, lavoratore) per ogni i da 0 a n - 1 con
+ * numero_thread thread, compreso quello chiamante: ognuno prende il
+ * prossimo indice libero, cosi' un elemento lento non ferma gli altri.
+ * lavoratore va da 0 a numero_thread - 1 e serve a dare a ogni thread
+ * i propri buffer senza lock.
+ */
+template <typename Funzione>
+inline void per_ogni_indice(size_t n, unsigned numero_thread, Funzione f)
+{
+    if (numero_thread == 0)
+        numero_thread = 1;
+
+    std::atomic<size_t> prossimo(0);
+    auto lavora = [&](unsigned lavoratore)
+    {
+        for (size_t i = prossimo++; i < n; i = prossimo++)
+            f(i, lavoratore);
+    };
+
+    std::vector<std::thread> thread;
+    for (unsigned i = 1; i < numero_thread; i++)
+        thread.emplace_back(lavora, i);
+    lavora(0);
+    for (std::thread &t : thread)
+        t.join();
+}
+
+#endif
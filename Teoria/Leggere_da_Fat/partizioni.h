@@ -0,0 +1,179 @@
+#ifndef PARTIZIONI_H
+#define PARTIZIONI_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "immagine.h"
+
+
+// Le tabelle delle partizioni contano in settori da 512 byte
+#define BYTE_SETTORE_MBR 512
+
+// La tabella sta a 0x1be del settore: quattro righe da 16 byte
+#define INIZIO_TABELLA_PARTIZIONI 0x1be
+
+// Oltre questo numero di partizioni logiche la catena degli EBR ha un ciclo
+#define MASSIMO_PARTIZIONI_LOGICHE 128
+
+
+// Partizione e' una riga della tabella delle partizioni, con le posizioni in byte
+typedef struct
+{
+    // Il numero come lo darebbe Linux: da 1 a 4 le primarie, da 5 le logiche;
+    // 0 quando l'immagine e' direttamente un volume
+    unsigned numero;
+
+    unsigned char tipo;
+    unsigned long inizio;
+    unsigned long dimensione;
+
+    // 1 se il primo settore ha la forma di un boot sector FAT
+    int fat;
+} Partizione;
+
+
+inline int tipo_esteso(unsigned char tipo)
+{
+    return tipo == 0x05 || tipo == 0x0f || tipo == 0x85;
+}
+
+
+/**
+ * sembra_boot_sector dice se il settore che inizia al byte inizio ha la
+ * forma di un boot sector FAT: l'istruzione di salto, byte per settore e
+ * settori per cluster potenze di due, almeno un settore riservato e una FAT.
+ * Un MBR non passa: al posto di questi campi ha il codice di avvio.
+ */
+inline int sembra_boot_sector(Immagine *img, unsigned long inizio)
+{
+    if (inizio + BYTE_SETTORE_MBR > img->dimensione)
+        return 0;
+    unsigned char s[BYTE_SETTORE_MBR];
+    read_buffer(img, inizio, BYTE_SETTORE_MBR, s);
+
+    unsigned byte_per_settore = s[0x0b] | (s[0x0c] << 8);
+    unsigned settori_per_cluster = s[0x0d];
+    unsigned riservati = s[0x0e] | (s[0x0f] << 8);
+    return (s[0] == 0xeb || s[0] == 0xe9) &&
+           byte_per_settore >= 512 && byte_per_settore <= 4096 && (byte_per_settore & (byte_per_settore - 1)) == 0 &&
+           settori_per_cluster != 0 && (settori_per_cluster & (settori_per_cluster - 1)) == 0 &&
+           riservati > 0 && s[0x10] > 0;
+}
+
+
+// leggi_32 legge un intero little endian da una riga della tabella
+inline uint32_t leggi_32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+inline void aggiungi_partizione(Immagine *img, std::vector<Partizione> &partizioni, unsigned numero,
+                                unsigned char tipo, unsigned long settore, unsigned long settori)
+{
+    Partizione p;
+    p.numero = numero;
+    p.tipo = tipo;
+    p.inizio = settore * BYTE_SETTORE_MBR;
+    p.dimensione = settori * BYTE_SETTORE_MBR;
+    p.fat = sembra_boot_sector(img, p.inizio);
+    partizioni.push_back(p);
+}
+
+
+/**
+ * segui_estesa segue la catena degli EBR di una partizione estesa. Ogni EBR
+ * descrive una partizione logica, con l'inizio relativo all'EBR stesso, e
+ * il prossimo EBR, con l'inizio relativo alla partizione estesa.
+ */
+inline void segui_estesa(Immagine *img, unsigned long inizio_estesa, unsigned *numero,
+                         std::vector<Partizione> &partizioni)
+{
+    unsigned long ebr = inizio_estesa;
+    for (int i = 0; i < MASSIMO_PARTIZIONI_LOGICHE; i++)
+    {
+        if ((ebr + 1) * BYTE_SETTORE_MBR > img->dimensione)
+            return;
+        unsigned char s[BYTE_SETTORE_MBR];
+        read_buffer(img, ebr * BYTE_SETTORE_MBR, BYTE_SETTORE_MBR, s);
+        if (s[510] != 0x55 || s[511] != 0xaa)
+            return;
+
+        const unsigned char *logica = s + INIZIO_TABELLA_PARTIZIONI;
+        const unsigned char *prossimo = logica + 16;
+        if (logica[4] != 0 && leggi_32(logica + 12) != 0)
+            aggiungi_partizione(img, partizioni, (*numero)++, logica[4], ebr + leggi_32(logica + 8), leggi_32(logica + 12));
+
+        if (!tipo_esteso(prossimo[4]) || leggi_32(prossimo + 8) == 0)
+            return;
+        ebr = inizio_estesa + leggi_32(prossimo + 8);
+    }
+}
+
+
+/**
+ * cerca_partizioni legge la tabella del MBR e, per ogni partizione estesa,
+ * la catena delle sue partizioni logiche. Le partizioni estese non
+ * compaiono nell'elenco, solo quelle che contengono dati.
+ *
+ * @returns Il numero di partizioni trovate, 0 se il primo settore non e' un MBR
+ */
+inline int cerca_partizioni(Immagine *img, std::vector<Partizione> &partizioni)
+{
+    partizioni.clear();
+    if (img->dimensione < BYTE_SETTORE_MBR)
+        return 0;
+    unsigned char mbr[BYTE_SETTORE_MBR];
+    read_buffer(img, 0, BYTE_SETTORE_MBR, mbr);
+    if (mbr[510] != 0x55 || mbr[511] != 0xaa)
+        return 0;
+
+    // il primo byte di ogni riga dice solo se la partizione e' attiva
+    for (int i = 0; i < 4; i++)
+        if (mbr[INIZIO_TABELLA_PARTIZIONI + 16 * i] & 0x7f)
+            return 0;
+
+    unsigned numero_logica = 5;
+    for (int i = 0; i < 4; i++)
+    {
+        const unsigned char *riga = mbr + INIZIO_TABELLA_PARTIZIONI + 16 * i;
+        unsigned long settore = leggi_32(riga + 8), settori = leggi_32(riga + 12);
+        if (riga[4] == 0 || settori == 0)
+            continue;
+        if (tipo_esteso(riga[4]))
+            segui_estesa(img, settore, &numero_logica, partizioni);
+        else
+            aggiungi_partizione(img, partizioni, i + 1, riga[4], settore, settori);
+    }
+    return partizioni.size();
+}
+
+
+/**
+ * volumi_fat sceglie i volumi da elaborare: l'immagine stessa se inizia con
+ * un boot sector FAT, altrimenti le partizioni FAT del MBR. Un'immagine che
+ * non e' ne' l'una ne' l'altra cosa si tratta come un volume, che poi
+ * leggi_volume rifiutera'.
+ *
+ * @param richiesta Il numero dell'unica partizione da tenere, 0 per tutte
+ *
+ * @returns -1 se non resta nessun volume, 0 altrimenti
+ */
+inline int volumi_fat(Immagine *img, unsigned richiesta, std::vector<Partizione> &volumi)
+{
+    volumi.clear();
+    std::vector<Partizione> partizioni;
+    if (sembra_boot_sector(img, 0) || cerca_partizioni(img, partizioni) == 0)
+    {
+        volumi.push_back(Partizione{0, 0, 0, img->dimensione, 1});
+        return 0;
+    }
+
+    for (const Partizione &p : partizioni)
+        if (p.fat && (richiesta == 0 || p.numero == richiesta))
+            volumi.push_back(p);
+    return volumi.empty() ? -1 : 0;
+}
+
+#endif
@@ -0,0 +1,322 @@
+#ifndef RECUPERO_H
+#define RECUPERO_H
+
+#include <fcntl.h>
+#include <algorithm>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "immagine.h"
+#include "fat.h"
+#include "esplora.h"
+#include "nomi_lunghi.h"
+#include "estrai_tutto.h"
+
+
+// Quanto dell'immagine legge ogni pread durante il recupero senza mappatura
+#define DIMENSIONE_FINESTRA_RECUPERO (1 << 22)
+
+
+// Quanto resta di un file cancellato, secondo la FAT
+enum StatoRecupero
+{
+    // tutti i cluster che avrebbe occupato di seguito sono ancora liberi
+    RECUPERO_INTEGRO,
+
+    // il primo cluster e' libero ma qualcuno dei successivi e' stato riusato
+    RECUPERO_PARZIALE,
+
+    // il primo cluster appartiene gia' a un altro file
+    RECUPERO_SOVRASCRITTO,
+
+    // nessun dato da recuperare: dimensione o primo cluster a zero
+    RECUPERO_VUOTO
+};
+
+
+// VoceCancellata e' una riga 0xE5 trovata in una directory ancora viva
+typedef struct
+{
+    // Il percorso ricostruito e i campi della riga com'era prima della cancellazione
+    Voce voce;
+
+    StatoRecupero stato;
+
+    // Quanti cluster servirebbero e quanti di questi sono ancora liberi
+    unsigned long cluster_necessari;
+    unsigned long cluster_liberi;
+} VoceCancellata;
+
+
+/**
+ * stato_recupero stima se un file cancellato si puo' recuperare. La FAT
+ * non conserva la catena di un file cancellato, quindi si assume che fosse
+ * contigua a partire dal primo cluster, come accade quasi sempre.
+ */
+inline StatoRecupero stato_recupero(const Volume *vol, const TabellaFat *fat, const Voce *voce,
+                                    unsigned long *necessari, unsigned long *liberi)
+{
+    unsigned long dimensione = voce->attributi & ATTRIBUTO_DIRECTORY ? vol->byte_per_cluster : voce->dimensione;
+    *necessari = (dimensione + vol->byte_per_cluster - 1) / vol->byte_per_cluster;
+    *liberi = 0;
+
+    if (*necessari == 0 || voce->primo_cluster == 0)
+        return RECUPERO_VUOTO;
+    if (!cluster_valido(fat, voce->primo_cluster) || fat->prossimo[voce->primo_cluster] != CLUSTER_LIBERO)
+        return RECUPERO_SOVRASCRITTO;
+
+    for (unsigned long i = 0; i < *necessari; i++)
+    {
+        uint32_t cluster = voce->primo_cluster + i;
+        if (cluster_valido(fat, cluster) && fat->prossimo[cluster] == CLUSTER_LIBERO)
+            (*liberi)++;
+    }
+    return *liberi == *necessari ? RECUPERO_INTEGRO : RECUPERO_PARZIALE;
+}
+
+
+/**
+ * nome_cancellato ricostruisce il nome di una riga cancellata. La
+ * cancellazione sovrascrive il primo carattere del nome 8.3 e il numero di
+ * sequenza dei frammenti del nome lungo, ma non il resto: i frammenti che
+ * precedono la riga si rimettono in ordine dalla loro posizione e il
+ * carattere perso si ritrova cercando quello che rende giusto il checksum.
+ *
+ * @param riga La riga 0xE5 del nome corto
+ * @param frammenti Le righe dei frammenti cancellati subito prima, nell'ordine dell'immagine
+ * @param nome_lungo Buffer per la decodifica del nome lungo
+ * @param dest Riceve il nome 8.3 ricostruito, almeno 13 byte
+ *
+ * @returns Il nome lungo, o NULL se i frammenti non sono di questa riga
+ */
+inline const char *nome_cancellato(const unsigned char *riga, const unsigned char (*frammenti)[32],
+                                   int numero_frammenti, NomeLungo *nome_lungo, char *dest)
+{
+    unsigned char corto[32];
+    memcpy(corto, riga, 32);
+    corto[0] = '_';
+
+    int checksum_comune = numero_frammenti > 0;
+    for (int i = 1; i < numero_frammenti; i++)
+        if (frammenti[i][0x0d] != frammenti[0][0x0d])
+            checksum_comune = 0;
+
+    const char *lungo = NULL;
+    if (checksum_comune)
+    {
+        // il frammento piu' vicino alla riga e' il primo del nome
+        static const unsigned char offset[CARATTERI_PER_FRAMMENTO] = {
+            1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+        for (int i = 0; i < numero_frammenti; i++)
+        {
+            const unsigned char *frammento = frammenti[numero_frammenti - 1 - i];
+            uint16_t *unita = nome_lungo->unita + i * CARATTERI_PER_FRAMMENTO;
+            for (int c = 0; c < CARATTERI_PER_FRAMMENTO; c++)
+                unita[c] = frammento[offset[c]] | (frammento[offset[c] + 1] << 8);
+        }
+        utf16_a_utf8(nome_lungo->unita, numero_frammenti * CARATTERI_PER_FRAMMENTO, nome_lungo->utf8);
+
+        // si prova prima l'iniziale del nome lungo, poi ogni carattere valido in un nome 8.3
+        static const char candidati[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_$~!#%&'-@^`{}()";
+        unsigned char primo = nome_lungo->utf8[0] >= 'a' && nome_lungo->utf8[0] <= 'z' ? nome_lungo->utf8[0] - 32 : nome_lungo->utf8[0];
+        corto[0] = primo;
+        for (const char *c = candidati; checksum_nome_corto(corto) != frammenti[0][0x0d] && *c != '\0'; c++)
+            corto[0] = *c;
+
+        if (checksum_nome_corto(corto) == frammenti[0][0x0d] && nome_lungo->utf8[0] != '\0')
+            lungo = nome_lungo->utf8;
+        else
+            corto[0] = '_';
+    }
+
+    nome_corto(corto, dest);
+    return lungo;
+}
+
+
+/**
+ * cerca_cancellate scorre la root e tutte le directory vive e raccoglie le
+ * righe cancellate che contengono un file o una directory. Le directory
+ * cancellate vengono elencate ma non esplorate.
+ *
+ * @param voci Le voci vive dell'albero, da esplora_albero
+ */
+inline void cerca_cancellate(Immagine *img, const Volume *vol, const TabellaFat *fat,
+                             const std::vector<Voce> &voci, std::vector<VoceCancellata> &cancellate)
+{
+    std::vector<std::pair<uint32_t, std::string>> directory;
+    directory.push_back(std::make_pair(vol->cluster_root, std::string()));
+
+    // due directory con lo stesso primo cluster si leggono una volta sola
+    std::vector<unsigned char> vista(fat->numero_voci, 0);
+    for (const Voce &voce : voci)
+        if ((voce.attributi & ATTRIBUTO_DIRECTORY) && cluster_valido(fat, voce.primo_cluster) &&
+            voce.primo_cluster != vol->cluster_root && !vista[voce.primo_cluster])
+        {
+            vista[voce.primo_cluster] = 1;
+            directory.push_back(std::make_pair(voce.primo_cluster, voce.percorso));
+        }
+
+    std::vector<unsigned char> buffer;
+    std::unique_ptr<NomeLungo> nome_lungo(new NomeLungo);
+    unsigned char frammenti[FRAMMENTI_NOME_LUNGO][32];
+
+    for (const auto &d : directory)
+    {
+        int numero_frammenti = 0;
+        scorri_directory(img, vol, fat, d.first, buffer,
+                         [&](const unsigned char *righe, unsigned long numero, unsigned long posizione) -> int
+                         {
+                             for (unsigned long r = 0; r < numero; r++)
+                             {
+                                 const unsigned char *riga = righe + r * 32;
+                                 if (riga[0] == 0x00)
+                                     return 0;
+                                 if (riga[0] != 0xe5)
+                                 {
+                                     numero_frammenti = 0;
+                                     continue;
+                                 }
+
+                                 if (riga_nome_lungo(riga))
+                                 {
+                                     if (numero_frammenti == FRAMMENTI_NOME_LUNGO)
+                                         numero_frammenti = 0;
+                                     memcpy(frammenti[numero_frammenti++], riga, 32);
+                                     continue;
+                                 }
+                                 if ((riga[0x0b] & (ATTRIBUTO_ETICHETTA | ATTRIBUTO_DIRECTORY)) == ATTRIBUTO_ETICHETTA)
+                                 {
+                                     numero_frammenti = 0;
+                                     continue;
+                                 }
+
+                                 VoceCancellata c;
+                                 const char *lungo = nome_cancellato(riga, frammenti, numero_frammenti,
+                                                                     nome_lungo.get(), c.voce.nome_breve);
+                                 numero_frammenti = 0;
+
+                                 c.voce.percorso = d.second;
+                                 c.voce.percorso += '/';
+                                 c.voce.percorso += lungo ? lungo : c.voce.nome_breve;
+                                 decodifica_voce(riga, posizione + r * 32, vol->tipo_fat, &c.voce);
+                                 c.stato = stato_recupero(vol, fat, &c.voce, &c.cluster_necessari, &c.cluster_liberi);
+                                 cancellate.push_back(std::move(c));
+                             }
+                             return 1;
+                         });
+    }
+
+    std::sort(cancellate.begin(), cancellate.end(),
+              [](const VoceCancellata &a, const VoceCancellata &b) { return a.voce.percorso < b.voce.percorso; });
+}
+
+
+/**
+ * recupera_cancellate salva nella cartella i file cancellati integri, ognuno
+ * come "<primo cluster>_<nome>"; se due file avrebbero lo stesso nome, ad
+ * esempio perche' stavano in directory diverse, al secondo si aggiunge un
+ * numero: "<primo cluster>_2_<nome>". I pezzi di tutti i file si ordinano per
+ * posizione nell'immagine, cosi' l'immagine si legge in un'unica passata in
+ * avanti, con letture grandi e senza tornare indietro.
+ *
+ * @returns Il numero di file salvati
+ */
+inline unsigned long recupera_cancellate(Immagine *img, const Volume *vol, const std::vector<VoceCancellata> &cancellate,
+                                         const char *cartella, RisultatoEstrazione *r)
+{
+    memset(r, 0, sizeof(*r));
+
+    // uscita e' l'indice del file tra i candidati finche' i file non si aprono
+    std::vector<size_t> candidati;
+    std::vector<PezzoCopia> pezzi;
+    for (size_t i = 0; i < cancellate.size(); i++)
+    {
+        const Voce &voce = cancellate[i].voce;
+        if (cancellate[i].stato != RECUPERO_INTEGRO || (voce.attributi & ATTRIBUTO_DIRECTORY))
+            continue;
+
+        unsigned long sorgente = posizione_cluster(vol, voce.primo_cluster);
+        for (unsigned long fatti = 0; fatti < voce.dimensione; fatti += DIMENSIONE_PEZZO)
+        {
+            unsigned long lunghezza = voce.dimensione - fatti < DIMENSIONE_PEZZO ? voce.dimensione - fatti : DIMENSIONE_PEZZO;
+            pezzi.push_back(PezzoCopia{(int)candidati.size(), sorgente + fatti, fatti, lunghezza});
+        }
+        candidati.push_back(i);
+    }
+    std::stable_sort(pezzi.begin(), pezzi.end(),
+                     [](const PezzoCopia &a, const PezzoCopia &b) { return a.sorgente < b.sorgente; });
+
+    // i nomi si scelgono prima di aprire i file: O_TRUNC non deve cancellare un altro recuperato
+    std::vector<std::string> nomi(candidati.size());
+    std::unordered_set<std::string> usati;
+    for (size_t k = 0; k < candidati.size(); k++)
+    {
+        const Voce &voce = cancellate[candidati[k]].voce;
+        std::string cluster = std::to_string(voce.primo_cluster) + "_";
+        std::string nome = voce.percorso.substr(voce.percorso.rfind('/') + 1);
+        nomi[k] = cluster + nome;
+        for (unsigned n = 2; !usati.insert(nomi[k]).second; n++)
+            nomi[k] = cluster + std::to_string(n) + "_" + nome;
+    }
+
+
+    // ogni file si apre al primo pezzo e si chiude dopo l'ultimo
+    std::vector<unsigned long> mancanti(candidati.size(), 0);
+    std::vector<int> uscite(candidati.size(), -1);
+    for (const PezzoCopia &pezzo : pezzi)
+        mancanti[pezzo.uscita]++;
+
+    if (img->dati == NULL)
+        posix_fadvise(img->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    std::vector<unsigned char> finestra(img->dati == NULL ? DIMENSIONE_FINESTRA_RECUPERO : 0);
+    unsigned long inizio_finestra = 0, fine_finestra = 0;
+
+    for (const PezzoCopia &pezzo : pezzi)
+    {
+        int &uscita = uscite[pezzo.uscita];
+        if (uscita < 0 && mancanti[pezzo.uscita] > 0)
+        {
+            std::string percorso = std::string(cartella) + "/" + nomi[pezzo.uscita];
+            uscita = open(percorso.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (uscita < 0)
+            {
+                perror(percorso.c_str());
+                r->errori++;
+                mancanti[pezzo.uscita] = 0;
+                continue;
+            }
+        }
+        if (uscita < 0)
+            continue;
+
+        const unsigned char *dati = puntatore_immagine(img, pezzo.sorgente, pezzo.lunghezza);
+        if (dati == NULL && img->dati == NULL)
+        {
+            if (pezzo.sorgente < inizio_finestra || pezzo.sorgente + pezzo.lunghezza > fine_finestra)
+            {
+                inizio_finestra = pezzo.sorgente;
+                fine_finestra = inizio_finestra + pread_tutto(img->fd, finestra.data(), finestra.size(), inizio_finestra);
+            }
+            if (pezzo.sorgente + pezzo.lunghezza <= fine_finestra)
+                dati = finestra.data() + (pezzo.sorgente - inizio_finestra);
+        }
+
+        if (dati == NULL || pwrite_tutto(uscita, dati, pezzo.lunghezza, pezzo.destinazione) != 0)
+            r->errori++;
+        else
+            r->byte += pezzo.lunghezza;
+
+        if (--mancanti[pezzo.uscita] == 0)
+        {
+            close(uscita);
+            uscita = -1;
+            r->file++;
+        }
+    }
+
+    return r->file;
+}
+
+#endif
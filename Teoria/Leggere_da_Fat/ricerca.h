@@ -0,0 +1,286 @@
+#ifndef RICERCA_H
+#define RICERCA_H
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "immagine.h"
+#include "fat.h"
+#include "esplora.h"
+#include "parallelo.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RICERCA_X86 1
+#endif
+
+
+// Quanti byte alla volta legge ogni thread quando l'immagine non e' mappata
+#define DIMENSIONE_LETTURA_RICERCA (1 << 20)
+
+// La lunghezza massima del modello: i pezzi a cavallo tra due letture si
+// confrontano in un buffer sullo stack
+#define LUNGHEZZA_MASSIMA_MODELLO 4096
+
+
+/**
+ * cerca_scalare aggiunge a trovate base + la posizione di ogni occorrenza
+ * del modello nel testo, anche sovrapposte. memchr trova i candidati per
+ * il primo byte, memcmp conferma.
+ */
+inline void cerca_scalare(const unsigned char *testo, unsigned long n, const unsigned char *modello,
+                          unsigned long m, unsigned long base, std::vector<unsigned long> &trovate)
+{
+    if (n < m)
+        return;
+    const unsigned char *p = testo, *fine = testo + n - m + 1;
+    while (p < fine && (p = (const unsigned char *)memchr(p, modello[0], fine - p)) != NULL)
+    {
+        if (memcmp(p, modello, m) == 0)
+            trovate.push_back(base + (p - testo));
+        p++;
+    }
+}
+
+
+#ifdef RICERCA_X86
+
+/**
+ * cerca_sse2 confronta 16 posizioni alla volta con il primo e con l'ultimo
+ * byte del modello; solo le posizioni in cui coincidono entrambi passano
+ * al memcmp, cosi' i byte frequenti del testo non generano falsi candidati.
+ */
+inline void cerca_sse2(const unsigned char *testo, unsigned long n, const unsigned char *modello,
+                       unsigned long m, unsigned long base, std::vector<unsigned long> &trovate)
+{
+    if (n < m)
+        return;
+    const __m128i primo = _mm_set1_epi8(modello[0]);
+    const __m128i ultimo = _mm_set1_epi8(modello[m - 1]);
+
+    unsigned long i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(testo + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(testo + i + m - 1));
+        unsigned maschera = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, primo), _mm_cmpeq_epi8(b, ultimo)));
+        while (maschera)
+        {
+            unsigned k = __builtin_ctz(maschera);
+            if (m <= 2 || memcmp(testo + i + k + 1, modello + 1, m - 2) == 0)
+                trovate.push_back(base + i + k);
+            maschera &= maschera - 1;
+        }
+    }
+    cerca_scalare(testo + i, n - i, modello, m, base + i, trovate);
+}
+
+
+/**
+ * cerca_avx2 e' come cerca_sse2 ma con 32 posizioni alla volta.
+ */
+__attribute__((target("avx2"))) inline void cerca_avx2(const unsigned char *testo, unsigned long n,
+                                                        const unsigned char *modello, unsigned long m,
+                                                        unsigned long base, std::vector<unsigned long> &trovate)
+{
+    if (n < m)
+        return;
+    const __m256i primo = _mm256_set1_epi8(modello[0]);
+    const __m256i ultimo = _mm256_set1_epi8(modello[m - 1]);
+
+    unsigned long i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(testo + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(testo + i + m - 1));
+        uint32_t maschera = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, primo), _mm256_cmpeq_epi8(b, ultimo)));
+        while (maschera)
+        {
+            unsigned k = __builtin_ctz(maschera);
+            if (m <= 2 || memcmp(testo + i + k + 1, modello + 1, m - 2) == 0)
+                trovate.push_back(base + i + k);
+            maschera &= maschera - 1;
+        }
+    }
+    cerca_scalare(testo + i, n - i, modello, m, base + i, trovate);
+}
+
+#endif
+
+
+typedef void (*FunzioneRicerca)(const unsigned char *, unsigned long, const unsigned char *, unsigned long,
+                                unsigned long, std::vector<unsigned long> &);
+
+
+// scegli_ricerca sceglie una volta sola la versione migliore per questa CPU
+inline FunzioneRicerca scegli_ricerca()
+{
+#ifdef RICERCA_X86
+    static const FunzioneRicerca scelta = __builtin_cpu_supports("avx2") ? cerca_avx2 : cerca_sse2;
+    return scelta;
+#else
+    return cerca_scalare;
+#endif
+}
+
+
+/**
+ * decodifica_modello trasforma il modello scritto sulla riga di comando in
+ * byte: \xNN e' un byte in esadecimale, \\ una barra, il resto e' letterale.
+ *
+ * @returns 0 se il modello e' valido e non vuoto, -1 altrimenti
+ */
+inline int decodifica_modello(const char *testo, std::string &modello)
+{
+    modello.clear();
+    for (const char *p = testo; *p != '\0'; p++)
+    {
+        if (*p != '\\')
+        {
+            modello += *p;
+            continue;
+        }
+        if (p[1] == '\\')
+        {
+            modello += '\\';
+            p++;
+            continue;
+        }
+        if (p[1] != 'x' || !isxdigit((unsigned char)p[2]) || !isxdigit((unsigned char)p[3]))
+            return -1;
+        char cifre[3] = {p[2], p[3], '\0'};
+        modello += (char)strtoul(cifre, NULL, 16);
+        p += 3;
+    }
+    return modello.empty() || modello.size() > LUNGHEZZA_MASSIMA_MODELLO ? -1 : 0;
+}
+
+
+// RisultatoRicerca raccoglie le occorrenze trovate in un file
+typedef struct
+{
+    // Gli offset dall'inizio del file, in ordine crescente
+    std::vector<unsigned long> posizioni;
+
+    // 1 se la catena finisce prima della dimensione dichiarata o la lettura fallisce
+    int errore;
+} RisultatoRicerca;
+
+
+/**
+ * cerca_nel_file scorre le estensioni di un file nell'ordine della catena
+ * cercando il modello. Da un'immagine mappata ogni estensione si legge sul
+ * posto, senza copie; altrimenti a blocchi con pread. Un'occorrenza che
+ * inizia nelle ultime m - 1 posizioni di un pezzo e finisce nel successivo
+ * (tra due cluster non consecutivi o tra due blocchi) si trova cercando
+ * in un piccolo buffer che unisce la coda del pezzo e l'inizio del seguente.
+ *
+ * @param buffer Il buffer per le pread, da DIMENSIONE_LETTURA_RICERCA byte; non usato se l'immagine e' mappata
+ */
+inline void cerca_nel_file(Immagine *img, const Volume *vol, const TabellaFat *fat, const Voce &voce,
+                           const std::string &modello, unsigned char *buffer, RisultatoRicerca *r)
+{
+    FunzioneRicerca cerca = scegli_ricerca();
+    const unsigned char *m = (const unsigned char *)modello.data();
+    unsigned long lunghezza_modello = modello.size();
+
+    // la coda del pezzo precedente e, dopo, l'inizio del pezzo corrente
+    unsigned char giunzione[2 * LUNGHEZZA_MASSIMA_MODELLO];
+    unsigned long coda = 0;
+
+    r->posizioni.clear();
+    unsigned long letti = 0;
+    IteratoreCatena catena = inizia_catena(fat, voce.primo_cluster);
+    Estensione estensione;
+    while (letti < voce.dimensione && prossima_estensione(&catena, &estensione))
+    {
+        unsigned long sorgente = posizione_cluster(vol, estensione.inizio);
+        unsigned long lunghezza = (unsigned long)estensione.lunghezza * vol->byte_per_cluster;
+        if (lunghezza > voce.dimensione - letti)
+            lunghezza = voce.dimensione - letti;
+
+        while (lunghezza > 0)
+        {
+            unsigned long quanti = lunghezza;
+            const unsigned char *dati = puntatore_immagine(img, sorgente, quanti);
+            if (dati == NULL)
+            {
+                if (img->dati != NULL)
+                    break;
+                if (quanti > DIMENSIONE_LETTURA_RICERCA)
+                    quanti = DIMENSIONE_LETTURA_RICERCA;
+                if (pread_tutto(img->fd, buffer, quanti, sorgente) != quanti)
+                    break;
+                dati = buffer;
+            }
+
+            // prima le occorrenze che iniziano nella coda, che vengono prima nel file
+            if (coda > 0)
+            {
+                unsigned long inizio = lunghezza_modello - 1 < quanti ? lunghezza_modello - 1 : quanti;
+                memcpy(giunzione + coda, dati, inizio);
+                size_t prima = r->posizioni.size();
+                cerca_scalare(giunzione, coda + inizio, m, lunghezza_modello, letti - coda, r->posizioni);
+                while (r->posizioni.size() > prima && r->posizioni.back() >= letti)
+                    r->posizioni.pop_back();
+            }
+            cerca(dati, quanti, m, lunghezza_modello, letti, r->posizioni);
+
+            // le ultime m - 1 posizioni, che possono unirsi al pezzo seguente
+            unsigned long nuova_coda = coda + quanti < lunghezza_modello - 1 ? coda + quanti : lunghezza_modello - 1;
+            if (quanti >= nuova_coda)
+                memcpy(giunzione, dati + quanti - nuova_coda, nuova_coda);
+            else
+            {
+                memmove(giunzione, giunzione + coda - (nuova_coda - quanti), nuova_coda - quanti);
+                memcpy(giunzione + nuova_coda - quanti, dati, quanti);
+            }
+            coda = nuova_coda;
+
+            sorgente += quanti;
+            letti += quanti;
+            lunghezza -= quanti;
+        }
+        if (lunghezza > 0)
+            break;
+    }
+    r->errore = letti < voce.dimensione;
+}
+
+
+/**
+ * cerca_nell_albero cerca il modello in tutti i file di voci con
+ * numero_thread thread, ognuno dei quali prende il prossimo file libero.
+ *
+ * @param risultati Riceve un risultato per ogni voce, nello stesso ordine
+ * @returns Il numero di byte letti
+ */
+inline unsigned long cerca_nell_albero(Immagine *img, const Volume *vol, const TabellaFat *fat,
+                                       const std::vector<Voce> &voci, const std::string &modello,
+                                       unsigned numero_thread, std::vector<RisultatoRicerca> &risultati)
+{
+    if (numero_thread == 0)
+        numero_thread = 1;
+    risultati.assign(voci.size(), RisultatoRicerca());
+
+    std::atomic<unsigned long> byte(0);
+    std::vector<std::vector<unsigned char>> buffer(numero_thread,
+                                                   std::vector<unsigned char>(img->dati == NULL ? DIMENSIONE_LETTURA_RICERCA : 0));
+
+    per_ogni_indice(voci.size(), numero_thread, [&](size_t i, unsigned lavoratore)
+    {
+        if (voci[i].attributi & ATTRIBUTO_DIRECTORY)
+            return;
+        cerca_nel_file(img, vol, fat, voci[i], modello, buffer[lavoratore].data(), &risultati[i]);
+        byte += voci[i].dimensione;
+    });
+
+    return byte;
+}
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef SCANSIONE_H
+#define SCANSIONE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCANSIONE_X86 1
+#endif
+
+
+// Quante righe da 32 byte si classificano in un colpo solo
+#define RIGHE_PER_MASCHERA 64
+
+
+// MaschereRighe dice, per ognuna di al massimo 64 righe consecutive di una
+// directory, di che tipo e' la riga: il bit i riguarda la riga i.
+typedef struct
+{
+    // Righe con un file, una directory, "." o ".." o l'etichetta del volume
+    uint64_t vive;
+
+    // Frammenti di un nome lungo (attributo 0x0f)
+    uint64_t lunghe;
+
+    // Righe cancellate (primo byte 0xe5)
+    uint64_t cancellate;
+
+    // Righe libere (primo byte 0x00): dalla prima in poi la directory e' finita
+    uint64_t libere;
+} MaschereRighe;
+
+
+/**
+ * riga_nome_lungo dice se la riga e' un frammento di nome lungo. Conta solo
+ * i sei bit bassi dell'attributo, come fanno i sistemi operativi: i due alti
+ * sono riservati e non cambiano la natura della riga.
+ */
+inline int riga_nome_lungo(const unsigned char *riga)
+{
+    return (riga[0x0b] & 0x3f) == 0x0f;
+}
+
+
+inline void componi_maschere(uint64_t zero, uint64_t e5, uint64_t attributo_0f, MaschereRighe *m)
+{
+    m->libere = zero;
+    m->cancellate = e5;
+    m->lunghe = attributo_0f & ~(zero | e5);
+    m->vive = ~(zero | e5 | attributo_0f);
+}
+
+
+/**
+ * classifica_righe_scalare e' la versione semplice, una riga alla volta.
+ */
+inline void classifica_righe_scalare(const unsigned char *righe, unsigned long numero, MaschereRighe *m)
+{
+    uint64_t zero = 0, e5 = 0, attributo_0f = 0;
+    for (unsigned long i = 0; i < numero; i++)
+    {
+        const unsigned char *riga = righe + i * 32;
+        zero |= (uint64_t)(riga[0] == 0x00) << i;
+        e5 |= (uint64_t)(riga[0] == 0xe5) << i;
+        attributo_0f |= (uint64_t)riga_nome_lungo(riga) << i;
+    }
+    componi_maschere(zero, e5, attributo_0f, m);
+}
+
+
+#ifdef SCANSIONE_X86
+
+// aggiungi_resto classifica con la versione scalare le righe dopo la
+// parte gestita a vettori, poi compone le maschere.
+inline void aggiungi_resto(const unsigned char *righe, unsigned long fatte, unsigned long numero,
+                           uint64_t zero, uint64_t e5, uint64_t attributo_0f, MaschereRighe *m)
+{
+    if (fatte < numero)
+    {
+        MaschereRighe resto;
+        classifica_righe_scalare(righe + fatte * 32, numero - fatte, &resto);
+        zero |= resto.libere << fatte;
+        e5 |= resto.cancellate << fatte;
+        attributo_0f |= resto.lunghe << fatte;
+    }
+    componi_maschere(zero, e5, attributo_0f, m);
+}
+
+
+/**
+ * classifica_righe_sse2 raccoglie il primo byte e l'attributo di quattro
+ * righe alla volta e li confronta con un'unica istruzione per valore.
+ */
+inline void classifica_righe_sse2(const unsigned char *righe, unsigned long numero, MaschereRighe *m)
+{
+    uint64_t zero = 0, e5 = 0, attributo_0f = 0;
+    const __m128i basso = _mm_set1_epi32(0xff);
+    const __m128i valore_e5 = _mm_set1_epi32(0xe5);
+    const __m128i maschera_attributo = _mm_set1_epi32(0x3f);
+    const __m128i valore_0f = _mm_set1_epi32(0x0f);
+
+    unsigned long i = 0;
+    for (; i + 4 <= numero; i += 4)
+    {
+        const unsigned char *r = righe + i * 32;
+        int32_t testa[4], coda[4];
+        for (int k = 0; k < 4; k++)
+        {
+            memcpy(&testa[k], r + k * 32, 4);
+            memcpy(&coda[k], r + k * 32 + 8, 4);
+        }
+
+        __m128i primo = _mm_and_si128(_mm_loadu_si128((const __m128i *)testa), basso);
+        __m128i attributo = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128((const __m128i *)coda), 24), maschera_attributo);
+
+        zero |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(primo, _mm_setzero_si128()))) << i;
+        e5 |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(primo, valore_e5))) << i;
+        attributo_0f |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(attributo, valore_0f))) << i;
+    }
+
+    aggiungi_resto(righe, i, numero, zero, e5, attributo_0f, m);
+}
+
+
+/**
+ * classifica_righe_avx2 usa due gather per leggere il primo byte e
+ * l'attributo di otto righe alla volta.
+ */
+__attribute__((target("avx2"))) inline void classifica_righe_avx2(const unsigned char *righe, unsigned long numero, MaschereRighe *m)
+{
+    uint64_t zero = 0, e5 = 0, attributo_0f = 0;
+    const __m256i indici = _mm256_setr_epi32(0, 32, 64, 96, 128, 160, 192, 224);
+    const __m256i basso = _mm256_set1_epi32(0xff);
+    const __m256i valore_e5 = _mm256_set1_epi32(0xe5);
+    const __m256i maschera_attributo = _mm256_set1_epi32(0x3f);
+    const __m256i valore_0f = _mm256_set1_epi32(0x0f);
+
+    unsigned long i = 0;
+    for (; i + 8 <= numero; i += 8)
+    {
+        const unsigned char *r = righe + i * 32;
+        __m256i testa = _mm256_i32gather_epi32((const int *)r, indici, 1);
+        __m256i coda = _mm256_i32gather_epi32((const int *)(r + 8), indici, 1);
+
+        __m256i primo = _mm256_and_si256(testa, basso);
+        __m256i attributo = _mm256_and_si256(_mm256_srli_epi32(coda, 24), maschera_attributo);
+
+        zero |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(primo, _mm256_setzero_si256()))) << i;
+        e5 |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(primo, valore_e5))) << i;
+        attributo_0f |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(attributo, valore_0f))) << i;
+    }
+
+    aggiungi_resto(righe, i, numero, zero, e5, attributo_0f, m);
+}
+
+#endif
+
+
+typedef void (*Classificatore)(const unsigned char *, unsigned long, MaschereRighe *);
+
+
+/**
+ * scegli_classificatore restituisce la versione migliore per questa CPU.
+ * Il controllo si fa una volta sola.
+ */
+inline Classificatore scegli_classificatore()
+{
+#ifdef SCANSIONE_X86
+    static const Classificatore scelto = __builtin_cpu_supports("avx2") ? classifica_righe_avx2
+                                                                         : classifica_righe_sse2;
+    return scelto;
+#else
+    return classifica_righe_scalare;
+#endif
+}
+
+
+/**
+ * classifica_righe riempie le maschere per al massimo RIGHE_PER_MASCHERA
+ * righe. I bit oltre numero valgono 0 in tutte le maschere.
+ */
+inline void classifica_righe(const unsigned char *righe, unsigned long numero, MaschereRighe *m)
+{
+    scegli_classificatore()(righe, numero, m);
+
+    uint64_t validi = numero >= 64 ? ~0ull : ((1ull << numero) - 1);
+    m->vive &= validi;
+}
+
+#endif
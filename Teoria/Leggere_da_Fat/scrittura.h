@@ -0,0 +1,1166 @@
+#ifndef SCRITTURA_H
+#define SCRITTURA_H
+
+#include <time.h>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "immagine.h"
+#include "fat.h"
+#include "esplora.h"
+#include "nomi_lunghi.h"
+#include "mappa_bit.h"
+#include "generatore.h"
+#include "estrai_tutto.h"
+
+
+// Le modifiche all'immagine restano in memoria fino a salva_scrittura:
+// la FAT grezza con un bit per ogni settore cambiato e i cluster delle
+// directory toccate. Solo il contenuto dei file va subito sul disco, nei
+// cluster liberi sul disco: quelli liberati durante la sessione restano
+// in attesa, perche' le righe di directory salvate li usano ancora, e si
+// possono riallocare solo dopo il salvataggio. Cosi' finche' non si salva
+// l'immagine resta com'era.
+
+
+// Quanti byte di zeri si scrivono alla volta quando un file si allunga
+#define DIMENSIONE_ZERI (1 << 16)
+
+
+// BloccoDirectory e' un cluster di una directory, o tutta la root ad area fissa
+struct BloccoDirectory
+{
+    std::vector<unsigned char> dati;
+    int sporco;
+};
+
+
+// DirectoryScritta indicizza le righe di una directory gia' letta: i nomi
+// in minuscolo (lunghi e 8.3) portano alla riga del nome corto
+struct DirectoryScritta
+{
+    // Il primo cluster, 0 per la root ad area fissa di FAT12 e FAT16
+    uint32_t primo_cluster;
+
+    // I blocchi in ordine; la riga i sta nel blocco i / righe_per_blocco
+    std::vector<uint32_t> blocchi;
+    unsigned long righe_per_blocco;
+
+    std::unordered_map<std::string, unsigned long> nomi;
+    std::unordered_set<std::string> brevi;
+
+    // Da qui in poi si cercano le righe libere
+    unsigned long prima_libera;
+
+    // La riga 0x00 che chiude la directory: le righe da qui in poi sono
+    // libere qualunque cosa contengano
+    unsigned long fine;
+};
+
+
+// ScritturaFat e' un'immagine aperta in scrittura
+struct ScritturaFat
+{
+    int fd;
+    Volume vol;
+    TabellaFat *fat;
+
+    // La prima copia della FAT cosi' come andra' scritta in tutte le copie
+    std::vector<unsigned char> fat_grezza;
+    MappaBit settori_sporchi;
+
+    // I cluster liberi (bit a 1) e il punto da cui riparte la ricerca.
+    // numero_liberi conta anche quelli in attesa, come la FAT in memoria
+    MappaBit liberi;
+    unsigned long numero_liberi;
+    uint32_t cursore;
+
+    // I cluster liberati in questa sessione che sul disco sono ancora
+    // usati, il valore che hanno sul disco, e quelli allocati in questa
+    // sessione che sul disco sono ancora liberi
+    MappaBit in_attesa;
+    unsigned long numero_in_attesa;
+    std::unordered_map<uint32_t, uint32_t> valori_su_disco;
+    MappaBit nuovi;
+
+    // La chiave e' il cluster del blocco, 0 per la root ad area fissa
+    std::map<uint32_t, BloccoDirectory> blocchi;
+    std::map<uint32_t, DirectoryScritta> directory;
+
+    // Le pwrite fatte finora, per i dati e per i metadati
+    unsigned long scritture;
+};
+
+
+/**
+ * apri_scrittura apre un'immagine in lettura e scrittura, carica la FAT e
+ * costruisce la mappa dei cluster liberi. Su FAT32 la ricerca dei cluster
+ * parte dal suggerimento dell'FSInfo.
+ *
+ * @param inizio Il byte in cui inizia il volume, per una partizione di un disco intero
+ *
+ * @returns L'immagine aperta, o NULL in caso di errore
+ */
+inline ScritturaFat *apri_scrittura(const char *percorso, unsigned long inizio = 0)
+{
+    Immagine *img = apri_immagine(percorso, 0);
+    if (img == NULL)
+        return NULL;
+
+    ScritturaFat *w = new ScritturaFat;
+    w->fat = NULL;
+    w->liberi.parole = NULL;
+    w->in_attesa.parole = NULL;
+    w->nuovi.parole = NULL;
+    w->settori_sporchi.parole = NULL;
+    w->scritture = 0;
+    w->fd = -1;
+
+    if (leggi_volume(img, &w->vol, inizio) == 0 && !img->in_memoria)
+        w->fat = carica_tabella_fat(img, &w->vol);
+    if (w->fat != NULL)
+    {
+        w->fat_grezza.resize(w->vol.bytes_per_fat);
+        read_buffer(img, w->vol.inizio_area_fat, w->vol.bytes_per_fat, w->fat_grezza.data());
+        w->fd = open(percorso, O_RDWR);
+    }
+
+    uint32_t suggerimento = 0;
+    if (w->fd >= 0 && w->vol.tipo_fat == 32)
+    {
+        unsigned long info = inizio + read_number(img, inizio + 0x30, 2) * w->vol.byte_per_settore;
+        if (read_number(img, info, 4) == 0x41615252 && read_number(img, info + 484, 4) == 0x61417272)
+            suggerimento = read_number(img, info + 492, 4);
+    }
+    chiudi_immagine(img);
+
+    if (w->fd < 0 || crea_mappa_bit(&w->liberi, w->fat->numero_voci) != 0 ||
+        crea_mappa_bit(&w->in_attesa, w->fat->numero_voci) != 0 || crea_mappa_bit(&w->nuovi, w->fat->numero_voci) != 0 ||
+        crea_mappa_bit(&w->settori_sporchi, w->vol.bytes_per_fat / w->vol.byte_per_settore + 1) != 0)
+    {
+        if (w->fd >= 0)
+            close(w->fd);
+        distruggi_mappa_bit(&w->liberi);
+        distruggi_mappa_bit(&w->in_attesa);
+        distruggi_mappa_bit(&w->nuovi);
+        distruggi_mappa_bit(&w->settori_sporchi);
+        distruggi_tabella_fat(w->fat);
+        delete w;
+        return NULL;
+    }
+
+    w->numero_liberi = 0;
+    w->numero_in_attesa = 0;
+    for (unsigned long c = 2; c < w->fat->numero_voci; c++)
+        if (w->fat->prossimo[c] == CLUSTER_LIBERO)
+        {
+            accendi_bit(&w->liberi, c);
+            w->numero_liberi++;
+        }
+    w->cursore = cluster_valido(w->fat, suggerimento) ? suggerimento : 2;
+    return w;
+}
+
+
+/**
+ * codifica_fat scrive valore nella voce di cluster della FAT grezza dati e
+ * segna in settori quelli che la contengono.
+ */
+inline void codifica_fat(const ScritturaFat *w, unsigned char *dati, MappaBit *settori, uint32_t cluster, uint32_t valore)
+{
+    unsigned long inizio = 0, fine = 0;
+    switch (w->vol.tipo_fat)
+    {
+    case 12:
+        codifica_voce_fat<12>(dati, cluster, valore);
+        inizio = cluster + cluster / 2;
+        fine = inizio + 1;
+        break;
+    case 16:
+        codifica_voce_fat<16>(dati, cluster, valore);
+        inizio = fine = 2 * cluster;
+        break;
+    case 32:
+        codifica_voce_fat<32>(dati, cluster, valore);
+        inizio = fine = 4 * cluster;
+        break;
+    }
+    // una voce da 12 bit puo' stare a cavallo di due settori
+    accendi_bit(settori, inizio / w->vol.byte_per_settore);
+    accendi_bit(settori, fine / w->vol.byte_per_settore);
+}
+
+
+/**
+ * imposta_fat cambia una voce della FAT in memoria, nella tabella
+ * decodificata e in quella grezza, e segna i settori da riscrivere. Un
+ * cluster che sul disco e' usato e qui si libera non torna tra i liberi:
+ * resta in attesa fino a salva_scrittura.
+ */
+inline void imposta_fat(ScritturaFat *w, uint32_t cluster, uint32_t valore)
+{
+    uint32_t attuale = w->fat->prossimo[cluster];
+    if (attuale != CLUSTER_LIBERO && !leggi_bit(&w->nuovi, cluster))
+        w->valori_su_disco.emplace(cluster, attuale);
+    codifica_fat(w, w->fat_grezza.data(), &w->settori_sporchi, cluster, valore);
+
+    if (attuale == CLUSTER_LIBERO && valore != CLUSTER_LIBERO)
+    {
+        w->numero_liberi--;
+        if (leggi_bit(&w->in_attesa, cluster))
+        {
+            spegni_bit(&w->in_attesa, cluster);
+            w->numero_in_attesa--;
+        }
+        else
+        {
+            spegni_bit(&w->liberi, cluster);
+            accendi_bit(&w->nuovi, cluster);
+        }
+    }
+    else if (attuale != CLUSTER_LIBERO && valore == CLUSTER_LIBERO)
+    {
+        w->numero_liberi++;
+        if (leggi_bit(&w->nuovi, cluster))
+        {
+            spegni_bit(&w->nuovi, cluster);
+            accendi_bit(&w->liberi, cluster);
+        }
+        else
+        {
+            accendi_bit(&w->in_attesa, cluster);
+            w->numero_in_attesa++;
+        }
+    }
+    w->fat->prossimo[cluster] = valore;
+}
+
+
+/**
+ * alloca_cluster prende il primo cluster libero a partire dal cursore
+ * (next-fit), 64 cluster per parola della mappa, e lo segna come fine
+ * catena. I cluster in attesa non sono nella mappa e non si prendono. Ripartire dall'ultimo allocato tiene contigui i file scritti uno
+ * dopo l'altro e non ripassa sulle parti gia' piene della FAT.
+ *
+ * @returns Il cluster, o 0 se il volume e' pieno
+ */
+inline uint32_t alloca_cluster(ScritturaFat *w)
+{
+    unsigned long numero_parole = (w->fat->numero_voci + 63) / 64;
+    unsigned long parola = w->cursore / 64;
+    uint64_t maschera = ~0ull << (w->cursore % 64);
+
+    for (unsigned long giri = 0; giri <= numero_parole; giri++)
+    {
+        uint64_t bit = w->liberi.parole[parola] & maschera;
+        if (bit)
+        {
+            uint32_t cluster = parola * 64 + __builtin_ctzll(bit);
+            if (cluster < w->fat->numero_voci)
+            {
+                imposta_fat(w, cluster, CLUSTER_FINE);
+                w->cursore = cluster + 1 < w->fat->numero_voci ? cluster + 1 : 2;
+                return cluster;
+            }
+        }
+        maschera = ~0ull;
+        parola = parola + 1 < numero_parole ? parola + 1 : 0;
+    }
+    return 0;
+}
+
+
+/**
+ * libera_catena libera tutti i cluster della catena che parte da cluster.
+ */
+inline void libera_catena(ScritturaFat *w, uint32_t cluster)
+{
+    unsigned long passi = 0;
+    while (cluster_valido(w->fat, cluster) && passi++ < w->fat->numero_voci)
+    {
+        uint32_t successivo = w->fat->prossimo[cluster];
+        imposta_fat(w, cluster, CLUSTER_LIBERO);
+        cluster = successivo;
+    }
+}
+
+
+/**
+ * estendi_catena aggiunge numero cluster dopo ultimo (0 per una catena
+ * nuova) e mette in cluster i loro numeri. Se il volume si riempie a meta'
+ * i cluster appena presi vengono restituiti.
+ *
+ * @returns 0 se tutti i cluster sono stati allocati, -1 altrimenti
+ */
+inline int estendi_catena(ScritturaFat *w, uint32_t ultimo, unsigned long numero, std::vector<uint32_t> &cluster)
+{
+    cluster.clear();
+    if (numero > w->numero_liberi - w->numero_in_attesa)
+        return -1;
+
+    uint32_t precedente = ultimo;
+    for (unsigned long i = 0; i < numero; i++)
+    {
+        uint32_t nuovo = alloca_cluster(w);
+        if (nuovo == 0)
+        {
+            for (uint32_t c : cluster)
+                imposta_fat(w, c, CLUSTER_LIBERO);
+            if (ultimo != 0)
+                imposta_fat(w, ultimo, CLUSTER_FINE);
+            cluster.clear();
+            return -1;
+        }
+        if (precedente != 0)
+            imposta_fat(w, precedente, nuovo);
+        cluster.push_back(nuovo);
+        precedente = nuovo;
+    }
+    return 0;
+}
+
+
+/**
+ * blocco_directory restituisce un blocco di directory, leggendolo dal disco
+ * la prima volta. Un cluster appena allocato si chiede con nuovo = 1 e
+ * parte azzerato senza leggere nulla.
+ */
+inline BloccoDirectory &blocco_directory(ScritturaFat *w, uint32_t cluster, int nuovo = 0)
+{
+    auto trovato = w->blocchi.find(cluster);
+    if (trovato != w->blocchi.end() && !nuovo)
+        return trovato->second;
+
+    BloccoDirectory &blocco = w->blocchi[cluster];
+    unsigned long byte = cluster == 0 ? w->vol.numero_righe_dir * 32 : w->vol.byte_per_cluster;
+    unsigned long posizione = cluster == 0 ? w->vol.inizio_root_dir : posizione_cluster(&w->vol, cluster);
+    blocco.dati.assign(byte, 0);
+    blocco.sporco = nuovo;
+    if (!nuovo)
+        pread_tutto(w->fd, blocco.dati.data(), byte, posizione);
+    return blocco;
+}
+
+
+// riga_directory restituisce la riga i della directory, eventualmente segnando il blocco come cambiato
+inline unsigned char *riga_directory(ScritturaFat *w, DirectoryScritta *d, unsigned long i, int cambia)
+{
+    BloccoDirectory &blocco = blocco_directory(w, d->blocchi[i / d->righe_per_blocco]);
+    blocco.sporco |= cambia;
+    return blocco.dati.data() + (i % d->righe_per_blocco) * 32;
+}
+
+
+inline std::string in_minuscolo(const std::string &nome)
+{
+    std::string minuscolo = nome;
+    for (char &c : minuscolo)
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+    return minuscolo;
+}
+
+
+/**
+ * carica_directory legge una volta sola tutte le righe di una directory e
+ * ne indicizza i nomi, cosi' le creazioni successive non la riscorrono.
+ */
+inline DirectoryScritta *carica_directory(ScritturaFat *w, uint32_t primo_cluster)
+{
+    auto trovata = w->directory.find(primo_cluster);
+    if (trovata != w->directory.end())
+        return &trovata->second;
+
+    DirectoryScritta &d = w->directory[primo_cluster];
+    d.primo_cluster = primo_cluster;
+    if (primo_cluster == 0)
+    {
+        d.blocchi.push_back(0);
+        d.righe_per_blocco = w->vol.numero_righe_dir;
+    }
+    else
+    {
+        IteratoreCatena catena = inizia_catena(w->fat, primo_cluster);
+        uint32_t cluster;
+        while ((cluster = prossimo_cluster(&catena)) != 0)
+            d.blocchi.push_back(cluster);
+        d.righe_per_blocco = w->vol.byte_per_cluster / 32;
+    }
+
+    unsigned long totale = d.blocchi.size() * d.righe_per_blocco;
+    d.prima_libera = totale;
+    d.fine = totale;
+    NomeLungo nome_lungo;
+    azzera_nome_lungo(&nome_lungo);
+    for (unsigned long i = 0; i < totale; i++)
+    {
+        const unsigned char *riga = riga_directory(w, &d, i, 0);
+        if (riga[0] == 0x00 || riga[0] == 0xe5)
+        {
+            if (d.prima_libera == totale)
+                d.prima_libera = i;
+            azzera_nome_lungo(&nome_lungo);
+            if (riga[0] == 0x00)
+            {
+                d.fine = i;
+                break;
+            }
+            continue;
+        }
+        if (riga_nome_lungo(riga))
+        {
+            aggiungi_frammento(&nome_lungo, riga);
+            continue;
+        }
+
+        // anche l'etichetta del volume occupa un nome 8.3
+        d.brevi.insert(std::string((const char *)riga, 11));
+        const char *lungo = concludi_nome_lungo(&nome_lungo, riga);
+        if (riga[0] == '.' || (riga[0x0b] & (ATTRIBUTO_ETICHETTA | ATTRIBUTO_DIRECTORY)) == ATTRIBUTO_ETICHETTA)
+            continue;
+
+        char breve[13];
+        nome_corto(riga, breve);
+        d.nomi[in_minuscolo(breve)] = i;
+        if (lungo != NULL)
+            d.nomi[in_minuscolo(lungo)] = i;
+    }
+    return &d;
+}
+
+
+/**
+ * risolvi_percorso divide un percorso in directory padre e ultimo nome,
+ * scendendo nelle directory intermedie.
+ *
+ * @returns La directory padre, o NULL se una directory intermedia non esiste
+ */
+inline DirectoryScritta *risolvi_percorso(ScritturaFat *w, const char *percorso, std::string &nome)
+{
+    std::vector<std::string> componenti;
+    std::string componente;
+    for (const char *p = percorso;; p++)
+    {
+        if (*p == '/' || *p == '\0')
+        {
+            if (!componente.empty())
+                componenti.push_back(componente);
+            componente.clear();
+            if (*p == '\0')
+                break;
+        }
+        else
+            componente += *p;
+    }
+    if (componenti.empty())
+        return NULL;
+
+    DirectoryScritta *d = carica_directory(w, w->vol.cluster_root);
+    for (size_t i = 0; i + 1 < componenti.size(); i++)
+    {
+        auto trovato = d->nomi.find(in_minuscolo(componenti[i]));
+        if (trovato == d->nomi.end())
+            return NULL;
+        const unsigned char *riga = riga_directory(w, d, trovato->second, 0);
+        Voce voce;
+        decodifica_voce(riga, 0, w->vol.tipo_fat, &voce);
+        if (!(voce.attributi & ATTRIBUTO_DIRECTORY) || !cluster_valido(w->fat, voce.primo_cluster))
+            return NULL;
+        d = carica_directory(w, voce.primo_cluster);
+    }
+    nome = componenti.back();
+    return d;
+}
+
+
+/**
+ * nome_valido dice se un nome si puo' usare come nome lungo: niente
+ * caratteri di controllo, niente caratteri riservati, non "." o "..".
+ */
+inline int nome_valido(const std::string &nome)
+{
+    if (nome.empty() || nome.size() > 255 || nome == "." || nome == "..")
+        return 0;
+    for (unsigned char c : nome)
+        if (c < 0x20 || strchr("\\/:*?\"<>|", c) != NULL)
+            return 0;
+    return 1;
+}
+
+
+// carattere_83 dice se un carattere e' ammesso in un nome 8.3
+inline int carattere_83(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c >= 0x80) || strchr("!#$%&'()-@^_`{}~", c) != NULL;
+}
+
+
+/**
+ * nome_breve_per sceglie il nome 8.3 di un nome nuovo. Se il nome e' gia' un
+ * 8.3 valido in maiuscolo si usa com'e' e non serve un nome lungo;
+ * altrimenti si prova NOME~1 ... NOME~4 e poi, come fa Windows, due
+ * caratteri piu' quattro cifre esadecimali ricavate dal nome, cosi' anche
+ * migliaia di nomi simili trovano subito un nome libero.
+ *
+ * @param corto Riceve gli 11 byte del nome
+ * @returns 1 se serve anche il nome lungo, 0 altrimenti, -1 se non c'e' un nome libero
+ */
+inline int nome_breve_per(const DirectoryScritta *d, const std::string &nome, unsigned char *corto)
+{
+    size_t punto = nome.rfind('.');
+    if (punto == 0)
+        punto = std::string::npos;
+    std::string radice = nome.substr(0, punto);
+    std::string estensione = punto == std::string::npos ? "" : nome.substr(punto + 1);
+
+    int esatto = radice.size() >= 1 && radice.size() <= 8 && estensione.size() <= 3 &&
+                 (punto == std::string::npos || !estensione.empty());
+    for (unsigned char c : radice + estensione)
+        esatto &= carattere_83(c) && c < 0x80;
+    if (esatto)
+    {
+        memset(corto, ' ', 11);
+        memcpy(corto, radice.data(), radice.size());
+        memcpy(corto + 8, estensione.data(), estensione.size());
+        return d->brevi.count(std::string((const char *)corto, 11)) ? -1 : 0;
+    }
+
+    auto pulisci = [](const std::string &testo, size_t massimo)
+    {
+        std::string pulito;
+        for (unsigned char c : testo)
+        {
+            if (pulito.size() == massimo)
+                break;
+            if (c == ' ' || c == '.')
+                continue;
+            if (c >= 'a' && c <= 'z')
+                c -= 'a' - 'A';
+            pulito += carattere_83(c) && c < 0x80 ? (char)c : '_';
+        }
+        return pulito;
+    };
+    std::string base = pulisci(radice, 8);
+    std::string est = pulisci(estensione, 3);
+    if (base.empty())
+        base = "_";
+
+    uint32_t impronta = 2166136261u;
+    for (unsigned char c : nome)
+        impronta = (impronta ^ c) * 16777619u;
+
+    for (unsigned long n = 1; n < 100000; n++)
+    {
+        std::string prova = base;
+        unsigned long numero = n;
+        if (n > 4)
+        {
+            char esadecimale[8];
+            snprintf(esadecimale, sizeof(esadecimale), "%04X", (impronta + (unsigned)((n - 5) / 9)) & 0xffff);
+            prova = base.substr(0, 2) + esadecimale;
+            numero = (n - 5) % 9 + 1;
+        }
+        std::string coda = "~" + std::to_string(numero);
+        prova = prova.substr(0, 8 - coda.size()) + coda;
+
+        memset(corto, ' ', 11);
+        memcpy(corto, prova.data(), prova.size());
+        memcpy(corto + 8, est.data(), est.size());
+        if (corto[0] == 0xe5)
+            corto[0] = 0x05;
+        if (!d->brevi.count(std::string((const char *)corto, 11)))
+            return 1;
+    }
+    return -1;
+}
+
+
+/**
+ * utf8_a_utf16 converte un nome UTF-8 nelle unita' UTF-16 del nome lungo.
+ *
+ * @returns Il numero di unita', o -1 se il nome non e' UTF-8 valido o e' troppo lungo
+ */
+inline int utf8_a_utf16(const std::string &nome, uint16_t *unita, int massimo)
+{
+    int n = 0;
+    for (size_t i = 0; i < nome.size();)
+    {
+        unsigned char c = nome[i];
+        uint32_t codice;
+        int seguito;
+        if (c < 0x80)
+            codice = c, seguito = 0;
+        else if ((c & 0xe0) == 0xc0)
+            codice = c & 0x1f, seguito = 1;
+        else if ((c & 0xf0) == 0xe0)
+            codice = c & 0x0f, seguito = 2;
+        else if ((c & 0xf8) == 0xf0)
+            codice = c & 0x07, seguito = 3;
+        else
+            return -1;
+        if (i + seguito >= nome.size())
+            return -1;
+        for (int k = 1; k <= seguito; k++)
+        {
+            if ((nome[i + k] & 0xc0) != 0x80)
+                return -1;
+            codice = (codice << 6) | (nome[i + k] & 0x3f);
+        }
+        i += 1 + seguito;
+
+        if (codice >= 0x10000)
+        {
+            if (n + 2 > massimo)
+                return -1;
+            codice -= 0x10000;
+            unita[n++] = 0xd800 | (codice >> 10);
+            unita[n++] = 0xdc00 | (codice & 0x3ff);
+        }
+        else
+        {
+            if (n + 1 > massimo)
+                return -1;
+            unita[n++] = codice;
+        }
+    }
+    return n;
+}
+
+
+// data_ora_fat restituisce data e orario locali di adesso nel formato della FAT
+inline void data_ora_fat(uint16_t *data, uint16_t *orario, unsigned char *centesimi)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    struct tm ora;
+    localtime_r(&t.tv_sec, &ora);
+
+    int anno = ora.tm_year + 1900 < 1980 ? 1980 : ora.tm_year + 1900;
+    *data = ((anno - 1980) << 9) | ((ora.tm_mon + 1) << 5) | ora.tm_mday;
+    *orario = (ora.tm_hour << 11) | (ora.tm_min << 5) | (ora.tm_sec / 2);
+    *centesimi = (ora.tm_sec % 2) * 100 + t.tv_nsec / 10000000;
+}
+
+
+/**
+ * righe_libere trova numero righe libere consecutive, anche a cavallo di
+ * due cluster, allungando la directory di un cluster azzerato se serve.
+ * La root ad area fissa di FAT12 e FAT16 non si puo' allungare.
+ *
+ * @returns L'indice della prima riga, o -1 se non c'e' spazio
+ */
+inline long righe_libere(ScritturaFat *w, DirectoryScritta *d, unsigned long numero)
+{
+    unsigned long inizio = d->prima_libera, trovate = 0;
+    for (unsigned long i = d->prima_libera;; i++)
+    {
+        if (i == d->blocchi.size() * d->righe_per_blocco)
+        {
+            std::vector<uint32_t> nuovo;
+            // una directory non puo' superare le 65536 righe
+            if (d->primo_cluster == 0 || i >= 65536 || estendi_catena(w, d->blocchi.back(), 1, nuovo) != 0)
+                return -1;
+            blocco_directory(w, nuovo[0], 1);
+            d->blocchi.push_back(nuovo[0]);
+        }
+
+        const unsigned char *riga = riga_directory(w, d, i, 0);
+        if (i < d->fine && riga[0] != 0x00 && riga[0] != 0xe5)
+        {
+            trovate = 0;
+            continue;
+        }
+        if (trovate++ == 0)
+            inizio = i;
+        if (trovate == numero)
+            break;
+    }
+
+    if (inizio == d->prima_libera)
+        d->prima_libera = inizio + numero;
+
+    // scrivendo oltre la fine si sposta la riga 0x00 dopo le righe nuove
+    if (inizio + numero > d->fine)
+    {
+        d->fine = inizio + numero;
+        if (d->fine < d->blocchi.size() * d->righe_per_blocco)
+            riga_directory(w, d, d->fine, 1)[0] = 0x00;
+    }
+    return inizio;
+}
+
+
+/**
+ * aggiungi_voce scrive nella directory una voce nuova, con il nome lungo
+ * se serve, e la aggiunge all'indice dei nomi.
+ *
+ * @returns L'indice della riga 8.3, o -1 in caso di errore
+ */
+inline long aggiungi_voce(ScritturaFat *w, DirectoryScritta *d, const std::string &nome,
+                          unsigned char attributi, uint32_t primo_cluster)
+{
+    unsigned char corto[11];
+    int serve_lungo = nome_breve_per(d, nome, corto);
+    if (serve_lungo < 0)
+        return -1;
+
+    uint16_t unita[FRAMMENTI_NOME_LUNGO * CARATTERI_PER_FRAMMENTO];
+    int numero_unita = serve_lungo ? utf8_a_utf16(nome, unita, FRAMMENTI_NOME_LUNGO * CARATTERI_PER_FRAMMENTO) : 0;
+    if (numero_unita < 0)
+        return -1;
+    unsigned long frammenti = (numero_unita + CARATTERI_PER_FRAMMENTO - 1) / CARATTERI_PER_FRAMMENTO;
+
+    long inizio = righe_libere(w, d, frammenti + 1);
+    if (inizio < 0)
+        return -1;
+
+    // i frammenti vanno dall'ultimo al primo, poi la riga 8.3
+    static const int posizioni[CARATTERI_PER_FRAMMENTO] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+    unsigned char checksum = checksum_nome_corto(corto);
+    for (unsigned long k = frammenti; k >= 1; k--)
+    {
+        unsigned char *riga = riga_directory(w, d, inizio + frammenti - k, 1);
+        memset(riga, 0, 32);
+        riga[0] = k | (k == frammenti ? 0x40 : 0);
+        riga[0x0b] = ATTRIBUTO_NOME_LUNGO;
+        riga[0x0d] = checksum;
+        for (int i = 0; i < CARATTERI_PER_FRAMMENTO; i++)
+        {
+            long indice = (k - 1) * CARATTERI_PER_FRAMMENTO + i;
+            scrivi_16(riga + posizioni[i], indice < numero_unita ? unita[indice] : indice == numero_unita ? 0x0000 : 0xffff);
+        }
+    }
+
+    unsigned long indice = inizio + frammenti;
+    unsigned char *riga = riga_directory(w, d, indice, 1);
+    uint16_t data, orario;
+    unsigned char centesimi;
+    data_ora_fat(&data, &orario, &centesimi);
+    memset(riga, 0, 32);
+    memcpy(riga, corto, 11);
+    riga[0x0b] = attributi;
+    riga[0x0d] = centesimi;
+    scrivi_16(riga + 0x0e, orario);
+    scrivi_16(riga + 0x10, data);
+    scrivi_16(riga + 0x12, data);
+    scrivi_16(riga + 0x14, w->vol.tipo_fat == 32 ? primo_cluster >> 16 : 0);
+    scrivi_16(riga + 0x16, orario);
+    scrivi_16(riga + 0x18, data);
+    scrivi_16(riga + 0x1a, primo_cluster & 0xffff);
+
+    char breve[13];
+    nome_corto(riga, breve);
+    d->brevi.insert(std::string((const char *)corto, 11));
+    d->nomi[in_minuscolo(breve)] = indice;
+    d->nomi[in_minuscolo(nome)] = indice;
+    return indice;
+}
+
+
+// aggiorna_voce riscrive primo cluster, dimensione e data di modifica di una riga 8.3
+inline void aggiorna_voce(ScritturaFat *w, DirectoryScritta *d, unsigned long indice,
+                          uint32_t primo_cluster, unsigned long dimensione)
+{
+    unsigned char *riga = riga_directory(w, d, indice, 1);
+    uint16_t data, orario;
+    unsigned char centesimi;
+    data_ora_fat(&data, &orario, &centesimi);
+    scrivi_16(riga + 0x12, data);
+    scrivi_16(riga + 0x14, w->vol.tipo_fat == 32 ? primo_cluster >> 16 : 0);
+    scrivi_16(riga + 0x16, orario);
+    scrivi_16(riga + 0x18, data);
+    scrivi_16(riga + 0x1a, primo_cluster & 0xffff);
+    scrivi_32(riga + 0x1c, dimensione);
+}
+
+
+/**
+ * trova_file cerca un file (non una directory) e ne decodifica la riga.
+ *
+ * @returns 0 se il file esiste, -1 altrimenti
+ */
+inline int trova_file(ScritturaFat *w, const char *percorso, DirectoryScritta **d, unsigned long *indice, Voce *voce)
+{
+    std::string nome;
+    *d = risolvi_percorso(w, percorso, nome);
+    if (*d == NULL)
+        return -1;
+    auto trovato = (*d)->nomi.find(in_minuscolo(nome));
+    if (trovato == (*d)->nomi.end())
+        return -1;
+    *indice = trovato->second;
+    decodifica_voce(riga_directory(w, *d, *indice, 0), 0, w->vol.tipo_fat, voce);
+    return voce->attributi & ATTRIBUTO_DIRECTORY ? -1 : 0;
+}
+
+
+/**
+ * crea_directory crea una directory, e le directory intermedie mancanti,
+ * con le righe "." e "..". Una directory che esiste gia' va bene.
+ *
+ * @returns 0 se la directory esiste alla fine, -1 altrimenti
+ */
+inline int crea_directory(ScritturaFat *w, const char *percorso)
+{
+    std::string parziale;
+    for (const char *p = percorso;; p++)
+    {
+        if ((*p == '/' || *p == '\0') && !parziale.empty() && parziale != "/")
+        {
+            std::string nome;
+            DirectoryScritta *padre = risolvi_percorso(w, parziale.c_str(), nome);
+            if (padre == NULL || !nome_valido(nome))
+                return -1;
+
+            auto trovato = padre->nomi.find(in_minuscolo(nome));
+            if (trovato != padre->nomi.end())
+            {
+                if (!(riga_directory(w, padre, trovato->second, 0)[0x0b] & ATTRIBUTO_DIRECTORY))
+                    return -1;
+            }
+            else
+            {
+                std::vector<uint32_t> cluster;
+                if (estendi_catena(w, 0, 1, cluster) != 0)
+                    return -1;
+                if (aggiungi_voce(w, padre, nome, ATTRIBUTO_DIRECTORY, cluster[0]) < 0)
+                {
+                    libera_catena(w, cluster[0]);
+                    return -1;
+                }
+
+                // ".." vale 0 quando il padre e' la root
+                uint32_t cluster_padre = padre->primo_cluster == w->vol.cluster_root ? 0 : padre->primo_cluster;
+                BloccoDirectory &blocco = blocco_directory(w, cluster[0], 1);
+                static const unsigned char punto[11] = {'.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '};
+                static const unsigned char due_punti[11] = {'.', '.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '};
+                scrivi_riga(blocco.dati.data(), punto, ATTRIBUTO_DIRECTORY, cluster[0], 0);
+                scrivi_riga(blocco.dati.data() + 32, due_punti, ATTRIBUTO_DIRECTORY, cluster_padre, 0);
+            }
+        }
+        if (*p == '\0')
+            break;
+        parziale += *p;
+    }
+    return 0;
+}
+
+
+/**
+ * scrivi_in_file scrive count byte dal byte offset di un file, che deve
+ * essere gia' allocato fino a offset + count. I cluster contigui si
+ * scrivono con una sola pwrite.
+ */
+inline int scrivi_in_file(ScritturaFat *w, uint32_t primo_cluster, unsigned long offset,
+                          const unsigned char *dati, unsigned long count)
+{
+    unsigned long byte_per_cluster = w->vol.byte_per_cluster;
+    IteratoreCatena catena = inizia_catena(w->fat, primo_cluster);
+    Estensione estensione;
+    unsigned long inizio_estensione = 0;
+
+    while (count > 0 && prossima_estensione(&catena, &estensione))
+    {
+        unsigned long lunghezza = (unsigned long)estensione.lunghezza * byte_per_cluster;
+        if (offset < inizio_estensione + lunghezza)
+        {
+            unsigned long dentro = offset - inizio_estensione;
+            unsigned long quanti = lunghezza - dentro < count ? lunghezza - dentro : count;
+            if (pwrite_tutto(w->fd, dati, quanti, posizione_cluster(&w->vol, estensione.inizio) + dentro) != 0)
+                return -1;
+            w->scritture++;
+            dati += quanti;
+            offset += quanti;
+            count -= quanti;
+        }
+        inizio_estensione += lunghezza;
+    }
+    return count == 0 ? 0 : -1;
+}
+
+
+/**
+ * cluster_del_file conta i cluster di un file e trova l'ultimo.
+ */
+inline unsigned long cluster_del_file(const ScritturaFat *w, uint32_t primo_cluster, uint32_t *ultimo)
+{
+    unsigned long numero = 0;
+    *ultimo = 0;
+    IteratoreCatena catena = inizia_catena(w->fat, primo_cluster);
+    uint32_t cluster;
+    while ((cluster = prossimo_cluster(&catena)) != 0)
+    {
+        *ultimo = cluster;
+        numero++;
+    }
+    return numero;
+}
+
+
+/**
+ * ridimensiona porta la catena di un file al numero di cluster che serve
+ * per dimensione byte, allungandola o liberandone la coda.
+ *
+ * @returns 0 in caso di successo, -1 se il volume e' pieno
+ */
+inline int ridimensiona(ScritturaFat *w, uint32_t *primo_cluster, unsigned long dimensione)
+{
+    unsigned long servono = (dimensione + w->vol.byte_per_cluster - 1) / w->vol.byte_per_cluster;
+    uint32_t ultimo;
+    unsigned long presenti = cluster_del_file(w, *primo_cluster, &ultimo);
+
+    if (servono > presenti)
+    {
+        std::vector<uint32_t> nuovi;
+        if (estendi_catena(w, ultimo, servono - presenti, nuovi) != 0)
+            return -1;
+        if (presenti == 0)
+            *primo_cluster = nuovi[0];
+        return 0;
+    }
+    if (servono == presenti)
+        return 0;
+
+    if (servono == 0)
+    {
+        libera_catena(w, *primo_cluster);
+        *primo_cluster = 0;
+        return 0;
+    }
+    uint32_t cluster = *primo_cluster;
+    for (unsigned long i = 1; i < servono; i++)
+        cluster = w->fat->prossimo[cluster];
+    libera_catena(w, w->fat->prossimo[cluster]);
+    imposta_fat(w, cluster, CLUSTER_FINE);
+    return 0;
+}
+
+
+/**
+ * aggiungi_a_file scrive dati in coda a un file, allocando i cluster che
+ * mancano.
+ *
+ * @returns 0 in caso di successo, -1 altrimenti
+ */
+inline int aggiungi_a_file(ScritturaFat *w, const char *percorso, const unsigned char *dati, unsigned long count)
+{
+    DirectoryScritta *d;
+    unsigned long indice;
+    Voce voce;
+    if (trova_file(w, percorso, &d, &indice, &voce) != 0)
+        return -1;
+    if (count == 0)
+        return 0;
+    if (voce.dimensione + count > 0xffffffffull)
+        return -1;
+
+    uint32_t primo = voce.primo_cluster;
+    if (ridimensiona(w, &primo, voce.dimensione + count) != 0 ||
+        scrivi_in_file(w, primo, voce.dimensione, dati, count) != 0)
+        return -1;
+    aggiorna_voce(w, d, indice, primo, voce.dimensione + count);
+    return 0;
+}
+
+
+/**
+ * tronca_file porta un file a dimensione byte: accorciandolo libera i
+ * cluster in piu', allungandolo scrive zeri nella parte nuova.
+ *
+ * @returns 0 in caso di successo, -1 altrimenti
+ */
+inline int tronca_file(ScritturaFat *w, const char *percorso, unsigned long dimensione)
+{
+    DirectoryScritta *d;
+    unsigned long indice;
+    Voce voce;
+    if (trova_file(w, percorso, &d, &indice, &voce) != 0 || dimensione > 0xffffffffull)
+        return -1;
+
+    uint32_t primo = voce.primo_cluster;
+    if (ridimensiona(w, &primo, dimensione) != 0)
+        return -1;
+
+    static const unsigned char zeri[DIMENSIONE_ZERI] = {0};
+    for (unsigned long offset = voce.dimensione; offset < dimensione; offset += DIMENSIONE_ZERI)
+    {
+        unsigned long quanti = dimensione - offset < DIMENSIONE_ZERI ? dimensione - offset : DIMENSIONE_ZERI;
+        if (scrivi_in_file(w, primo, offset, zeri, quanti) != 0)
+            return -1;
+    }
+    aggiorna_voce(w, d, indice, primo, dimensione);
+    return 0;
+}
+
+
+/**
+ * crea_file crea un file vuoto nella sua directory, che deve esistere.
+ * Un file che esiste gia' viene svuotato, come con O_TRUNC.
+ *
+ * @returns 0 in caso di successo, -1 altrimenti
+ */
+inline int crea_file(ScritturaFat *w, const char *percorso)
+{
+    std::string nome;
+    DirectoryScritta *d = risolvi_percorso(w, percorso, nome);
+    if (d == NULL || !nome_valido(nome))
+        return -1;
+
+    if (d->nomi.count(in_minuscolo(nome)))
+        return tronca_file(w, percorso, 0);
+    return aggiungi_voce(w, d, nome, ATTRIBUTO_ARCHIVIO, 0) < 0 ? -1 : 0;
+}
+
+
+/**
+ * scrivi_settori_fat scrive in ognuna delle numero_fat copie i settori
+ * segnati in settori, presi da dati; i settori consecutivi con una sola
+ * pwrite.
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+inline int scrivi_settori_fat(ScritturaFat *w, const unsigned char *dati, const MappaBit *settori)
+{
+    int ret = 0;
+    unsigned long byte_per_settore = w->vol.byte_per_settore;
+    unsigned long numero_settori = w->vol.bytes_per_fat / byte_per_settore;
+    for (unsigned long s = 0; s < numero_settori; s++)
+    {
+        if (!leggi_bit(settori, s))
+            continue;
+        unsigned long fine = s;
+        while (fine + 1 < numero_settori && leggi_bit(settori, fine + 1))
+            fine++;
+        for (unsigned long copia = 0; copia < w->vol.numero_fat; copia++)
+        {
+            ret |= pwrite_tutto(w->fd, dati + s * byte_per_settore, (fine - s + 1) * byte_per_settore,
+                                w->vol.inizio_area_fat + copia * w->vol.bytes_per_fat + s * byte_per_settore);
+            w->scritture++;
+        }
+        s = fine;
+    }
+    return ret;
+}
+
+
+/**
+ * salva_scrittura scrive sul disco tutte le modifiche accumulate, in
+ * quattro fasi separate da un fsync:
+ *   1. la FAT con le allocazioni e le catene cambiate, ma con i cluster
+ *      liberati ancora al valore che avevano sul disco;
+ *   2. i blocchi di directory cambiati;
+ *   3. i settori della FAT con i cluster liberati;
+ *   4. su FAT32, il conteggio dei cluster liberi nell'FSInfo.
+ * Se la scrittura si interrompe restano al piu' cluster usati che nessuna
+ * directory raggiunge, che check segnala come catene perse, mai righe di
+ * directory che puntano a cluster liberi e che si potrebbero allocare due
+ * volte. Dopo il salvataggio i cluster in attesa tornano allocabili. Le
+ * modifiche salvate non si scrivono di nuovo a un salvataggio successivo.
+ *
+ * @returns 0 se tutto e' stato scritto, -1 altrimenti
+ */
+inline int salva_scrittura(ScritturaFat *w)
+{
+    int ret = 0;
+    unsigned long byte_per_settore = w->vol.byte_per_settore;
+    unsigned long numero_settori = w->vol.bytes_per_fat / byte_per_settore;
+    MappaBit liberati;
+    if (crea_mappa_bit(&liberati, numero_settori + 1) != 0)
+        return -1;
+
+    if (w->numero_in_attesa == 0)
+        ret = scrivi_settori_fat(w, w->fat_grezza.data(), &w->settori_sporchi);
+    else
+    {
+        // i cluster liberati restano usati finche' le directory non sono salvate
+        std::vector<unsigned char> senza_liberati(w->fat_grezza);
+        for (const auto &v : w->valori_su_disco)
+            if (leggi_bit(&w->in_attesa, v.first))
+                codifica_fat(w, senza_liberati.data(), &liberati, v.first, v.second);
+        ret = scrivi_settori_fat(w, senza_liberati.data(), &w->settori_sporchi);
+    }
+    memset(w->settori_sporchi.parole, 0, (w->settori_sporchi.numero_bit + 63) / 64 * sizeof(uint64_t));
+    if (ret != 0 || fsync(w->fd) != 0)
+    {
+        distruggi_mappa_bit(&liberati);
+        return -1;
+    }
+
+    for (auto &b : w->blocchi)
+    {
+        if (!b.second.sporco)
+            continue;
+        unsigned long posizione = b.first == 0 ? w->vol.inizio_root_dir : posizione_cluster(&w->vol, b.first);
+        ret |= pwrite_tutto(w->fd, b.second.dati.data(), b.second.dati.size(), posizione);
+        b.second.sporco = 0;
+        w->scritture++;
+    }
+    if (ret != 0 || fsync(w->fd) != 0)
+    {
+        distruggi_mappa_bit(&liberati);
+        return -1;
+    }
+
+    if (w->numero_in_attesa > 0)
+    {
+        ret = scrivi_settori_fat(w, w->fat_grezza.data(), &liberati);
+        if (ret != 0 || fsync(w->fd) != 0)
+        {
+            // i settori restano da riscrivere al prossimo salvataggio
+            for (unsigned long i = 0; i < (liberati.numero_bit + 63) / 64; i++)
+                w->settori_sporchi.parole[i] |= liberati.parole[i];
+            distruggi_mappa_bit(&liberati);
+            return -1;
+        }
+
+        // ora nessuna riga salvata usa piu' i cluster in attesa
+        for (unsigned long i = 0; i < (w->in_attesa.numero_bit + 63) / 64; i++)
+            w->liberi.parole[i] |= w->in_attesa.parole[i];
+        memset(w->in_attesa.parole, 0, (w->in_attesa.numero_bit + 63) / 64 * sizeof(uint64_t));
+        w->numero_in_attesa = 0;
+    }
+    distruggi_mappa_bit(&liberati);
+    memset(w->nuovi.parole, 0, (w->nuovi.numero_bit + 63) / 64 * sizeof(uint64_t));
+    w->valori_su_disco.clear();
+
+    if (w->vol.tipo_fat == 32)
+    {
+        unsigned char settore[512];
+        unsigned long info = 0;
+        if (pread_tutto(w->fd, settore, 512, w->vol.inizio_partizione) == 512)
+            info = w->vol.inizio_partizione + (settore[0x30] | (settore[0x31] << 8)) * byte_per_settore;
+        if (info != 0 && pread_tutto(w->fd, settore, 512, info) == 512 &&
+            memcmp(settore, "RRaA", 4) == 0 && memcmp(settore + 484, "rrAa", 4) == 0)
+        {
+            scrivi_32(settore + 488, w->numero_liberi);
+            scrivi_32(settore + 492, w->cursore);
+            ret |= pwrite_tutto(w->fd, settore, 512, info);
+            w->scritture++;
+        }
+    }
+    if (fsync(w->fd) != 0)
+        ret = -1;
+    return ret ? -1 : 0;
+}
+
+
+/**
+ * chiudi_scrittura chiude l'immagine. Le modifiche non salvate con
+ * salva_scrittura si perdono e l'immagine resta com'era, a parte il
+ * contenuto scritto nei cluster che erano liberi.
+ */
+inline void chiudi_scrittura(ScritturaFat *w)
+{
+    close(w->fd);
+    distruggi_mappa_bit(&w->liberi);
+    distruggi_mappa_bit(&w->in_attesa);
+    distruggi_mappa_bit(&w->nuovi);
+    distruggi_mappa_bit(&w->settori_sporchi);
+    distruggi_tabella_fat(w->fat);
+    delete w;
+}
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef STATISTICHE_H
+#define STATISTICHE_H
+
+#include <stdint.h>
+
+#include "fat.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STATISTICHE_X86 1
+#endif
+
+
+// StatisticheFat riassume lo stato dei cluster dell'area dati
+typedef struct
+{
+    unsigned long totali;
+    unsigned long liberi;
+    unsigned long danneggiati;
+
+    // Cluster con cui finisce una catena: uno per ogni file o directory non vuoti
+    unsigned long fine_catena;
+
+    // Cluster occupati, compresi quelli di fine catena
+    unsigned long usati;
+} StatisticheFat;
+
+
+inline void conta_scalare(const uint32_t *voci, unsigned long numero,
+                          unsigned long *liberi, unsigned long *danneggiati, unsigned long *fine)
+{
+    for (unsigned long c = 0; c < numero; c++)
+    {
+        *liberi += voci[c] == CLUSTER_LIBERO;
+        *danneggiati += voci[c] == CLUSTER_DANNEGGIATO;
+        *fine += voci[c] == CLUSTER_FINE;
+    }
+}
+
+
+#ifdef STATISTICHE_X86
+
+/**
+ * conta_sse2 confronta quattro voci alla volta. Ogni confronto vale -1 per
+ * le voci uguali, quindi sottrarlo dai contatori conta le corrispondenze.
+ */
+inline void conta_sse2(const uint32_t *voci, unsigned long numero,
+                       unsigned long *liberi, unsigned long *danneggiati, unsigned long *fine)
+{
+    const __m128i libero = _mm_set1_epi32(CLUSTER_LIBERO);
+    const __m128i danneggiato = _mm_set1_epi32(CLUSTER_DANNEGGIATO);
+    const __m128i fine_catena = _mm_set1_epi32(CLUSTER_FINE);
+
+    unsigned long c = 0;
+    while (c + 4 <= numero)
+    {
+        // i contatori a 32 bit si svuotano prima che possano traboccare
+        unsigned long blocco = numero - c;
+        if (blocco > (1ul << 30))
+            blocco = 1ul << 30;
+        blocco &= ~3ul;
+
+        __m128i n_liberi = _mm_setzero_si128();
+        __m128i n_danneggiati = _mm_setzero_si128();
+        __m128i n_fine = _mm_setzero_si128();
+        for (unsigned long fine_blocco = c + blocco; c < fine_blocco; c += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(voci + c));
+            n_liberi = _mm_sub_epi32(n_liberi, _mm_cmpeq_epi32(v, libero));
+            n_danneggiati = _mm_sub_epi32(n_danneggiati, _mm_cmpeq_epi32(v, danneggiato));
+            n_fine = _mm_sub_epi32(n_fine, _mm_cmpeq_epi32(v, fine_catena));
+        }
+
+        uint32_t parziali[4];
+        _mm_storeu_si128((__m128i *)parziali, n_liberi);
+        *liberi += (unsigned long)parziali[0] + parziali[1] + parziali[2] + parziali[3];
+        _mm_storeu_si128((__m128i *)parziali, n_danneggiati);
+        *danneggiati += (unsigned long)parziali[0] + parziali[1] + parziali[2] + parziali[3];
+        _mm_storeu_si128((__m128i *)parziali, n_fine);
+        *fine += (unsigned long)parziali[0] + parziali[1] + parziali[2] + parziali[3];
+    }
+
+    conta_scalare(voci + c, numero - c, liberi, danneggiati, fine);
+}
+
+
+/**
+ * conta_avx2 e' come conta_sse2 ma con otto voci alla volta.
+ */
+__attribute__((target("avx2"))) inline void conta_avx2(const uint32_t *voci, unsigned long numero,
+                                                        unsigned long *liberi, unsigned long *danneggiati, unsigned long *fine)
+{
+    const __m256i libero = _mm256_set1_epi32(CLUSTER_LIBERO);
+    const __m256i danneggiato = _mm256_set1_epi32(CLUSTER_DANNEGGIATO);
+    const __m256i fine_catena = _mm256_set1_epi32(CLUSTER_FINE);
+
+    unsigned long c = 0;
+    while (c + 8 <= numero)
+    {
+        unsigned long blocco = numero - c;
+        if (blocco > (1ul << 30))
+            blocco = 1ul << 30;
+        blocco &= ~7ul;
+
+        __m256i n_liberi = _mm256_setzero_si256();
+        __m256i n_danneggiati = _mm256_setzero_si256();
+        __m256i n_fine = _mm256_setzero_si256();
+        for (unsigned long fine_blocco = c + blocco; c < fine_blocco; c += 8)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(voci + c));
+            n_liberi = _mm256_sub_epi32(n_liberi, _mm256_cmpeq_epi32(v, libero));
+            n_danneggiati = _mm256_sub_epi32(n_danneggiati, _mm256_cmpeq_epi32(v, danneggiato));
+            n_fine = _mm256_sub_epi32(n_fine, _mm256_cmpeq_epi32(v, fine_catena));
+        }
+
+        uint32_t parziali[8];
+        _mm256_storeu_si256((__m256i *)parziali, n_liberi);
+        for (int i = 0; i < 8; i++)
+            *liberi += parziali[i];
+        _mm256_storeu_si256((__m256i *)parziali, n_danneggiati);
+        for (int i = 0; i < 8; i++)
+            *danneggiati += parziali[i];
+        _mm256_storeu_si256((__m256i *)parziali, n_fine);
+        for (int i = 0; i < 8; i++)
+            *fine += parziali[i];
+    }
+
+    conta_scalare(voci + c, numero - c, liberi, danneggiati, fine);
+}
+
+#endif
+
+
+/**
+ * calcola_statistiche conta in una sola passata sulla FAT in memoria i
+ * cluster liberi, danneggiati e di fine catena.
+ *
+ * @param fat La FAT caricata, non deve essere NULL
+ * @param stat Le statistiche da riempire, non deve essere NULL
+ *
+ * @returns -1 in caso di errore, 0 altrimenti
+ */
+inline int calcola_statistiche(const TabellaFat *fat, StatisticheFat *stat)
+{
+    if (fat == NULL || stat == NULL)
+        return -1;
+
+    memset(stat, 0, sizeof(StatisticheFat));
+    if (fat->numero_voci <= 2)
+        return 0;
+
+    // le voci 0 e 1 non corrispondono a cluster
+    const uint32_t *voci = fat->prossimo + 2;
+    stat->totali = fat->numero_voci - 2;
+
+#ifdef STATISTICHE_X86
+    if (__builtin_cpu_supports("avx2"))
+        conta_avx2(voci, stat->totali, &stat->liberi, &stat->danneggiati, &stat->fine_catena);
+    else
+        conta_sse2(voci, stat->totali, &stat->liberi, &stat->danneggiati, &stat->fine_catena);
+#else
+    conta_scalare(voci, stat->totali, &stat->liberi, &stat->danneggiati, &stat->fine_catena);
+#endif
+
+    stat->usati = stat->totali - stat->liberi - stat->danneggiati;
+    return 0;
+}
+
+#endif
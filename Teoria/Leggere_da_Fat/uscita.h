@@ -0,0 +1,375 @@
+#ifndef USCITA_H
+#define USCITA_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esplora.h"
+
+
+// La capacita' del buffer: le write partono solo quando e' pieno
+#define DIMENSIONE_BUFFER_USCITA (1 << 20)
+
+// Lo spazio che una scrittura di un campo a lunghezza fissa puo' chiedere
+#define MARGINE_USCITA 64
+
+
+// Formati dei record
+enum FormatoUscita
+{
+    FORMATO_JSONL,
+    FORMATO_CSV
+};
+
+
+// BufferUscita accumula i record e li scrive sul descrittore a blocchi
+// grandi, senza passare da stdio e dal suo lock
+typedef struct
+{
+    int fd;
+    char *dati;
+    unsigned long usati;
+
+    // 1 se una write e' fallita: da li' in poi si scarta tutto
+    int errore;
+} BufferUscita;
+
+
+inline int crea_buffer_uscita(BufferUscita *out, int fd)
+{
+    out->fd = fd;
+    out->usati = 0;
+    out->errore = 0;
+    out->dati = (char *)malloc(DIMENSIONE_BUFFER_USCITA);
+    return out->dati == NULL ? -1 : 0;
+}
+
+
+/**
+ * svuota_uscita scrive tutto il contenuto del buffer, ripetendo le
+ * scritture parziali.
+ *
+ * @returns 0 se tutto e' stato scritto, -1 altrimenti
+ */
+inline int svuota_uscita(BufferUscita *out)
+{
+    unsigned long scritti = 0;
+    while (scritti < out->usati && !out->errore)
+    {
+        ssize_t n = write(out->fd, out->dati + scritti, out->usati - scritti);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            out->errore = 1;
+        else
+            scritti += n;
+    }
+    out->usati = 0;
+    return out->errore ? -1 : 0;
+}
+
+
+// distruggi_buffer_uscita svuota il buffer e lo libera
+inline int distruggi_buffer_uscita(BufferUscita *out)
+{
+    int ret = svuota_uscita(out);
+    free(out->dati);
+    out->dati = NULL;
+    return ret;
+}
+
+
+// riserva garantisce che ci siano almeno spazio byte liberi in coda
+inline char *riserva(BufferUscita *out, unsigned long spazio)
+{
+    if (DIMENSIONE_BUFFER_USCITA - out->usati < spazio)
+        svuota_uscita(out);
+    return out->dati + out->usati;
+}
+
+
+inline void scrivi_testo(BufferUscita *out, const char *testo, unsigned long lunghezza)
+{
+    while (lunghezza > 0)
+    {
+        if (out->usati == DIMENSIONE_BUFFER_USCITA)
+            svuota_uscita(out);
+        unsigned long quanti = DIMENSIONE_BUFFER_USCITA - out->usati;
+        if (quanti > lunghezza)
+            quanti = lunghezza;
+        memcpy(out->dati + out->usati, testo, quanti);
+        out->usati += quanti;
+        testo += quanti;
+        lunghezza -= quanti;
+    }
+}
+
+
+/**
+ * scrivi_cifre scrive n in decimale in dest, due cifre per volta da una
+ * tabella, invece di una divisione per cifra come snprintf.
+ *
+ * @returns Il numero di caratteri scritti
+ */
+inline int scrivi_cifre(char *dest, uint64_t n)
+{
+    static const char coppie[201] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+    char cifre[20];
+    int i = 20;
+    while (n >= 100)
+    {
+        unsigned resto = n % 100;
+        n /= 100;
+        i -= 2;
+        memcpy(cifre + i, coppie + resto * 2, 2);
+    }
+    if (n >= 10)
+    {
+        i -= 2;
+        memcpy(cifre + i, coppie + n * 2, 2);
+    }
+    else
+        cifre[--i] = '0' + n;
+
+    memcpy(dest, cifre + i, 20 - i);
+    return 20 - i;
+}
+
+
+inline void scrivi_intero(BufferUscita *out, uint64_t n)
+{
+    char *dest = riserva(out, MARGINE_USCITA);
+    out->usati += scrivi_cifre(dest, n);
+}
+
+
+// due_cifre scrive un numero da 0 a 99 sempre con due cifre
+inline void due_cifre(char *dest, unsigned n)
+{
+    dest[0] = '0' + n / 10;
+    dest[1] = '0' + n % 10;
+}
+
+
+/**
+ * scrivi_data_ora scrive una data e un orario della FAT in formato ISO 8601,
+ * ad esempio "2024-03-01T12:30:08.450". I centesimi oltre 100 aggiungono un
+ * secondo, come nella creazione; modifica e ultimo accesso non li hanno.
+ */
+inline void scrivi_data_ora(BufferUscita *out, uint16_t data, uint16_t orario, int centesimi)
+{
+    char *dest = riserva(out, MARGINE_USCITA);
+
+    unsigned secondi = (orario & 0x1f) * 2;
+    unsigned millisecondi = 0;
+    if (centesimi >= 0)
+    {
+        millisecondi = centesimi * 10;
+        secondi += millisecondi / 1000;
+        millisecondi %= 1000;
+    }
+
+    unsigned anno = ((data >> 9) & 0x7f) + 1980;
+    due_cifre(dest, anno / 100);
+    due_cifre(dest + 2, anno % 100);
+    dest[4] = '-';
+    due_cifre(dest + 5, (data >> 5) & 0x0f);
+    dest[7] = '-';
+    due_cifre(dest + 8, data & 0x1f);
+    dest[10] = 'T';
+    due_cifre(dest + 11, orario >> 11);
+    dest[13] = ':';
+    due_cifre(dest + 14, (orario >> 5) & 0x3f);
+    dest[16] = ':';
+    due_cifre(dest + 17, secondi);
+    int n = 19;
+    if (centesimi >= 0)
+    {
+        dest[19] = '.';
+        dest[20] = '0' + millisecondi / 100;
+        due_cifre(dest + 21, millisecondi % 100);
+        n = 23;
+    }
+    out->usati += n;
+}
+
+
+/**
+ * sequenza_utf8 dice quanti byte occupa il carattere UTF-8 valido che
+ * inizia in p, senza leggere oltre resto byte. Rifiuta le forme troppo
+ * lunghe, i surrogati e i valori oltre U+10FFFF.
+ *
+ * @returns La lunghezza del carattere, 0 se i byte non sono UTF-8 valido
+ */
+inline unsigned sequenza_utf8(const unsigned char *p, unsigned long resto)
+{
+    unsigned n;
+    uint32_t minimo, codice;
+    if (p[0] >= 0xc2 && p[0] <= 0xdf)
+        n = 2, minimo = 0x80, codice = p[0] & 0x1f;
+    else if (p[0] >= 0xe0 && p[0] <= 0xef)
+        n = 3, minimo = 0x800, codice = p[0] & 0x0f;
+    else if (p[0] >= 0xf0 && p[0] <= 0xf4)
+        n = 4, minimo = 0x10000, codice = p[0] & 0x07;
+    else
+        return 0;
+    if (n > resto)
+        return 0;
+
+    for (unsigned k = 1; k < n; k++)
+    {
+        if ((p[k] & 0xc0) != 0x80)
+            return 0;
+        codice = (codice << 6) | (p[k] & 0x3f);
+    }
+    if (codice < minimo || codice > 0x10ffff || (codice >= 0xd800 && codice <= 0xdfff))
+        return 0;
+    return n;
+}
+
+
+/**
+ * scrivi_stringa_json scrive una stringa tra virgolette. I tratti che non
+ * vanno protetti, quasi sempre tutta la stringa, si copiano con un memcpy.
+ * Un byte che non fa parte di UTF-8 valido, ad esempio un nome 8.3 nella
+ * code page OEM, diventa \u00XX: il JSON resta valido e il byte si
+ * ricava ancora dal testo.
+ */
+inline void scrivi_stringa_json(BufferUscita *out, const char *testo, unsigned long lunghezza)
+{
+    static const char esadecimali[] = "0123456789abcdef";
+
+    scrivi_testo(out, "\"", 1);
+    unsigned long inizio = 0;
+    for (unsigned long i = 0; i < lunghezza; i++)
+    {
+        unsigned char c = testo[i];
+        if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\')
+            continue;
+        if (c >= 0x80)
+        {
+            unsigned n = sequenza_utf8((const unsigned char *)testo + i, lunghezza - i);
+            if (n > 0)
+            {
+                i += n - 1;
+                continue;
+            }
+        }
+
+        scrivi_testo(out, testo + inizio, i - inizio);
+        char *dest = riserva(out, MARGINE_USCITA);
+        dest[0] = '\\';
+        if (c == '"' || c == '\\')
+        {
+            dest[1] = c;
+            out->usati += 2;
+        }
+        else
+        {
+            memcpy(dest + 1, "u00", 3);
+            dest[4] = esadecimali[c >> 4];
+            dest[5] = esadecimali[c & 0xf];
+            out->usati += 6;
+        }
+        inizio = i + 1;
+    }
+    scrivi_testo(out, testo + inizio, lunghezza - inizio);
+    scrivi_testo(out, "\"", 1);
+}
+
+
+/**
+ * scrivi_campo_csv scrive un campo secondo RFC 4180: tra virgolette, con le
+ * virgolette raddoppiate, solo se contiene separatori, virgolette o a capo.
+ */
+inline void scrivi_campo_csv(BufferUscita *out, const char *testo, unsigned long lunghezza)
+{
+    if (strcspn(testo, ",\"\r\n") >= lunghezza)
+    {
+        scrivi_testo(out, testo, lunghezza);
+        return;
+    }
+
+    scrivi_testo(out, "\"", 1);
+    unsigned long inizio = 0;
+    for (unsigned long i = 0; i < lunghezza; i++)
+        if (testo[i] == '"')
+        {
+            scrivi_testo(out, testo + inizio, i + 1 - inizio);
+            inizio = i;
+        }
+    scrivi_testo(out, testo + inizio, lunghezza - inizio);
+    scrivi_testo(out, "\"", 1);
+}
+
+
+// La riga di intestazione del CSV, negli stessi campi e nello stesso ordine del JSON
+#define INTESTAZIONE_CSV "percorso,nome_breve,directory,attributi,dimensione,primo_cluster,creazione,modifica,posizione\n"
+
+
+/**
+ * scrivi_voce scrive un record per la voce: un oggetto JSON su una riga o
+ * una riga CSV. Le date a zero, cioe' mai impostate, restano vuote (null).
+ */
+inline void scrivi_voce(BufferUscita *out, FormatoUscita formato, const Voce *voce)
+{
+    int json = formato == FORMATO_JSONL;
+
+    if (json)
+    {
+        scrivi_testo(out, "{\"percorso\":", 12);
+        scrivi_stringa_json(out, voce->percorso.data(), voce->percorso.size());
+        scrivi_testo(out, ",\"nome_breve\":", 14);
+        scrivi_stringa_json(out, voce->nome_breve, strlen(voce->nome_breve));
+        if (voce->attributi & ATTRIBUTO_DIRECTORY)
+            scrivi_testo(out, ",\"directory\":true,\"attributi\":", 30);
+        else
+            scrivi_testo(out, ",\"directory\":false,\"attributi\":", 31);
+    }
+    else
+    {
+        scrivi_campo_csv(out, voce->percorso.data(), voce->percorso.size());
+        scrivi_testo(out, ",", 1);
+        scrivi_campo_csv(out, voce->nome_breve, strlen(voce->nome_breve));
+        scrivi_testo(out, voce->attributi & ATTRIBUTO_DIRECTORY ? ",1," : ",0,", 3);
+    }
+
+    scrivi_intero(out, voce->attributi);
+    scrivi_testo(out, json ? ",\"dimensione\":" : ",", json ? 14 : 1);
+    scrivi_intero(out, voce->dimensione);
+    scrivi_testo(out, json ? ",\"primo_cluster\":" : ",", json ? 17 : 1);
+    scrivi_intero(out, voce->primo_cluster);
+
+    scrivi_testo(out, json ? ",\"creazione\":" : ",", json ? 13 : 1);
+    if (voce->data_creazione == 0)
+        scrivi_testo(out, "null", json ? 4 : 0);
+    else
+    {
+        scrivi_testo(out, "\"", json);
+        scrivi_data_ora(out, voce->data_creazione, voce->orario_creazione, voce->centesimi_creazione);
+        scrivi_testo(out, "\"", json);
+    }
+
+    scrivi_testo(out, json ? ",\"modifica\":" : ",", json ? 12 : 1);
+    if (voce->data_modifica == 0)
+        scrivi_testo(out, "null", json ? 4 : 0);
+    else
+    {
+        scrivi_testo(out, "\"", json);
+        scrivi_data_ora(out, voce->data_modifica, voce->orario_modifica, -1);
+        scrivi_testo(out, "\"", json);
+    }
+
+    scrivi_testo(out, json ? ",\"posizione\":" : ",", json ? 13 : 1);
+    scrivi_intero(out, voce->posizione);
+    scrivi_testo(out, json ? "}\n" : "\n", json ? 2 : 1);
+}
+
+#endif